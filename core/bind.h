@@ -2,13 +2,42 @@
 #define __PD_BIND_H__
 
 #include <stddef.h>
+#include <string>
+
+#define BIND_CONST 1 // results never change and do not depend on the arguments
 
 struct lua_State;
 
+// a host handler for one call type, returns the number of values it pushed onto L.
+typedef int (*bind_fn)(const char *data, const char *sign, lua_State *L);
+
+// a structured handler, args holds the call arguments wire encoded (see wire.h) and
+// the results are wire encoded into out, so tables, numbers and blobs cross as they are.
+// 0 fails the call, it returns nothing to lua.
+typedef int (*bind_wire_fn)(const char *args, size_t alen, std::string &out);
+
 int 
 bind_call(const char *type, const char *data, const char *sign, lua_State *L = nullptr);
 
 int
 bind_read(const char *path, size_t plen, lua_State *L = nullptr);
 
+// registers fn for type and returns its handle, nullptr fn hands the type back to bind_call.
+// handles are never reused and stay valid across loop_stop, loop_start and loop_reload.
+int
+bind_register(const char *type, bind_fn fn);
+
+// registers a structured handler. each lua state decodes the results of a BIND_CONST type
+// once and hands out the same values afterwards, tables among them must not be changed.
+int
+bind_register_wire(const char *type, bind_wire_fn fn, int flags = 0);
+
+// the handle of type, made on first use even when nothing is registered for it yet.
+int
+bind_handle(const char *type, size_t tlen);
+
+// calls the handler of handle, or bind_call with its type when there is none.
+int
+bind_invoke(int handle, const char *data, const char *sign, lua_State *L = nullptr);
+
 #endif //__PD_BIND_H__
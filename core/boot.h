@@ -1,14 +1,13 @@
 #ifndef __PD_BOOT_H__
 #define __PD_BOOT_H__
 
+// c modules become globals on first use, the ones in package.preload are opened right then.
 const char __LUA_BOOTSTRAP[] =
-"cbind = require('cbind')\n"
-"cjson = require('cjson')\n"
-"cutil = require('cutil')\n"
-"cfile = require('cfile')\n"
-"chttp = require('chttp')\n"
-"clink = require('clink')\n"
-"package.path = HOME .. '?.lua'"
-"load(cbind.read('boot.lua', 'boot.lua'))()";
+"local lazy = { cbind = true, cjson = true, cutil = true, cfile = true, chttp = true, clink = true, cwork = true, cprof = true, ctrace = true, cpkg = true, ckv = true }\n"
+"setmetatable(_G, { __index = function(g, k)\n"
+"\tif lazy[k] then local m = require(k); lazy[k] = nil; rawset(g, k, m); return m end\n"
+"end })\n"
+"package.path = HOME .. '?.lua'\n"
+"assert(cpkg.asset('boot.lua', '@boot.lua'))()";
 
 #endif //__PD_BOOT_H__
@@ -1,5 +1,8 @@
 #include <file.h>
-#include <http.h>
+#include <util.h>
+#include <log.h>
+#include <pool.h>
+#include <loop.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -16,23 +19,31 @@ extern "C" {
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <ctype.h>
+#include <limits.h>
+#include <chrono>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
 #ifdef _WIN32
 #include <direct.h>
 #include <io.h>
+#include <process.h>
 #include <sys/utime.h>
 #include <windows.h>
 #else //_WIN32
 #include <dirent.h>
 #include <utime.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #endif
-
-#ifdef ANDROID
-#include <android/log.h>
-#define lprint(...)  __android_log_print(ANDROID_LOG_ERROR, "daemon", "%s", __VA_ARGS__)
-#else //ANDROID
-#define lprint(...)  printf("%s", __VA_ARGS__)
-#endif//ANDROID
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif //__linux__
 
 #ifdef _WIN32
 #ifndef S_ISDIR
@@ -50,6 +61,12 @@ extern "C" {
 #ifndef S_ISFIFO
 #define S_ISFIFO(mode) (0)
 #endif
+#ifndef getpid
+#define getpid _getpid
+#endif
+#ifndef lstat
+#define lstat stat
+#endif
 #ifndef S_ISCHR
 #define S_ISCHR(mode) ((mode) & _S_IFCHR)
 #endif
@@ -71,44 +88,57 @@ typedef unsigned short mode_t;
 #endif //_WIN32
 
 static const char  *__DIR_METATABLE = "__DIR_METATABLE__";
-static const size_t __LOG_HEAD_SIZE = 17;
+
+struct stat_entry
+{
+	struct stat _st;
+	int         _ok; // 0 for a path that does not exist
+	int         _wd; // watch of the parent directory, -1 where FILE_TTL applies rather than FILE_WTTL
+	uint64_t    _at;
+};
 
 struct file_data 
 {
 	char   _home[PATH_SIZE];
-	char   _temp[PATH_SIZE];
 	size_t _hlen;
 
-	size_t _lmask;
-	FILE  *_lfile;
-	char   _lpath[PATH_SIZE];
-	size_t _lplen;
-	char   _lpush[PATH_SIZE];
-	size_t _lulen;
-	char   _lbuff[1 << 16];
-	size_t _lblen;
-	char   _ldate[8]; // "yyyymmdd"
-
-	file_data() : _hlen(0), _lmask(0xff), _lfile(nullptr), _lplen(0), _lulen(0), _lblen(0)
+	// stat cache, see __file_stat.
+	std::mutex                                        _slock;
+	std::unordered_map<std::string, stat_entry>       _stats;
+	std::map<std::string, int>                        _wds; // ordered, see __stat_drop
+	std::unordered_map<int, std::vector<std::string>> _dirs;
+	int                                               _notify;
+	bool                                              _scache;
+	uint64_t                                          _hits;
+	uint64_t                                          _misses;
+
+	// paths file_write already looked for leftover temps of.
+	std::mutex                                        _wlock;
+	std::unordered_set<std::string>                   _swept;
+
+	file_data() : _hlen(0), _notify(-1), _scache(true), _hits(0), _misses(0)
 	{
 		this->_home[0] = '\0';
-		this->_temp[0] = '\0';
-		this->_lpath[0] = '\0';
-		this->_lpush[0] = '\0';
-		this->_lbuff[0] = '\0';
-		this->_ldate[0] = '\0';
+#ifdef __linux__
+		this->_notify = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif //__linux__
 	}
 
 	~file_data()
 	{
-		if (nullptr != this->_lfile) {
-			::fclose(this->_lfile);
+#ifndef _WIN32
+		if (this->_notify >= 0) {
+			::close(this->_notify);
 		}
+#endif //_WIN32
 	}
 };
 
 static file_data * _F = nullptr;
 
+// full paths are built per thread, cfile is also opened in worker states.
+static THREAD_LOCAL char __file_temp[PATH_SIZE];
+
 static inline char*
 __file_fullpath(char *path, size_t plen, size_t *flen)
 {
@@ -116,12 +146,13 @@ __file_fullpath(char *path, size_t plen, size_t *flen)
 	size_t fl = plen;
 
 	if ('/' != path[0]) {
-		fp = _F->_temp;
+		fp = __file_temp;
 		fl = _F->_hlen;
-		if (fl + plen < sizeof(_F->_temp)) {
+		memcpy(fp, _F->_home, fl);
+		if (fl + plen < sizeof(__file_temp)) {
 			memcpy(fp + fl, path, plen); fl += plen;
-			_F->_temp[fl] = '\0';
 		}
+		__file_temp[fl] = '\0';
 	}
 
 	if (nullptr != flen) { *flen = fl; }
@@ -156,6 +187,212 @@ __file_basename(const char *path, size_t plen)
 	return t - h;
 }
 
+static uint64_t
+__file_ms(void)
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// stat results of paths under home, for cfile.check and cfile.attr. where the parent directory
+// has an inotify watch an entry holds until an event drops it or for FILE_WTTL ms, otherwise
+// for FILE_TTL ms. a watch hears nothing when a directory above it is renamed or replaced.
+// events are drained before every lookup, so even writes made just before are seen.
+static void
+__stat_prefix(const std::string &dir)
+{
+	std::string head = dir + "/";
+	for (auto it = _F->_stats.begin(); it != _F->_stats.end(); ) {
+		if (0 == it->first.compare(0, head.size(), head)) {
+			it = _F->_stats.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+#ifdef __linux__
+static void
+__stat_unwatch(int wd)
+{
+	auto it = _F->_dirs.find(wd);
+	if (_F->_dirs.end() == it) {
+		return;
+	}
+	for (auto &dir : it->second) {
+		_F->_wds.erase(dir);
+		__stat_prefix(dir);
+	}
+	_F->_dirs.erase(it);
+}
+
+static void
+__stat_drain(void)
+{
+	if (_F->_notify < 0) {
+		return;
+	}
+
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t n = 0;
+	while (0 < (n = ::read(_F->_notify, buf, sizeof(buf)))) {
+		for (char *p = buf; p < buf + n; ) {
+			struct inotify_event *ev = (struct inotify_event*)p;
+			p += sizeof(struct inotify_event) + ev->len;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				_F->_stats.clear();
+			} else if (ev->mask & (IN_IGNORED | IN_MOVE_SELF | IN_DELETE_SELF)) {
+				// the directory is gone or somewhere else now, its path means nothing.
+				if (ev->mask & IN_MOVE_SELF) {
+					::inotify_rm_watch(_F->_notify, ev->wd);
+				}
+				__stat_unwatch(ev->wd);
+			} else if (ev->len > 0) {
+				auto it = _F->_dirs.find(ev->wd);
+				if (_F->_dirs.end() != it) {
+					for (auto &dir : it->second) {
+						std::string key = dir + "/" + ev->name;
+						_F->_stats.erase(key);
+						if (ev->mask & IN_ISDIR) {
+							__stat_prefix(key);
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+static int
+__stat_watch(const std::string &dir)
+{
+	auto it = _F->_wds.find(dir);
+	if (_F->_wds.end() != it) {
+		return it->second;
+	}
+	if (_F->_notify < 0 || _F->_wds.size() >= FILE_WATCHES) {
+		return -1;
+	}
+
+	int wd = ::inotify_add_watch(_F->_notify, dir.c_str(), IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+	if (wd < 0) {
+		return -1;
+	}
+	// the same directory spelled another way gets the same wd.
+	_F->_wds[dir] = wd;
+	_F->_dirs[wd].push_back(dir);
+	return wd;
+}
+#else //__linux__
+static void
+__stat_drain(void)
+{
+}
+
+static int
+__stat_watch(const std::string &dir)
+{
+	(void)dir;
+	return -1;
+}
+#endif //__linux__
+
+// stat through the cache, 0 or -1 and errno like stat.
+static int
+__file_stat(const char *fpath, size_t flen, struct stat *st)
+{
+	if (nullptr == _F || !_F->_scache || flen <= _F->_hlen || 0 != memcmp(fpath, _F->_home, _F->_hlen)) {
+		return stat(fpath, st);
+	}
+	size_t dlen = __file_dirname(fpath, flen);
+	size_t blen = __file_basename(fpath, flen);
+	if (0 == dlen || blen + 1 >= flen) {
+		return stat(fpath, st);
+	}
+
+	std::string dir(fpath, dlen), key = dir;
+	key.append("/").append(fpath + blen + 1, flen - blen - 1);
+
+	std::lock_guard<std::mutex> lock(_F->_slock);
+	__stat_drain();
+
+	uint64_t now = __file_ms();
+	auto it = _F->_stats.find(key);
+	if (_F->_stats.end() != it && now - it->second._at < (it->second._wd >= 0 ? FILE_WTTL : FILE_TTL)) {
+		++_F->_hits;
+		if (0 != it->second._ok) {
+			*st = it->second._st;
+			return 0;
+		}
+		errno = ENOENT;
+		return -1;
+	}
+
+	++_F->_misses;
+	// watched first, a change between the stat and the watch would be lost otherwise.
+	int wd = __stat_watch(dir);
+	int ret = stat(fpath, st);
+	if (0 != ret && ENOENT != errno) {
+		return ret;
+	}
+	if (_F->_stats.size() >= FILE_STATS) {
+		_F->_stats.clear();
+	}
+	stat_entry &e = _F->_stats[key];
+	e._ok = 0 == ret ? 1 : 0;
+	if (0 == ret) {
+		e._st = *st;
+	}
+	e._wd = wd;
+	e._at = now;
+	return ret;
+}
+
+// drops what the calling thread itself changed, for the entries only the ttl keeps. called
+// after the change, a stat racing with it could cache the old state again otherwise. entries
+// below the path are only swept when it is a cached directory or has a watch at or below it,
+// the others expire with the ttl.
+static void
+__stat_drop(const char *fpath, size_t flen)
+{
+	if (nullptr == _F || !_F->_scache) {
+		return;
+	}
+	size_t dlen = __file_dirname(fpath, flen);
+	size_t blen = __file_basename(fpath, flen);
+	if (0 == dlen || blen + 1 >= flen) {
+		return;
+	}
+
+	std::string key(fpath, dlen);
+	key.append("/").append(fpath + blen + 1, flen - blen - 1);
+	std::lock_guard<std::mutex> lock(_F->_slock);
+	bool dir = _F->_wds.end() != _F->_wds.find(key);
+	if (!dir) {
+		std::string head = key + "/";
+		auto w = _F->_wds.lower_bound(head);
+		dir = _F->_wds.end() != w && 0 == w->first.compare(0, head.size(), head);
+	}
+	auto it = _F->_stats.find(key);
+	if (_F->_stats.end() != it) {
+		dir = dir || (0 != it->second._ok && S_ISDIR(it->second._st.st_mode));
+		_F->_stats.erase(it);
+	}
+	if (dir) {
+		__stat_prefix(key);
+	}
+}
+
+static void
+__stat_clear(void)
+{
+	if (nullptr == _F) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(_F->_slock);
+	_F->_stats.clear();
+}
+
 static inline int
 __file_mkdir(char *path, size_t plen)
 {
@@ -192,74 +429,6 @@ __file_mkdir(char *path, size_t plen)
 	return ret;
 }
 
-void
-__rmdir_r(char *path, size_t plen)
-{
-	struct stat st;
-	if (0 == stat(path, &st)) {
-		if (S_ISDIR(st.st_mode)) {
-#ifdef _WIN32
-			struct _finddata_t fd;
-			char *ft = path + plen;
-			char kp[] = { ft[0], ft[1], ft[2] };
-			ft[0] = '/'; ft[1] = '*'; ft[2] = '\0'; 
-			long fh = ::_findfirst(path, &fd);
-			ft[0] = kp[0]; ft[1] = kp[1]; ft[2] = kp[2]; 
-			if (-1 != fh) {
-				do {
-					if (0 != strcmp(".", fd.name) && 0 != strcmp("..", fd.name) ) {
-						size_t dlen = strlen(fd.name);
-						size_t nlen = plen + dlen + 1;
-						assert(nlen < PATH_SIZE);
-						if (nlen < PATH_SIZE) {
-							path[plen] = '/';
-							memcpy(path + plen + 1, fd.name, dlen);
-							path[nlen] = '\0';
-							__rmdir_r(path, nlen);
-						}
-					}
-				} while (0 == ::_findnext(fh, &fd));
-
-				::_findclose(fh);
-			}
-#else //_WIN32
-			DIR *dp = ::opendir(path);
-			if (nullptr != dp) {
-				dirent *ep;
-				while (nullptr != (ep = ::readdir(dp))) {
-					if (0 != strcmp(".", ep->d_name) && 0 != strcmp("..", ep->d_name)) {
-						size_t dlen = strlen(ep->d_name);
-						size_t nlen = plen + dlen + 1;
-						assert(nlen < PATH_SIZE);
-						if (nlen < PATH_SIZE) {
-							path[plen] = '/';
-							memcpy(path + plen + 1, ep->d_name, dlen);
-							path[nlen] = '\0';
-							__rmdir_r(path, nlen);
-						}
-					}
-				}
-			}
-			::closedir(dp);
-#endif //_WIN32
-			path[plen] = '\0';
-			rmdir(path);
-		} else {
-			unlink(path);
-		}
-	}
-}
-
-static inline int
-__file_rmdir(char *path, size_t plen)
-{
-	size_t flen = 0;
-	char *fpath = (char*)__file_fullpath(path, plen, &flen);
-
-	__rmdir_r(fpath, flen);
-	return 1;
-}
-
 static inline int
 __file_utime(char *path, size_t plen, time_t mtime, time_t atime)
 {
@@ -267,7 +436,9 @@ __file_utime(char *path, size_t plen, time_t mtime, time_t atime)
 	const char *fpath = __file_fullpath(path, plen, &flen);
 
 	utimbuf ub; ub.actime = atime; ub.modtime = mtime;
-	return 0 == utime(fpath, &ub) ? 1 : 0;
+	int ret = 0 == utime(fpath, &ub) ? 1 : 0;
+	__stat_drop(fpath, flen);
+	return ret;
 }
 
 static inline int
@@ -277,53 +448,7 @@ __file_check(char *path, size_t plen, size_t fsize, time_t mtime)
 	const char *fpath = __file_fullpath(path, plen, &flen);
 
 	struct stat st;
-	return (0 == stat(fpath, &st) && (0 == fsize || fsize == st.st_size) && (0 == mtime || mtime == st.st_mtime)) ? 1 : 0;
-}
-
-static inline int
-__file_log(int lv, int dlen)
-{
-	if (nullptr == _F || 0 == (_F->_lmask & (1 << lv))) {
-		return 0;
-	}
-
-	char lvs[LOG_MAX] = { 'D', 'I', 'W', 'E', 'F' };
-	_F->_lblen = 0;
-	_F->_lbuff[_F->_lblen++] = lvs[lv];
-	_F->_lbuff[_F->_lblen++] = LOG_SPLIT;
-
-	time_t now = ::time(NULL);
-	_F->_lblen += strftime(_F->_lbuff + _F->_lblen , sizeof(_F->_lbuff) - _F->_lblen, "%Y%m%d%H%M%S", localtime(&now));
-	_F->_lbuff[_F->_lblen++] = LOG_SPLIT;
-	_F->_lblen += dlen;
-	_F->_lbuff[_F->_lblen++] = '\n';
-
-	if (_F->_lplen > 0 && _F->_lblen > 0 && _F->_lblen < sizeof(_F->_lbuff) - 1) {
-		if (0 != memcmp(_F->_ldate, _F->_lbuff + 2, sizeof(_F->_ldate))) {
-			memcpy(_F->_ldate, _F->_lbuff + 2, sizeof(_F->_ldate));
-			char *p = _F->_lpath + _F->_lplen;
-			memcpy(p, _F->_ldate, sizeof(_F->_ldate)); p += sizeof(_F->_ldate);
-			*p++ = '.'; *p++ = 't'; *p++ = 'x'; *p++ = 't'; *p++ = '\0';
-
-			if (nullptr != _F->_lfile) {
-				::fclose(_F->_lfile); _F->_lfile = nullptr;
-			}
-		}
-		if (nullptr == _F->_lfile) {
-			_F->_lfile = ::fopen(_F->_lpath, "at");
-		}
-		if (nullptr != _F->_lfile) {
-			::fwrite(_F->_lbuff, 1, _F->_lblen, _F->_lfile);
-		}
-
-		if (_F->_lulen > 0) {
-			http_push(_F->_lpush, _F->_lulen, _F->_lbuff, _F->_lblen);
-		}
-
-		_F->_lbuff[_F->_lblen] = '\0'; lprint(_F->_lbuff);
-	}
-
-	return 1;
+	return (0 == __file_stat(fpath, flen, &st) && (0 == fsize || (st.st_size >= 0 && fsize == (size_t)st.st_size)) && (0 == mtime || mtime == st.st_mtime)) ? 1 : 0;
 }
 
 struct dir_data 
@@ -331,7 +456,7 @@ struct dir_data
 	char   _path[PATH_SIZE];
 	size_t _plen;
 #ifdef _WIN32
-	long   _dir;
+	intptr_t _dir;
 #else //_WIN32
 	DIR   *_dir;
 #endif //_WIN32
@@ -450,102 +575,132 @@ __l2c_dir(lua_State *L)
 	return 2;
 }
 
+// attribute fields, cfile.attr and cfile.list take them as a string of the keys, "mdsz" or "md,sz,mt".
+enum {
+	FILE_MD  = 1 << 0,  // mode
+	FILE_SZ  = 1 << 1,  // size
+	FILE_DV  = 1 << 2,  // dev
+	FILE_NO  = 1 << 3,  // inode
+	FILE_NL  = 1 << 4,  // nlink
+	FILE_CT  = 1 << 5,  // ctime
+	FILE_MT  = 1 << 6,  // mtime
+	FILE_AT  = 1 << 7,  // atime
+	FILE_UI  = 1 << 8,  // uid
+	FILE_GI  = 1 << 9,  // gid
+	FILE_PM  = 1 << 10, // permissions
+	FILE_ALL = (1 << 11) - 1,
+};
+
+static const char *__FILE_FIELDS[] = { "md", "sz", "dv", "no", "nl", "ct", "mt", "at", "ui", "gi", "pm" };
+
 static int
-__l2c_pushattr(lua_State *L, char *path, size_t plen)
+__file_fields(lua_State *L, int idx)
 {
-	lua_newtable(L);
+	if (lua_isnoneornil(L, idx)) {
+		return FILE_ALL;
+	}
 
-	struct stat st;
-	if (0 != stat(path, &st)) {
+	size_t flen = 0;
+	const char *fields = luaL_checklstring(L, idx, &flen);
+	int mask = 0;
+	for (size_t i = 0; i < flen; ) {
+		if (',' == fields[i] || ' ' == fields[i]) {
+			++i; continue;
+		}
+		int bit = -1;
+		for (int f = 0; f < (int)(sizeof(__FILE_FIELDS) / sizeof(__FILE_FIELDS[0])) && i + 1 < flen; ++f) {
+			if (__FILE_FIELDS[f][0] == fields[i] && __FILE_FIELDS[f][1] == fields[i + 1]) {
+				bit = f; break;
+			}
+		}
+		if (bit < 0) {
+			return luaL_argerror(L, idx, lua_pushfstring(L, "unknown field at '%s'", fields + i));
+		}
+		mask |= 1 << bit;
+		i += 2;
+	}
+	return mask;
+}
+
+static int
+__file_popcount(int mask)
+{
+	int n = 0;
+	for (; 0 != mask; mask &= mask - 1) ++n;
+	return n;
+}
+
+static void
+__file_pushfield(lua_State *L, int field, lua_Number value)
+{
+	lua_pushlstring(L, __FILE_FIELDS[field], 2);
+	lua_pushnumber(L, value);
+	lua_rawset(L, -3);
+}
+
+static int
+__file_pushstat(lua_State *L, const struct stat *st, int mask)
+{
+	lua_createtable(L, 0, __file_popcount(mask));
+	if (nullptr == st) {
 		return 1;
 	}
 
 	// mode
-	lua_pushlstring (L, "md", 2);
-	const char *mode = "o";
-	if (S_ISREG(st.st_mode)) {
-		mode = "f";
-	} else if (S_ISDIR(st.st_mode)) {
-		mode = "d";
-	} else if (S_ISLNK(st.st_mode)) {
-		mode = "l";
-	} else if (S_ISSOCK(st.st_mode)) {
-		mode = "s";
-	} else if (S_ISFIFO(st.st_mode)) {
-		mode = "p";
-	} else if (S_ISCHR(st.st_mode)) {
-		mode = "c";
-	} else if (S_ISBLK(st.st_mode)) {
-		mode = "b";
-	}
-	lua_pushlstring(L, mode, 1);
-	lua_rawset (L, -3);
-
-	// size
-	lua_pushlstring (L, "sz", 2);
-	lua_pushnumber (L, (lua_Number)st.st_size);
-	lua_rawset (L, -3);
-
-	// dev
-	lua_pushlstring (L, "dv", 2);
-	lua_pushnumber (L, (lua_Number)st.st_dev);
-	lua_rawset (L, -3);
-
-	// inode
-	lua_pushlstring (L, "no", 2);
-	lua_pushnumber (L, (lua_Number)st.st_ino);
-	lua_rawset (L, -3);
-
-	// nlink
-	lua_pushlstring (L, "nl", 2);
-	lua_pushnumber (L, (lua_Number)st.st_nlink);
-	lua_rawset (L, -3);
-
-	// ctime
-	lua_pushlstring (L, "ct", 2);
-	lua_pushnumber (L, (lua_Number)st.st_ctime);
-	lua_rawset (L, -3);
-
-	// mtime
-	lua_pushlstring (L, "mt", 2);
-	lua_pushnumber (L, (lua_Number)st.st_mtime);
-	lua_rawset (L, -3);
-
-	// atime
-	lua_pushlstring (L, "at", 2);
-	lua_pushnumber (L, (lua_Number)st.st_atime);
-	lua_rawset (L, -3);
-
-	// uid
-	lua_pushlstring (L, "ui", 2);
-	lua_pushnumber (L, (lua_Number)st.st_uid);
-	lua_rawset (L, -3);
-
-	// uid
-	lua_pushlstring (L, "gi", 2);
-	lua_pushnumber (L, (lua_Number)st.st_gid);
-	lua_rawset (L, -3);
+	if (mask & FILE_MD) {
+		lua_pushlstring (L, "md", 2);
+		const char *mode = "o";
+		if (S_ISREG(st->st_mode)) {
+			mode = "f";
+		} else if (S_ISDIR(st->st_mode)) {
+			mode = "d";
+		} else if (S_ISLNK(st->st_mode)) {
+			mode = "l";
+		} else if (S_ISSOCK(st->st_mode)) {
+			mode = "s";
+		} else if (S_ISFIFO(st->st_mode)) {
+			mode = "p";
+		} else if (S_ISCHR(st->st_mode)) {
+			mode = "c";
+		} else if (S_ISBLK(st->st_mode)) {
+			mode = "b";
+		}
+		lua_pushlstring(L, mode, 1);
+		lua_rawset (L, -3);
+	}
+
+	if (mask & FILE_SZ) __file_pushfield(L, 1, (lua_Number)st->st_size);
+	if (mask & FILE_DV) __file_pushfield(L, 2, (lua_Number)st->st_dev);
+	if (mask & FILE_NO) __file_pushfield(L, 3, (lua_Number)st->st_ino);
+	if (mask & FILE_NL) __file_pushfield(L, 4, (lua_Number)st->st_nlink);
+	if (mask & FILE_CT) __file_pushfield(L, 5, (lua_Number)st->st_ctime);
+	if (mask & FILE_MT) __file_pushfield(L, 6, (lua_Number)st->st_mtime);
+	if (mask & FILE_AT) __file_pushfield(L, 7, (lua_Number)st->st_atime);
+	if (mask & FILE_UI) __file_pushfield(L, 8, (lua_Number)st->st_uid);
+	if (mask & FILE_GI) __file_pushfield(L, 9, (lua_Number)st->st_gid);
 
 	// permissions
-	lua_pushlstring (L, "pm", 2);
-	char perms[10] = "---------";
+	if (mask & FILE_PM) {
+		lua_pushlstring (L, "pm", 2);
+		char perms[10] = "---------";
 #ifdef _WIN32
-	if (st.st_mode & _S_IREAD) { perms[0] = 'r'; perms[3] = 'r'; perms[6] = 'r'; }
-	if (st.st_mode & _S_IWRITE) { perms[1] = 'w'; perms[4] = 'w'; perms[7] = 'w'; }
-	if (st.st_mode & _S_IEXEC) { perms[2] = 'x'; perms[5] = 'x'; perms[8] = 'x'; }
+		if (st->st_mode & _S_IREAD) { perms[0] = 'r'; perms[3] = 'r'; perms[6] = 'r'; }
+		if (st->st_mode & _S_IWRITE) { perms[1] = 'w'; perms[4] = 'w'; perms[7] = 'w'; }
+		if (st->st_mode & _S_IEXEC) { perms[2] = 'x'; perms[5] = 'x'; perms[8] = 'x'; }
 #else
-	if (st.st_mode & S_IRUSR) perms[0] = 'r';
-	if (st.st_mode & S_IWUSR) perms[1] = 'w';
-	if (st.st_mode & S_IXUSR) perms[2] = 'x';
-	if (st.st_mode & S_IRGRP) perms[3] = 'r';
-	if (st.st_mode & S_IWGRP) perms[4] = 'w';
-	if (st.st_mode & S_IXGRP) perms[5] = 'x';
-	if (st.st_mode & S_IROTH) perms[6] = 'r';
-	if (st.st_mode & S_IWOTH) perms[7] = 'w';
-	if (st.st_mode & S_IXOTH) perms[8] = 'x';
+		if (st->st_mode & S_IRUSR) perms[0] = 'r';
+		if (st->st_mode & S_IWUSR) perms[1] = 'w';
+		if (st->st_mode & S_IXUSR) perms[2] = 'x';
+		if (st->st_mode & S_IRGRP) perms[3] = 'r';
+		if (st->st_mode & S_IWGRP) perms[4] = 'w';
+		if (st->st_mode & S_IXGRP) perms[5] = 'x';
+		if (st->st_mode & S_IROTH) perms[6] = 'r';
+		if (st->st_mode & S_IWOTH) perms[7] = 'w';
+		if (st->st_mode & S_IXOTH) perms[8] = 'x';
 #endif
-	lua_pushlstring(L, perms, 9);
-	lua_rawset (L, -3);
+		lua_pushlstring(L, perms, 9);
+		lua_rawset (L, -3);
+	}
 
 	return 1;
 }
@@ -555,73 +710,124 @@ __l2c_attr(lua_State *L)
 {
 	size_t plen = 0;
 	const char *path = luaL_checklstring(L, 1, &plen);
+	int mask = __file_fields(L, 2);
 	size_t flen = 0;
 	char *fpath = __file_fullpath((char*)path, plen, &flen);
 
-	return __l2c_pushattr(L, fpath, flen);
+	struct stat st;
+	return __file_pushstat(L, 0 == __file_stat(fpath, flen, &st) ? &st : nullptr, mask);
 }
 
+// cfile.list(path[, fields]), name -> attr table of the fields asked for, all of them by default.
+// names are gathered first so the result table is made at its final size, and entries are
+// only stat'ed when a field needs it: the mode alone comes from the directory entry.
 static int
 __l2c_list(lua_State *L)
 {
 	size_t plen = 0;
 	const char *path = luaL_checklstring(L, 1, &plen);
+	int mask = __file_fields(L, 2);
 	size_t flen = 0;
 	char *fpath = __file_fullpath((char*)path, plen, &flen);
+	if (flen >= PATH_SIZE) {
+		return 0;
+	}
+
+#ifdef _WIN32
+	// the find data has the mode, size and times already.
+	const int found = FILE_MD | FILE_SZ | FILE_CT | FILE_MT | FILE_AT;
+	char full[PATH_SIZE + 2];
+	memcpy(full, fpath, flen);
+	full[flen] = '/'; full[flen + 1] = '*'; full[flen + 2] = '\0';
 
 	struct stat st;
 	if (0 != stat(fpath, &st) || 0 == S_ISDIR(st.st_mode)) {
 		return 0;
 	}
 
-	lua_newtable(L);
-
-#ifdef _WIN32
+	std::vector<struct _finddata_t> finds;
 	struct _finddata_t fd;
-	char *ft = fpath + flen;
-	char kp[] = { ft[0], ft[1], ft[2] };
-	ft[0] = '/'; ft[1] = '*'; ft[2] = '\0'; 
-	long fh = ::_findfirst(fpath, &fd);
-	ft[0] = kp[0]; ft[1] = kp[1]; ft[2] = kp[2]; 
+	intptr_t fh = ::_findfirst(full, &fd);
 	if (-1 != fh) {
 		do {
-			if (0 != strcmp(".", fd.name) && 0 != strcmp("..", fd.name) ) {
-				size_t dlen = strlen(fd.name);
-				size_t nlen = flen + dlen + 1;
-				assert(nlen < PATH_SIZE);
-				if (nlen < PATH_SIZE) {
-					fpath[flen] = '/';
-					memcpy(fpath + flen + 1, fd.name, dlen);
-					fpath[nlen] = '\0';
-
-					lua_pushlstring(L, fd.name, dlen);
-					__l2c_pushattr(L, fpath, nlen);
-					lua_rawset (L, -3);
-				}
+			if (0 != strcmp(".", fd.name) && 0 != strcmp("..", fd.name)) {
+				finds.push_back(fd);
 			}
 		} while (0 == ::_findnext(fh, &fd));
-
 		::_findclose(fh);
 	}
-#else //_WIN32
-	DIR *dp = ::opendir(path);
-	if (nullptr != dp) {
-		dirent *ep;
-		while (nullptr != (ep = ::readdir(dp))) {
-			if (0 != strcmp(".", ep->d_name) && 0 != strcmp("..", ep->d_name)) {
-				size_t dlen = strlen(ep->d_name);
-				size_t nlen = flen + dlen + 1;
-				assert(nlen < PATH_SIZE);
-				if (nlen < PATH_SIZE) {
-					fpath[flen] = '/';
-					memcpy(fpath + flen + 1, ep->d_name, dlen);
-					fpath[nlen] = '\0';
-					lua_pushlstring(L, ep->d_name, dlen);
-					__l2c_pushattr(L, fpath, nlen);
-					lua_rawset (L, -3);
-				}
+
+	lua_createtable(L, 0, (int)finds.size());
+	for (size_t i = 0; i < finds.size(); ++i) {
+		const struct _finddata_t &f = finds[i];
+		size_t dlen = strlen(f.name);
+		lua_pushlstring(L, f.name, dlen);
+		if (0 == (mask & ~found)) {
+			memset(&st, 0, sizeof(st));
+			st.st_mode = (f.attrib & _A_SUBDIR) ? _S_IFDIR : _S_IFREG;
+			st.st_size = f.size;
+			st.st_ctime = f.time_create;
+			st.st_mtime = f.time_write;
+			st.st_atime = f.time_access;
+			__file_pushstat(L, &st, mask);
+		} else {
+			size_t nlen = flen + dlen + 1;
+			if (nlen < PATH_SIZE) {
+				memcpy(full + flen + 1, f.name, dlen + 1);
 			}
+			__file_pushstat(L, nlen < PATH_SIZE && 0 == stat(full, &st) ? &st : nullptr, mask);
+		}
+		lua_rawset (L, -3);
+	}
+#else //_WIN32
+	DIR *dp = ::opendir(fpath);
+	if (nullptr == dp) {
+		return 0;
+	}
+
+	// name '\0' type, one after the other.
+	std::string names;
+	int count = 0;
+
+	dirent *ep;
+	while (nullptr != (ep = ::readdir(dp))) {
+		const char *n = ep->d_name;
+		if ('.' == n[0] && ('\0' == n[1] || ('.' == n[1] && '\0' == n[2]))) {
+			continue;
+		}
+		names.append(n).push_back('\0');
+		names.push_back((char)ep->d_type);
+		++count;
+	}
+
+	lua_createtable(L, 0, count);
+	int fd = dirfd(dp);
+	struct stat st;
+	for (size_t i = 0; i < names.size(); ) {
+		const char *n = names.data() + i;
+		size_t dlen = strlen(n);
+		unsigned char type = (unsigned char)n[dlen + 1];
+		i += dlen + 2;
+
+		lua_pushlstring(L, n, dlen);
+		// a link or a file system without d_type still needs the stat, it follows links.
+		mode_t mode = 0;
+		switch (type) {
+		case DT_REG:  mode = S_IFREG; break;
+		case DT_DIR:  mode = S_IFDIR; break;
+		case DT_SOCK: mode = S_IFSOCK; break;
+		case DT_FIFO: mode = S_IFIFO; break;
+		case DT_CHR:  mode = S_IFCHR; break;
+		case DT_BLK:  mode = S_IFBLK; break;
 		}
+		if (0 == (mask & ~FILE_MD) && (0 != mode || 0 == mask)) {
+			memset(&st, 0, sizeof(st));
+			st.st_mode = mode;
+			__file_pushstat(L, &st, mask);
+		} else {
+			__file_pushstat(L, 0 == ::fstatat(fd, n, &st, 0) ? &st : nullptr, mask);
+		}
+		lua_rawset (L, -3);
 	}
 	::closedir(dp);
 #endif //_WIN32
@@ -629,80 +835,1300 @@ __l2c_list(lua_State *L)
 	return 1;
 }
 
+// glob over a name: * any run, ? any char, [a-z] [!x] a class.
 static int
-__l2c_dirname(lua_State *L)
+__file_glob(const char *p, const char *s)
 {
-	size_t plen = 0;
-	const char *path = luaL_checklstring(L, 1, &plen);
-	size_t dlen = __file_dirname(path, plen);
-	if (0 == dlen) {
-		return 0;
+	const char *bp = nullptr, *bs = nullptr;
+	while ('\0' != *s) {
+		if ('*' == *p) {
+			bp = ++p; bs = s;
+			continue;
+		}
+		if ('?' == *p) {
+			++p; ++s;
+			continue;
+		}
+		if ('[' == *p) {
+			const char *q = p + 1;
+			int neg = ('!' == *q || '^' == *q) ? 1 : 0;
+			q += neg;
+			int hit = 0;
+			do {
+				if ('-' == q[1] && ']' != q[2] && '\0' != q[2]) {
+					hit |= (*s >= q[0] && *s <= q[2]) ? 1 : 0; q += 3;
+				} else {
+					hit |= (*s == *q) ? 1 : 0; ++q;
+				}
+			} while ('\0' != *q && ']' != *q);
+			if (']' == *q && hit != neg) {
+				p = q + 1; ++s;
+				continue;
+			}
+		} else if (*p == *s) {
+			++p; ++s;
+			continue;
+		}
+		if (nullptr == bp) {
+			return 0;
+		}
+		p = bp; s = ++bs;
 	}
-
-	lua_pushlstring(L, path, dlen);
-	return 1;
+	while ('*' == *p) ++p;
+	return '\0' == *p ? 1 : 0;
 }
 
-static int
-__l2c_mkdir(lua_State *L)
+struct walk_item
 {
-	size_t plen = 0;
-	const char *path = luaL_checklstring(L, 1, &plen);
-	int ret = __file_mkdir((char*)path, plen);
+	std::string _path;
+	struct stat _st;
+	int         _ok;
+};
 
-	lua_pushboolean(L, ret);
-	return 1;
-}
+typedef std::vector<walk_item> walk_items;
 
-static int
-__l2c_rmdir(lua_State *L)
+struct walk_data
 {
-	size_t plen = 0;
-	const char *path = luaL_checklstring(L, 1, &plen);
-	int ret = __file_rmdir((char*)path, plen);
+	std::string              _root;
+#ifndef _WIN32
+	int                      _fd;
+#endif //_WIN32
+	int                      _mask;
+	int                      _depth;
+	int                      _dirs;
+	size_t                   _batch;
+	int                      _threads;
+	std::string              _glob;
+	std::vector<std::string> _exts;
+
+	// async walks, the last task to finish posts the final batch.
+	std::mutex               _lock;
+	walk_items               _items;
+	int                      _pending;
+	int                      _running;
+	int                      _lfun;
+
+	walk_data(void) : 
+#ifndef _WIN32
+		_fd(-1), 
+#endif //_WIN32
+		_mask(FILE_ALL), _depth(-1), _dirs(0), _batch(512), _threads(1), _pending(0), _running(0), _lfun(LUA_NOREF)
+	{
+	}
 
-	lua_pushboolean(L, ret);
-	return 1;
-}
+	~walk_data(void)
+	{
+#ifndef _WIN32
+		if (this->_fd >= 0) {
+			::close(this->_fd);
+		}
+#endif //_WIN32
+	}
+};
 
 static int
-__l2c_utime(lua_State *L)
+__walk_match(walk_data *w, const char *name, size_t nlen)
 {
-	size_t plen = 0;
-	const char *path = luaL_checklstring(L, 1, &plen);
-	time_t mtime = (time_t)luaL_checklong(L, 2);
-	time_t atime = (time_t)luaL_checklong(L, 3);
-	int ret = __file_utime((char*)path, plen, mtime, atime);
-
-	lua_pushboolean(L, ret);
-	return 1;
+	if (!w->_glob.empty() && !__file_glob(w->_glob.c_str(), name)) {
+		return 0;
+	}
+	if (w->_exts.empty()) {
+		return 1;
+	}
+	for (auto &it : w->_exts) {
+		size_t elen = it.size();
+		if (nlen > elen && '.' == name[nlen - elen - 1]) {
+			size_t i = 0;
+			for (; i < elen && tolower((unsigned char)name[nlen - elen + i]) == tolower((unsigned char)it[i]); ++i);
+			if (i == elen) {
+				return 1;
+			}
+		}
+	}
+	return 0;
 }
 
-static int
-__l2c_check(lua_State *L)
+static void
+__walk_push(lua_State *L, walk_data *w, walk_items &items)
 {
-	size_t plen = 0;
-	const char *path = luaL_checklstring(L, 1, &plen);
-	size_t fsize = (size_t)luaL_checklong(L, 2);
-	time_t mtime = (time_t)luaL_checklong(L, 3);
-	int ret = __file_check((char*)path, plen, fsize, mtime);
-
-	lua_pushboolean(L, ret);
-	return 1;
+	lua_createtable(L, 0, (int)items.size());
+	for (auto &it : items) {
+		lua_pushlstring(L, it._path.data(), it._path.size());
+		__file_pushstat(L, it._ok ? &it._st : nullptr, w->_mask);
+		lua_rawset(L, -3);
+	}
 }
 
-static int
+// moves items into the walk's pending entries and posts them in batches, the rest too when last.
+// called with the walk locked.
+static void
+__walk_flush(std::shared_ptr<walk_data> w, walk_items &items, bool last)
+{
+	w->_items.insert(w->_items.end(), std::make_move_iterator(items.begin()), std::make_move_iterator(items.end()));
+	items.clear();
+
+	size_t head = 0;
+	while (w->_items.size() - head >= w->_batch || last) {
+		size_t n = std::min(w->_batch, w->_items.size() - head);
+		bool fin = last && head + n == w->_items.size();
+		std::shared_ptr<walk_items> batch(new walk_items(std::make_move_iterator(w->_items.begin() + head), std::make_move_iterator(w->_items.begin() + head + n)));
+		head += n;
+		pool_post([w, batch, fin](lua_State *L) {
+			if (LUA_NOREF == w->_lfun) {
+				return;
+			}
+			lua_rawgeti(L, LUA_REGISTRYINDEX, w->_lfun);
+			if (fin) {
+				luaL_unref(L, LUA_REGISTRYINDEX, w->_lfun);
+				w->_lfun = LUA_NOREF;
+			}
+			__walk_push(L, w.get(), *batch);
+			lua_pushboolean(L, fin ? 1 : 0);
+			loop_call(L, 2, 0);
+		});
+		if (fin) {
+			break;
+		}
+	}
+	w->_items.erase(w->_items.begin(), w->_items.begin() + head);
+}
+
+static void __walk_task(std::shared_ptr<walk_data> w, std::string rel, int depth);
+
+// reads one directory, rel is relative to the root and empty for the root itself.
+// subdirectories are handed to another pool task while there are threads to spare,
+// walked here depth first otherwise.
+static void
+__walk_dir(std::shared_ptr<walk_data> w, const std::string &rel, int depth, walk_items &items, bool async)
+{
+	std::vector<std::string> subs;
+	bool down = w->_depth < 0 || depth + 1 < w->_depth;
+	std::string path;
+
+#ifdef _WIN32
+	// the find data has the mode, size and times already.
+	const int found = FILE_MD | FILE_SZ | FILE_CT | FILE_MT | FILE_AT;
+	std::string full = w->_root;
+	if (!rel.empty()) {
+		full.append("/").append(rel);
+	}
+	size_t flen = full.size();
+	full.append("/*");
+
+	struct _finddata_t fd;
+	intptr_t fh = ::_findfirst(full.c_str(), &fd);
+	if (-1 == fh) {
+		return;
+	}
+	do {
+		const char *n = fd.name;
+		if ('.' == n[0] && ('\0' == n[1] || ('.' == n[1] && '\0' == n[2]))) {
+			continue;
+		}
+		size_t nlen = strlen(n);
+		path = rel.empty() ? std::string(n, nlen) : rel + "/" + n;
+		int dir = (fd.attrib & _A_SUBDIR) ? 1 : 0;
+		if (dir && down) {
+			subs.push_back(path);
+		}
+		if (dir ? !w->_dirs : !__walk_match(w.get(), n, nlen)) {
+			continue;
+		}
+
+		walk_item item;
+		item._path.swap(path);
+		item._ok = 1;
+		if (0 == (w->_mask & ~found)) {
+			memset(&item._st, 0, sizeof(item._st));
+			item._st.st_mode = dir ? _S_IFDIR : _S_IFREG;
+			item._st.st_size = fd.size;
+			item._st.st_ctime = fd.time_create;
+			item._st.st_mtime = fd.time_write;
+			item._st.st_atime = fd.time_access;
+		} else {
+			full.resize(flen);
+			full.append("/").append(n, nlen);
+			item._ok = 0 == stat(full.c_str(), &item._st) ? 1 : 0;
+		}
+		items.push_back(std::move(item));
+		if (async && items.size() >= w->_batch) {
+			std::lock_guard<std::mutex> lock(w->_lock);
+			__walk_flush(w, items, false);
+		}
+	} while (0 == ::_findnext(fh, &fd));
+	::_findclose(fh);
+#else //_WIN32
+	int dfd = ::openat(w->_fd, rel.empty() ? "." : rel.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd < 0) {
+		return;
+	}
+	DIR *dp = ::fdopendir(dfd);
+	if (nullptr == dp) {
+		::close(dfd);
+		return;
+	}
+
+	dirent *ep;
+	struct stat st;
+	while (nullptr != (ep = ::readdir(dp))) {
+		const char *n = ep->d_name;
+		if ('.' == n[0] && ('\0' == n[1] || ('.' == n[1] && '\0' == n[2]))) {
+			continue;
+		}
+
+		mode_t mode = 0;
+		int ok = 0;
+		switch (ep->d_type) {
+		case DT_REG:  mode = S_IFREG; break;
+		case DT_DIR:  mode = S_IFDIR; break;
+		case DT_SOCK: mode = S_IFSOCK; break;
+		case DT_FIFO: mode = S_IFIFO; break;
+		case DT_CHR:  mode = S_IFCHR; break;
+		case DT_BLK:  mode = S_IFBLK; break;
+		case DT_LNK:  mode = S_IFLNK; break;
+		default:
+			// no d_type here, links are not followed down so the type is the link's own.
+			if (0 != ::fstatat(dfd, n, &st, AT_SYMLINK_NOFOLLOW)) {
+				continue;
+			}
+			mode = st.st_mode & S_IFMT;
+			ok = S_ISLNK(mode) ? 0 : 1;
+			break;
+		}
+
+		size_t nlen = strlen(n);
+		path = rel.empty() ? std::string(n, nlen) : rel + "/" + n;
+		int dir = S_ISDIR(mode) ? 1 : 0;
+		if (dir && down) {
+			subs.push_back(path);
+		}
+		if (dir ? !w->_dirs : !__walk_match(w.get(), n, nlen)) {
+			continue;
+		}
+
+		walk_item item;
+		item._path.swap(path);
+		if (0 == (w->_mask & ~FILE_MD) && !S_ISLNK(mode)) {
+			memset(&item._st, 0, sizeof(item._st));
+			item._st.st_mode = mode;
+			item._ok = 1;
+		} else if (ok) {
+			item._st = st;
+			item._ok = 1;
+		} else {
+			// reported like cfile.list, through the link.
+			item._ok = 0 == ::fstatat(dfd, n, &item._st, 0) ? 1 : 0;
+		}
+		items.push_back(std::move(item));
+		if (async && items.size() >= w->_batch) {
+			std::lock_guard<std::mutex> lock(w->_lock);
+			__walk_flush(w, items, false);
+		}
+	}
+	::closedir(dp);
+#endif //_WIN32
+
+	for (auto &it : subs) {
+		if (async) {
+			bool spawn = false;
+			{
+				std::lock_guard<std::mutex> lock(w->_lock);
+				if (w->_running < w->_threads) {
+					++w->_running; ++w->_pending;
+					spawn = true;
+				}
+			}
+			if (spawn) {
+				auto ws = w;
+				std::string sub = it;
+				if (pool_push([ws, sub, depth](int) { __walk_task(ws, sub, depth + 1); }, pool_done())) {
+					continue;
+				}
+				std::lock_guard<std::mutex> lock(w->_lock);
+				--w->_running; --w->_pending;
+			}
+		}
+		__walk_dir(w, it, depth + 1, items, async);
+	}
+}
+
+static void
+__walk_task(std::shared_ptr<walk_data> w, std::string rel, int depth)
+{
+	walk_items items;
+	__walk_dir(w, rel, depth, items, true);
+
+	std::lock_guard<std::mutex> lock(w->_lock);
+	--w->_running;
+	__walk_flush(w, items, 0 == --w->_pending);
+}
+
+// cfile.walk(path[, opts[, fn]]), every file under path, keyed by the path relative to it,
+// to an attr table as cfile.list makes them. opts:
+//   fields  attr fields, all by default
+//   glob    pattern file names must match, "*.lua", "[a-f]*.png"
+//   ext     extension or list of them files must have, without the dot, any case
+//   depth   levels walked, 1 is path's own entries, all by default
+//   dirs    true lists directories too, they are walked either way
+//   batch   entries handed to fn at once, 512 by default
+//   threads pool tasks walking subtrees side by side, 1 by default
+// without fn the walk runs here and returns the table. with fn it runs on the pool and
+// fn(entries, last) is called on the loop thread for each batch, last is true once.
+// links are reported but not walked into.
+static int
+__l2c_walk(lua_State *L)
+{
+	size_t plen = 0;
+	const char *path = luaL_checklstring(L, 1, &plen);
+
+	std::shared_ptr<walk_data> w(new walk_data());
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "fields");
+		w->_mask = __file_fields(L, -1);
+		lua_getfield(L, 2, "glob");
+		if (lua_isstring(L, -1)) w->_glob = lua_tostring(L, -1);
+		lua_getfield(L, 2, "depth");
+		if (lua_isnumber(L, -1)) w->_depth = (int)lua_tointeger(L, -1);
+		lua_getfield(L, 2, "dirs");
+		w->_dirs = lua_toboolean(L, -1);
+		lua_getfield(L, 2, "batch");
+		if (lua_isnumber(L, -1) && lua_tointeger(L, -1) > 0) w->_batch = (size_t)lua_tointeger(L, -1);
+		lua_getfield(L, 2, "threads");
+		if (lua_isnumber(L, -1) && lua_tointeger(L, -1) > 0) w->_threads = (int)lua_tointeger(L, -1);
+		lua_getfield(L, 2, "ext");
+		if (lua_isstring(L, -1)) {
+			w->_exts.push_back(lua_tostring(L, -1));
+		} else if (lua_istable(L, -1)) {
+			for (int i = 1; ; ++i) {
+				lua_rawgeti(L, -1, i);
+				if (!lua_isstring(L, -1)) {
+					lua_pop(L, 1);
+					break;
+				}
+				w->_exts.push_back(lua_tostring(L, -1));
+				lua_pop(L, 1);
+			}
+		}
+		lua_pop(L, 7);
+	}
+
+	size_t flen = 0;
+	char *fpath = __file_fullpath((char*)path, plen, &flen);
+	w->_root.assign(fpath, flen);
+	while (w->_root.size() > 1 && '/' == w->_root.back()) {
+		w->_root.pop_back();
+	}
+
+#ifdef _WIN32
+	struct stat st;
+	if (0 != stat(w->_root.c_str(), &st) || 0 == S_ISDIR(st.st_mode)) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "walk %s: not a directory", path);
+		return 2;
+	}
+#else //_WIN32
+	w->_fd = ::open(w->_root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (w->_fd < 0) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "walk %s: %s", path, strerror(errno));
+		return 2;
+	}
+#endif //_WIN32
+
+	if (!lua_isfunction(L, 3)) {
+		walk_items items;
+		__walk_dir(w, std::string(), 0, items, false);
+		__walk_push(L, w.get(), items);
+		return 1;
+	}
+
+	lua_pushvalue(L, 3);
+	w->_lfun = luaL_ref(L, LUA_REGISTRYINDEX);
+	w->_pending = 1; w->_running = 1;
+	if (!pool_push([w](int) { __walk_task(w, std::string(), 0); }, pool_done())) {
+		luaL_unref(L, LUA_REGISTRYINDEX, w->_lfun);
+		w->_lfun = LUA_NOREF;
+		lua_pushnil(L);
+		lua_pushliteral(L, "walk: no pool");
+		return 2;
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+#define TREE_THREADS  4   // pool tasks one tree operation spreads over
+#define TREE_PROGRESS 100 // ms between progress callbacks
+#define TREE_TRASH    ".trash/"
+
+enum {
+	TREE_RM = 0,
+	TREE_CP,
+	TREE_MV,
+};
+
+struct tree_ent
+{
+	std::string _name;
+	char        _type; // 'f' file, 'd' directory, 'l' link, 'o' other
+};
+
+// one rmtree, copytree or move. relative paths below _from, and _to for copies.
+// subtrees are handed to other pool tasks like cfile.walk does, the last one to finish
+// removes the directories that were handed off, once the tasks they went to emptied them.
+struct tree_op
+{
+	int         _kind;
+	std::string _from;
+	std::string _to;
+#ifndef _WIN32
+	int         _sfd;
+	int         _dfd;
+#endif //_WIN32
+	int         _threads;
+
+	std::mutex  _lock;
+	int         _pending;
+	int         _running;
+	uint64_t    _count;
+	uint64_t    _bytes;
+	uint64_t    _posted;
+	std::string _err;
+	std::vector<std::string> _defer;
+	int         _lfun;
+	int         _lprog;
+
+	tree_op(void) : _kind(TREE_RM),
+#ifndef _WIN32
+		_sfd(-1), _dfd(-1),
+#endif //_WIN32
+		_threads(1), _pending(0), _running(0), _count(0), _bytes(0), _posted(0), _lfun(LUA_NOREF), _lprog(LUA_NOREF)
+	{
+	}
+
+	~tree_op(void)
+	{
+#ifndef _WIN32
+		if (this->_sfd >= 0) ::close(this->_sfd);
+		if (this->_dfd >= 0) ::close(this->_dfd);
+#endif //_WIN32
+	}
+};
+
+typedef std::shared_ptr<tree_op> tree_ptr;
+
+static void
+__tree_fail(tree_op *op, const std::string &what)
+{
+	std::lock_guard<std::mutex> lock(op->_lock);
+	if (op->_err.empty()) {
+		op->_err = what + ": " + strerror(errno);
+	}
+}
+
+// counts one entry done, and posts progress when it is due.
+static void
+__tree_tick(tree_ptr op, uint64_t bytes, bool async)
+{
+	// a move that copied counts what it copied, not what it removed after.
+	if (TREE_RM == op->_kind && !op->_to.empty()) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(op->_lock);
+	++op->_count;
+	op->_bytes += bytes;
+	if (!async || LUA_NOREF == op->_lprog) {
+		return;
+	}
+
+	uint64_t now = __file_ms();
+	if (now - op->_posted < TREE_PROGRESS) {
+		return;
+	}
+	op->_posted = now;
+	uint64_t count = op->_count, total = op->_bytes;
+	pool_post([op, count, total](lua_State *L) {
+		if (LUA_NOREF == op->_lprog) {
+			return;
+		}
+		lua_rawgeti(L, LUA_REGISTRYINDEX, op->_lprog);
+		lua_pushnumber(L, (lua_Number)count);
+		lua_pushnumber(L, (lua_Number)total);
+		loop_call(L, 2, 0);
+	});
+}
+
+static std::string
+__tree_join(const std::string &base, const std::string &rel, const std::string &name)
+{
+	std::string path = base;
+	if (!rel.empty()) {
+		path.append("/").append(rel);
+	}
+	if (!name.empty()) {
+		path.append("/").append(name);
+	}
+	return path;
+}
+
+#ifndef _WIN32
+static char
+__tree_type(int dfd, const char *name, unsigned char dt)
+{
+	switch (dt) {
+	case DT_REG: return 'f';
+	case DT_DIR: return 'd';
+	case DT_LNK: return 'l';
+	case DT_UNKNOWN: break;
+	default: return 'o';
+	}
+
+	struct stat st;
+	if (0 != ::fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+		return 'o';
+	}
+	return S_ISREG(st.st_mode) ? 'f' : S_ISDIR(st.st_mode) ? 'd' : S_ISLNK(st.st_mode) ? 'l' : 'o';
+}
+#endif //_WIN32
+
+// the entries of _from/rel. on posix *fd is left open on the directory for the *at calls.
+static int
+__tree_list(tree_op *op, const std::string &rel, int *fd, std::vector<tree_ent> &ents)
+{
+#ifdef _WIN32
+	*fd = -1;
+	std::string full = __tree_join(op->_from, rel, "*");
+	struct _finddata_t fd_;
+	intptr_t fh = ::_findfirst(full.c_str(), &fd_);
+	if (-1 == fh) {
+		return ENOENT == errno ? 1 : 0;
+	}
+	do {
+		const char *n = fd_.name;
+		if ('.' == n[0] && ('\0' == n[1] || ('.' == n[1] && '\0' == n[2]))) {
+			continue;
+		}
+		tree_ent ent;
+		ent._name = n;
+		ent._type = (fd_.attrib & _A_SUBDIR) ? 'd' : 'f';
+		ents.push_back(std::move(ent));
+	} while (0 == ::_findnext(fh, &fd_));
+	::_findclose(fh);
+#else //_WIN32
+	*fd = ::openat(op->_sfd, rel.empty() ? "." : rel.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (*fd < 0) {
+		return ENOENT == errno ? 1 : 0;
+	}
+	int lfd = ::dup(*fd);
+	DIR *dp = lfd < 0 ? nullptr : ::fdopendir(lfd);
+	if (nullptr == dp) {
+		if (lfd >= 0) ::close(lfd);
+		::close(*fd); *fd = -1;
+		return 0;
+	}
+	dirent *ep;
+	while (nullptr != (ep = ::readdir(dp))) {
+		const char *n = ep->d_name;
+		if ('.' == n[0] && ('\0' == n[1] || ('.' == n[1] && '\0' == n[2]))) {
+			continue;
+		}
+		tree_ent ent;
+		ent._name = n;
+		ent._type = __tree_type(*fd, n, ep->d_type);
+		ents.push_back(std::move(ent));
+	}
+	::closedir(dp);
+#endif //_WIN32
+	return 1;
+}
+
+static int
+__tree_unlink(tree_op *op, int fd, const std::string &rel, const tree_ent &ent)
+{
+#ifdef _WIN32
+	std::string full = __tree_join(op->_from, rel, ent._name);
+	if ('d' == ent._type) {
+		return 0 == rmdir(full.c_str()) || ENOENT == errno;
+	}
+	_chmod(full.c_str(), _S_IREAD | _S_IWRITE);
+	return 0 == unlink(full.c_str()) || ENOENT == errno;
+#else //_WIN32
+	(void)op; (void)rel;
+	return 0 == ::unlinkat(fd, ent._name.c_str(), 'd' == ent._type ? AT_REMOVEDIR : 0) || ENOENT == errno;
+#endif //_WIN32
+}
+
+// copies one file or link, returns the bytes copied or -1.
+static int64_t
+__tree_copy(tree_op *op, int sfd, int dfd, const std::string &rel, const tree_ent &ent)
+{
+#ifdef _WIN32
+	std::string src = __tree_join(op->_from, rel, ent._name), dst = __tree_join(op->_to, rel, ent._name);
+	struct stat st;
+	if (!::CopyFileA(src.c_str(), dst.c_str(), FALSE) || 0 != stat(dst.c_str(), &st)) {
+		return -1;
+	}
+	return (int64_t)st.st_size;
+#else //_WIN32
+	(void)op; (void)rel;
+	const char *name = ent._name.c_str();
+	if ('l' == ent._type) {
+		char link[PATH_MAX];
+		ssize_t llen = ::readlinkat(sfd, name, link, sizeof(link) - 1);
+		if (llen < 0) {
+			return -1;
+		}
+		link[llen] = '\0';
+		::unlinkat(dfd, name, 0);
+		return 0 == ::symlinkat(link, dfd, name) ? 0 : -1;
+	}
+
+	int in = ::openat(sfd, name, O_RDONLY | O_CLOEXEC);
+	if (in < 0) {
+		return -1;
+	}
+	struct stat st;
+	if (0 != ::fstat(in, &st)) {
+		::close(in);
+		return -1;
+	}
+	int out = ::openat(dfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 0777);
+	if (out < 0) {
+		::close(in);
+		return -1;
+	}
+
+	static THREAD_LOCAL char buf[1 << 16];
+	int64_t total = 0;
+	ssize_t n = 0;
+	while (0 < (n = ::read(in, buf, sizeof(buf)))) {
+		for (ssize_t off = 0; off < n; ) {
+			ssize_t w = ::write(out, buf + off, (size_t)(n - off));
+			if (w < 0) {
+				if (EINTR == errno) continue;
+				n = -1; break;
+			}
+			off += w;
+		}
+		if (n < 0) break;
+		total += n;
+	}
+	if (0 == n) {
+		// mtime is what cfile.check compares, copies keep it.
+		struct timespec ts[2] = { st.st_atim, st.st_mtim };
+		::futimens(out, ts);
+	}
+	::close(in);
+	::close(out);
+	return n < 0 ? -1 : total;
+#endif //_WIN32
+}
+
+static int
+__tree_mkdir(tree_op *op, const std::string &rel, int *fd)
+{
+#ifdef _WIN32
+	*fd = -1;
+	std::string full = __tree_join(op->_to, rel, std::string());
+	return 0 == mkdir(full.c_str(), 0) || EEXIST == errno;
+#else //_WIN32
+	if (!rel.empty() && 0 != ::mkdirat(op->_dfd, rel.c_str(), S_IRWXU | S_IRWXG | S_IRWXO) && EEXIST != errno) {
+		return 0;
+	}
+	*fd = ::openat(op->_dfd, rel.empty() ? "." : rel.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	return *fd >= 0;
+#endif //_WIN32
+}
+
+static void __tree_task(tree_ptr op, std::string rel);
+
+// removes or copies _from/rel, depth first, subtrees go to other tasks while there are spare.
+// a removed directory whose subtrees were handed off stays until the final sweep.
+static void
+__tree_dir(tree_ptr op, const std::string &rel, bool async)
+{
+	std::vector<tree_ent> ents;
+	int sfd = -1, dfd = -1;
+	if (!__tree_list(op.get(), rel, &sfd, ents)) {
+		__tree_fail(op.get(), __tree_join(op->_from, rel, std::string()));
+		return;
+	}
+	if (TREE_RM != op->_kind && !__tree_mkdir(op.get(), rel, &dfd)) {
+		__tree_fail(op.get(), __tree_join(op->_to, rel, std::string()));
+		if (sfd >= 0) ::close(sfd);
+		return;
+	}
+
+	for (auto &it : ents) {
+		std::string sub;
+		if ('d' == it._type) {
+			sub = rel.empty() ? it._name : rel + "/" + it._name;
+			bool spawn = false;
+			if (async) {
+				std::lock_guard<std::mutex> lock(op->_lock);
+				if (op->_running < op->_threads) {
+					++op->_running; ++op->_pending;
+					spawn = true;
+				}
+			}
+			if (spawn) {
+				if (pool_push([op, sub](int) { __tree_task(op, sub); }, pool_done())) {
+					if (TREE_RM == op->_kind) {
+						std::lock_guard<std::mutex> lock(op->_lock);
+						op->_defer.push_back(sub);
+					}
+					continue;
+				}
+				std::lock_guard<std::mutex> lock(op->_lock);
+				--op->_running; --op->_pending;
+			}
+			__tree_dir(op, sub, async);
+		}
+
+		if (TREE_RM != op->_kind) {
+			if ('d' == it._type) {
+				continue;
+			}
+			int64_t n = 'o' == it._type ? 0 : __tree_copy(op.get(), sfd, dfd, rel, it);
+			if (n < 0) {
+				__tree_fail(op.get(), __tree_join(op->_from, rel, it._name));
+				continue;
+			}
+			__tree_tick(op, (uint64_t)n, async);
+		} else {
+			if (!__tree_unlink(op.get(), sfd, rel, it)) {
+				__tree_fail(op.get(), __tree_join(op->_from, rel, it._name));
+				continue;
+			}
+			__tree_tick(op, 0, async);
+		}
+	}
+
+#ifndef _WIN32
+	if (sfd >= 0) ::close(sfd);
+	if (dfd >= 0) ::close(dfd);
+#endif //_WIN32
+}
+
+// the root, once every task is done. a move that had to copy goes on removing its source.
+static bool
+__tree_finish(tree_ptr op)
+{
+	if (TREE_RM == op->_kind) {
+		// children sort after their parents, so going backwards empties them first.
+		std::sort(op->_defer.begin(), op->_defer.end());
+		for (auto it = op->_defer.rbegin(); it != op->_defer.rend(); ++it) {
+			std::string full = __tree_join(op->_from, *it, std::string());
+			if (0 != rmdir(full.c_str()) && ENOENT != errno) {
+				__tree_fail(op.get(), full);
+			} else {
+				__tree_tick(op, 0, false);
+			}
+		}
+		op->_defer.clear();
+		if (0 != rmdir(op->_from.c_str()) && ENOENT != errno) {
+			__tree_fail(op.get(), op->_from);
+		}
+		return true;
+	}
+
+	if (TREE_MV == op->_kind && op->_err.empty()) {
+		op->_kind = TREE_RM;
+		op->_pending = 1; op->_running = 1;
+		return !pool_push([op](int) { __tree_task(op, std::string()); }, pool_done());
+	}
+	return true;
+}
+
+static void
+__tree_task(tree_ptr op, std::string rel)
+{
+	__tree_dir(op, rel, true);
+
+	bool last = false;
+	{
+		std::lock_guard<std::mutex> lock(op->_lock);
+		--op->_running;
+		last = 0 == --op->_pending;
+	}
+	if (!last || !__tree_finish(op)) {
+		return;
+	}
+
+	pool_post([op](lua_State *L) {
+		__stat_clear();
+		if (LUA_NOREF != op->_lprog) {
+			luaL_unref(L, LUA_REGISTRYINDEX, op->_lprog);
+			op->_lprog = LUA_NOREF;
+		}
+		if (LUA_NOREF == op->_lfun) {
+			return;
+		}
+		lua_rawgeti(L, LUA_REGISTRYINDEX, op->_lfun);
+		luaL_unref(L, LUA_REGISTRYINDEX, op->_lfun);
+		op->_lfun = LUA_NOREF;
+		lua_pushboolean(L, op->_err.empty() ? 1 : 0);
+		lua_pushnumber(L, (lua_Number)op->_count);
+		lua_pushnumber(L, (lua_Number)op->_bytes);
+		if (op->_err.empty()) {
+			lua_pushnil(L);
+		} else {
+			lua_pushlstring(L, op->_err.data(), op->_err.size());
+		}
+		loop_call(L, 4, 0);
+	});
+}
+
+static int
+__tree_open(tree_op *op)
+{
+#ifndef _WIN32
+	// the root of a removal is never followed, entries below it are not either.
+	op->_sfd = ::open(op->_from.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC | (TREE_RM == op->_kind ? O_NOFOLLOW : 0));
+	if (op->_sfd < 0) {
+		return 0;
+	}
+	if (TREE_RM != op->_kind) {
+		std::string to = op->_to;
+		__file_mkdir(&to[0], to.size());
+		op->_dfd = ::open(op->_to.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (op->_dfd < 0) {
+			return 0;
+		}
+	}
+#else //_WIN32
+	struct stat st;
+	if (0 != stat(op->_from.c_str(), &st) || 0 == S_ISDIR(st.st_mode)) {
+		errno = ENOTDIR;
+		return 0;
+	}
+	if (TREE_RM != op->_kind) {
+		std::string to = op->_to;
+		__file_mkdir(&to[0], to.size());
+	}
+#endif //_WIN32
+	return 1;
+}
+
+// removes a file or a tree in place, on the calling thread.
+static inline int
+__file_rmdir(char *path, size_t plen)
+{
+	size_t flen = 0;
+	char *fpath = (char*)__file_fullpath(path, plen, &flen);
+
+	// a link to a directory goes like a file, its target is left alone.
+	struct stat st;
+	if (0 != lstat(fpath, &st)) {
+		return 1;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		unlink(fpath);
+		__stat_drop(fpath, flen);
+		return 1;
+	}
+
+	tree_ptr op(new tree_op());
+	op->_from.assign(fpath, flen);
+	if (__tree_open(op.get())) {
+		__tree_dir(op, std::string(), false);
+		__tree_finish(op);
+	}
+	__stat_clear();
+	return 1;
+}
+
+static std::string
+__tree_path(lua_State *L, int idx)
+{
+	size_t plen = 0;
+	const char *path = luaL_checklstring(L, idx, &plen);
+	size_t flen = 0;
+	const char *fpath = __file_fullpath((char*)path, plen, &flen);
+	std::string full(fpath, flen);
+	while (full.size() > 1 && '/' == full[full.size() - 1]) {
+		full.erase(full.size() - 1);
+	}
+	return full;
+}
+
+// fn(ok, count, bytes) for what was done right away, delivered from the loop like the rest.
+static void
+__tree_done(lua_State *L, int idx, int ok, uint64_t count, uint64_t bytes)
+{
+	if (!lua_isfunction(L, idx)) {
+		return;
+	}
+	lua_pushvalue(L, idx);
+	int lfun = luaL_ref(L, LUA_REGISTRYINDEX);
+	pool_push(pool_work(), [lfun, ok, count, bytes](lua_State *L) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, lfun);
+		luaL_unref(L, LUA_REGISTRYINDEX, lfun);
+		lua_pushboolean(L, ok);
+		lua_pushnumber(L, (lua_Number)count);
+		lua_pushnumber(L, (lua_Number)bytes);
+		loop_call(L, 3, 0);
+	});
+}
+
+static int
+__tree_prepare(tree_op *op)
+{
+	op->_threads = (int)std::min(pool_size(), (size_t)TREE_THREADS);
+	if (op->_threads < 1) {
+		errno = EAGAIN;
+		return 0;
+	}
+	return __tree_open(op);
+}
+
+// removes what an earlier run left in the trash, each entry an operation of its own,
+// so none of them overlaps with the trees this run moves in there.
+static void
+__tree_sweep(const std::string &trash)
+{
+	tree_op list;
+	list._from = trash;
+	std::vector<tree_ent> ents;
+	int fd = -1;
+	if (!__tree_open(&list) || !__tree_list(&list, std::string(), &fd, ents)) {
+		return;
+	}
+
+	for (auto &it : ents) {
+		if ('d' != it._type) {
+			__tree_unlink(&list, fd, std::string(), it);
+			continue;
+		}
+		tree_ptr op(new tree_op());
+		op->_from = __tree_join(trash, std::string(), it._name);
+		if (__tree_prepare(op.get())) {
+			op->_pending = 1; op->_running = 1;
+			pool_push([op](int) { __tree_task(op, std::string()); }, pool_done());
+		}
+	}
+#ifndef _WIN32
+	if (fd >= 0) ::close(fd);
+#endif //_WIN32
+}
+
+// starts a prepared op on the pool with fn and progress at idx and idx + 1, pushes its results.
+static int
+__tree_run(lua_State *L, tree_ptr op, int idx)
+{
+	if (lua_isfunction(L, idx)) {
+		lua_pushvalue(L, idx);
+		op->_lfun = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	if (lua_isfunction(L, idx + 1)) {
+		lua_pushvalue(L, idx + 1);
+		op->_lprog = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+
+	op->_pending = 1; op->_running = 1;
+	pool_push([op](int) { __tree_task(op, std::string()); }, pool_done());
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+// prepares op and starts it, see __tree_run.
+static int
+__tree_start(lua_State *L, tree_ptr op, int idx)
+{
+	if (!__tree_prepare(op.get())) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: %s", op->_from.c_str(), strerror(errno));
+		return 2;
+	}
+
+	return __tree_run(L, op, idx);
+}
+
+// cfile.rmtree(path[, fn[, progress]]), path is renamed into HOME/.trash at once, so it is gone
+// as far as anyone looking is concerned, and deleted there on the pool. where the rename fails
+// it is deleted in place. fn(ok, count, bytes, err) when done, progress(count, bytes) meanwhile,
+// always from the loop, never before rmtree returns. the first rmtree also clears what an
+// earlier run left in the trash. a link is removed itself, never what it points to.
+static int
+__l2c_rmtree(lua_State *L)
+{
+	tree_ptr op(new tree_op());
+	op->_kind = TREE_RM;
+	op->_from = __tree_path(L, 1);
+
+	struct stat st;
+	if (0 != lstat(op->_from.c_str(), &st)) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: %s", op->_from.c_str(), strerror(errno));
+		return 2;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		int ok = 0 == unlink(op->_from.c_str()) ? 1 : 0;
+		__stat_drop(op->_from.c_str(), op->_from.size());
+		__tree_done(L, 2, ok, 1, (uint64_t)st.st_size);
+		lua_pushboolean(L, ok);
+		return 1;
+	}
+
+	// prepared before the rename, a failure leaves the directory where the caller had it.
+	// the open descriptor follows the directory into the trash.
+	std::string from = op->_from;
+	if (!__tree_prepare(op.get())) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: %s", from.c_str(), strerror(errno));
+		return 2;
+	}
+
+	static std::atomic<uint32_t> seq(0);
+	std::string trash(_F->_home, _F->_hlen);
+	trash.append(TREE_TRASH);
+	__file_mkdir(&trash[0], trash.size());
+	uint32_t n = seq++;
+	if (0 == n) {
+		__tree_sweep(trash);
+	}
+	char name[64];
+	snprintf(name, sizeof(name), "%llu.%u.%u", (unsigned long long)time(nullptr), (unsigned)getpid(), n);
+	std::string to = trash + name;
+	if (0 == ::rename(from.c_str(), to.c_str())) {
+		__stat_drop(from.c_str(), from.size());
+		op->_from = to;
+	}
+
+	return __tree_run(L, op, 2);
+}
+
+// cfile.copytree(from, to[, fn[, progress]]), copies into to, made when missing, keeping mtimes.
+static int
+__l2c_copytree(lua_State *L)
+{
+	tree_ptr op(new tree_op());
+	op->_kind = TREE_CP;
+	op->_from = __tree_path(L, 1);
+	op->_to = __tree_path(L, 2);
+	return __tree_start(L, op, 3);
+}
+
+// cfile.move(from, to[, fn[, progress]]), a rename, or across devices a copy that then removes from.
+static int
+__l2c_move(lua_State *L)
+{
+	tree_ptr op(new tree_op());
+	op->_kind = TREE_MV;
+	op->_from = __tree_path(L, 1);
+	op->_to = __tree_path(L, 2);
+
+	std::string to = op->_to;
+	__file_mkdir(&to[0], __file_dirname(to.c_str(), to.size()));
+	if (0 == ::rename(op->_from.c_str(), op->_to.c_str())) {
+		__stat_drop(op->_from.c_str(), op->_from.size());
+		__stat_drop(op->_to.c_str(), op->_to.size());
+		__tree_done(L, 3, 1, 1, 0);
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+	if (EXDEV != errno) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: %s", op->_from.c_str(), strerror(errno));
+		return 2;
+	}
+
+	return __tree_start(L, op, 3);
+}
+
+static int
+__l2c_dirname(lua_State *L)
+{
+	size_t plen = 0;
+	const char *path = luaL_checklstring(L, 1, &plen);
+	size_t dlen = __file_dirname(path, plen);
+	if (0 == dlen) {
+		return 0;
+	}
+
+	lua_pushlstring(L, path, dlen);
+	return 1;
+}
+
+static int
+__l2c_mkdir(lua_State *L)
+{
+	size_t plen = 0;
+	const char *path = luaL_checklstring(L, 1, &plen);
+	int ret = __file_mkdir((char*)path, plen);
+
+	lua_pushboolean(L, ret);
+	return 1;
+}
+
+static int
+__l2c_rmdir(lua_State *L)
+{
+	size_t plen = 0;
+	const char *path = luaL_checklstring(L, 1, &plen);
+	int ret = __file_rmdir((char*)path, plen);
+
+	lua_pushboolean(L, ret);
+	return 1;
+}
+
+static int
+__l2c_utime(lua_State *L)
+{
+	size_t plen = 0;
+	const char *path = luaL_checklstring(L, 1, &plen);
+	time_t mtime = (time_t)luaL_checklong(L, 2);
+	time_t atime = (time_t)luaL_checklong(L, 3);
+	int ret = __file_utime((char*)path, plen, mtime, atime);
+
+	lua_pushboolean(L, ret);
+	return 1;
+}
+
+static int
+__l2c_check(lua_State *L)
+{
+	size_t plen = 0;
+	const char *path = luaL_checklstring(L, 1, &plen);
+	size_t fsize = (size_t)luaL_checklong(L, 2);
+	time_t mtime = (time_t)luaL_checklong(L, 3);
+	int ret = __file_check((char*)path, plen, fsize, mtime);
+
+	lua_pushboolean(L, ret);
+	return 1;
+}
+
+// cfile.statcache([on]), turns the stat cache of cfile.check and cfile.attr on or off and
+// returns hits, misses, entries and watched directories.
+static int
+__l2c_statcache(lua_State *L)
+{
+	std::lock_guard<std::mutex> lock(_F->_slock);
+	if (!lua_isnoneornil(L, 1)) {
+		_F->_scache = lua_toboolean(L, 1) ? true : false;
+		if (!_F->_scache) {
+			_F->_stats.clear();
+		}
+	}
+
+	lua_pushnumber(L, (lua_Number)_F->_hits);
+	lua_pushnumber(L, (lua_Number)_F->_misses);
+	lua_pushnumber(L, (lua_Number)_F->_stats.size());
+	lua_pushnumber(L, (lua_Number)_F->_dirs.size());
+	return 4;
+}
+
+static int
+__file_seek(FILE *file, uint64_t off)
+{
+#ifdef _WIN32
+	return ::_fseeki64(file, (__int64)off, SEEK_SET);
+#else //_WIN32
+	return ::fseeko(file, (off_t)off, SEEK_SET);
+#endif //_WIN32
+}
+
+// cfile.read(path[, offset[, len]]), the file or len bytes of it from offset, nil and the error
+// when it cannot be read. files from FILE_MAP up are mapped and copied straight into the string.
+static int
+__l2c_read(lua_State *L)
+{
+	size_t plen = 0;
+	const char *path = luaL_checklstring(L, 1, &plen);
+	lua_Number offset = luaL_optnumber(L, 2, 0);
+	lua_Number len = luaL_optnumber(L, 3, -1);
+	luaL_argcheck(L, offset >= 0, 2, "negative offset");
+	size_t flen = 0;
+	const char *fpath = __file_fullpath((char*)path, plen, &flen);
+
+	struct stat st;
+	if (0 != stat(fpath, &st)) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: %s", path, strerror(errno));
+		return 2;
+	}
+	if (!S_ISREG(st.st_mode)) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: not a file", path);
+		return 2;
+	}
+
+	uint64_t size = (uint64_t)st.st_size;
+	uint64_t head = (uint64_t)offset < size ? (uint64_t)offset : size;
+	uint64_t want = len < 0 || (uint64_t)len > size - head ? size - head : (uint64_t)len;
+	if (0 == want) {
+		lua_pushliteral(L, "");
+		return 1;
+	}
+
+	if (want >= FILE_MAP) {
+		size_t msize = 0;
+		void *data = file_map(fpath, &msize);
+		if (nullptr != data && head + want <= msize) {
+			lua_pushlstring(L, (const char*)data + head, (size_t)want);
+			file_unmap(data, msize);
+			return 1;
+		}
+		file_unmap(data, msize);
+	}
+
+	FILE *file = ::fopen(fpath, "rb");
+	if (nullptr == file) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: %s", path, strerror(errno));
+		return 2;
+	}
+	luaL_Buffer b;
+	char *out = luaL_buffinitsize(L, &b, (size_t)want);
+	size_t got = (0 == head || 0 == __file_seek(file, head)) ? ::fread(out, 1, (size_t)want, file) : 0;
+	int err = 0 != ::ferror(file) ? errno : 0;
+	::fclose(file);
+	luaL_pushresultsize(&b, got);
+	if (got != want) {
+		// the file shrank since the stat, or the read failed.
+		lua_pop(L, 1);
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: %s", path, 0 != err ? strerror(err) : "short read");
+		return 2;
+	}
+	return 1;
+}
+
+// cfile.write_atomic(path, data[, sync]), see file_write.
+static int
+__l2c_write_atomic(lua_State *L)
+{
+	size_t plen = 0, dlen = 0;
+	const char *path = luaL_checklstring(L, 1, &plen);
+	const char *data = luaL_checklstring(L, 2, &dlen);
+	int sync = lua_toboolean(L, 3);
+
+	if (!file_write((char*)path, plen, data, dlen, sync)) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "%s: %s", path, strerror(errno));
+		return 2;
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int
 __l2c_log(lua_State *L)
 {
 	int lv = (int)luaL_checklong(L, 1);
 	size_t llen = 0;
 	const char *log = luaL_checklstring(L, 2, &llen);
-	if (llen > sizeof(_F->_lbuff) - __LOG_HEAD_SIZE -8) {
-		llen = sizeof(_F->_lbuff) - __LOG_HEAD_SIZE -8;
-	}
 
-	memcpy(_F->_lbuff + __LOG_HEAD_SIZE, log, llen);
-	__file_log(lv, llen);
+	// rate limits are kept per calling line, like they are per LOGx statement in c.
+	log_site *site = nullptr;
+	lua_Debug ar;
+	if (log_enabled(lv) && lua_getstack(L, 1, &ar) && lua_getinfo(L, "Sl", &ar) && ar.currentline > 0) {
+		site = log_intern(ar.short_src, ar.currentline);
+	}
+	log_write(site, lv, log, llen);
 
 	return 0;
 }
@@ -710,11 +2136,79 @@ __l2c_log(lua_State *L)
 static int
 __l2c_lmask(lua_State *L)
 {
-	_F->_lmask = (size_t)luaL_checklong(L, 1);
+	log_mask((size_t)luaL_checklong(L, 1));
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+// cfile.lformat("bin" | "text"), binary logs are read back with tool/logdump.
+static int
+__l2c_lformat(lua_State *L)
+{
+	const char *fmt = luaL_checkstring(L, 1);
+	log_format(0 == strcmp(fmt, "bin") ? 1 : 0);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+// cfile.lkeep({ size = bytes, count = n, age = seconds, bytes = total }), rotation and retention.
+static int
+__l2c_lkeep(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_getfield(L, 1, "size");
+	lua_getfield(L, 1, "count");
+	lua_getfield(L, 1, "age");
+	lua_getfield(L, 1, "bytes");
+	log_keep((uint64_t)luaL_optnumber(L, 2, LOG_SIZE), (size_t)luaL_optnumber(L, 3, LOG_COUNT), (uint64_t)luaL_optnumber(L, 4, 0), (uint64_t)luaL_optnumber(L, 5, 0));
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+// cfile.llimit({ rate = lines per second, burst = n, sample = n }), per call site, rate 0 is unlimited.
+static int
+__l2c_llimit(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_getfield(L, 1, "rate");
+	lua_getfield(L, 1, "burst");
+	lua_getfield(L, 1, "sample");
+	log_limit((uint32_t)luaL_optnumber(L, 2, LOG_RATE), (uint32_t)luaL_optnumber(L, 3, LOG_BURST), (uint32_t)luaL_optnumber(L, 4, 1));
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int
+__l2c_lroll(lua_State *L)
+{
+	log_roll();
 	lua_pushboolean(L, 1);
 	return 1;
 }
 
+// cfile.lsegs(), closed log segments as { path, size, time }, oldest first.
+static int
+__l2c_lsegs(lua_State *L)
+{
+	std::vector<log_segment> segs;
+	log_segments(segs);
+
+	lua_createtable(L, (int)segs.size(), 0);
+	for (size_t i = 0; i < segs.size(); ++i) {
+		lua_createtable(L, 0, 3);
+		lua_pushlstring(L, segs[i]._path.data(), segs[i]._path.size());
+		lua_setfield(L, -2, "path");
+		lua_pushnumber(L, (lua_Number)segs[i]._size);
+		lua_setfield(L, -2, "size");
+		lua_pushnumber(L, (lua_Number)segs[i]._time);
+		lua_setfield(L, -2, "time");
+		lua_rawseti(L, -2, (int)i + 1);
+	}
+	return 1;
+}
+
 static int
 __l2c_lpath(lua_State *L)
 {
@@ -724,13 +2218,7 @@ __l2c_lpath(lua_State *L)
 	char *fpath = __file_fullpath((char*)path, plen, &flen);
 	int ret = __file_mkdir((char*)fpath, __file_dirname(fpath, flen));
 	if (0 != ret) {
-		memcpy(_F->_lpath, fpath, flen);
-		_F->_lplen = flen;
-		_F->_ldate[0] = '\0';
-		if (nullptr != _F->_lfile) {
-			::fclose(_F->_lfile);
-			_F->_lfile = nullptr;
-		}
+		log_path(fpath, flen);
 	}
 
 	lua_pushboolean(L, ret);
@@ -742,8 +2230,8 @@ __l2c_lpush(lua_State *L)
 {
 	size_t plen = 0;
 	const char *push = luaL_checklstring(L, 1, &plen);
-	memcpy(_F->_lpush, push, plen); _F->_lpush[plen] = '\0';
-	_F->_lulen = plen;
+
+	log_push(push, plen);
 
 	lua_pushboolean(L, 1);
 	return 1;
@@ -758,13 +2246,25 @@ __luaopen_file(lua_State *L)
 		{ "dir", __l2c_dir },
 		{ "attr", __l2c_attr },
 		{ "list", __l2c_list },
+		{ "walk", __l2c_walk },
 		{ "dirname", __l2c_dirname },
 		{ "mkdir", __l2c_mkdir },
 		{ "rmdir", __l2c_rmdir },
+		{ "rmtree", __l2c_rmtree },
+		{ "copytree", __l2c_copytree },
+		{ "move", __l2c_move },
 		{ "utime", __l2c_utime },
 		{ "check", __l2c_check },
+		{ "statcache", __l2c_statcache },
+		{ "read", __l2c_read },
+		{ "write_atomic", __l2c_write_atomic },
 		{ "log", __l2c_log },
 		{ "lmask", __l2c_lmask },
+		{ "lformat", __l2c_lformat },
+		{ "lkeep", __l2c_lkeep },
+		{ "lroll", __l2c_lroll },
+		{ "llimit", __l2c_llimit },
+		{ "lsegs", __l2c_lsegs },
 		{ "lpath", __l2c_lpath },
 		{ "lpush", __l2c_lpush },
 		{ nullptr, nullptr },
@@ -780,16 +2280,33 @@ file_init(lua_State *L, const char *home, size_t hlen)
 		_F = new file_data();
 		if (nullptr != home && hlen > 0 && hlen < sizeof(_F->_home)) {
 			memcpy(_F->_home, home, hlen); _F->_home[hlen] = '\0'; 
-			memcpy(_F->_temp, _F->_home, hlen + 1);
 			_F->_hlen = hlen;
-
-			memcpy(_F->_lpath, _F->_home, hlen);
-			_F->_lplen = hlen;
-			__file_mkdir(_F->_lpath, __file_dirname(_F->_lpath, _F->_lplen));
 		}
 
-		luaL_requiref(L, "cfile", __luaopen_file, 0);
+		log_init(_F->_home, _F->_hlen);
+	}
+
+	util_preload(L, "cfile", __luaopen_file);
+}
+
+void
+file_require(lua_State *L)
+{
+	if (nullptr == _F) {
+		return;
+	}
+
+	luaL_requiref(L, "cfile", __luaopen_file, 0);
+}
+
+void
+file_reload(lua_State *L)
+{
+	if (nullptr == _F) {
+		return;
 	}
+
+	util_preload(L, "cfile", __luaopen_file);
 }
 
 void
@@ -799,9 +2316,22 @@ file_fini(lua_State *L)
 		return;
 	}
 
+	log_fini();
 	delete _F; _F = nullptr;
 }
 
+int
+file_mkdir(char *path, size_t plen)
+{
+	return __file_mkdir(path, plen);
+}
+
+const char*
+file_path(char *path, size_t plen, size_t *flen)
+{
+	return __file_fullpath(path, plen, flen);
+}
+
 void*
 file_open(char *path, size_t plen, const char *mode)
 {
@@ -809,7 +2339,11 @@ file_open(char *path, size_t plen, const char *mode)
 	char *fpath = __file_fullpath(path, plen, &flen);
 
 	__file_mkdir((char*)fpath, __file_dirname(fpath, flen));
-	return (void*)::fopen(fpath, mode);
+	FILE *file = ::fopen(fpath, mode);
+	if (nullptr != file && nullptr != strpbrk(mode, "wa+")) {
+		__stat_drop(fpath, flen);
+	}
+	return (void*)file;
 }
 
 int
@@ -819,13 +2353,212 @@ file_utime(char *path, size_t plen, time_t mtime, time_t atime)
 }
 
 int
-file_clog(int lv, const char *fmt, ...)
+file_rename(char *from, size_t flen, char *to, size_t tlen)
+{
+	char fpath[PATH_SIZE];
+	size_t fplen = 0;
+	const char *f = __file_fullpath(from, flen, &fplen);
+	memcpy(fpath, f, fplen); fpath[fplen] = '\0';
+
+	size_t tplen = 0;
+	const char *tpath = __file_fullpath(to, tlen, &tplen);
+#ifdef _WIN32
+	::remove(tpath);
+#endif //_WIN32
+	int ret = 0 == ::rename(fpath, tpath) ? 1 : 0;
+	__stat_drop(fpath, fplen);
+	__stat_drop(tpath, tplen);
+	return ret;
+}
+
+int
+file_remove(char *path, size_t plen)
+{
+	size_t flen = 0;
+	const char *fpath = __file_fullpath(path, plen, &flen);
+	int ret = 0 == ::remove(fpath) ? 1 : 0;
+	__stat_drop(fpath, flen);
+	return ret;
+}
+
+// temps of writes to fpath that died before their rename, "<name>.<pid>.<time>.<n>.tmp" older
+// than FILE_STALE. looked for on the first write to a path in this process only.
+static void
+__file_sweep(const std::string &fpath)
+{
+	if (nullptr == _F) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(_F->_wlock);
+		if (!_F->_swept.insert(fpath).second) {
+			return;
+		}
+	}
+
+	size_t dlen = __file_dirname(fpath.c_str(), fpath.size());
+	size_t blen = __file_basename(fpath.c_str(), fpath.size());
+	if (0 == dlen || blen + 1 >= fpath.size()) {
+		return;
+	}
+	std::string head = fpath.substr(blen + 1) + ".";
+
+	tree_op list;
+	list._from = fpath.substr(0, dlen);
+	std::vector<tree_ent> ents;
+	int fd = -1;
+	if (!__tree_open(&list) || !__tree_list(&list, std::string(), &fd, ents)) {
+		return;
+	}
+
+	time_t now = time(nullptr);
+	for (auto &it : ents) {
+		const std::string &n = it._name;
+		if ('f' != it._type || n.size() <= head.size() + 4 || 0 != n.compare(0, head.size(), head) || 0 != n.compare(n.size() - 4, 4, ".tmp")) {
+			continue;
+		}
+		if (n.size() - 3 != n.find_first_not_of("0123456789abcdef.", head.size())) {
+			continue;
+		}
+		struct stat st;
+		std::string full = __tree_join(list._from, std::string(), n);
+		if (0 == stat(full.c_str(), &st) && st.st_mtime + FILE_STALE < now) {
+			__tree_unlink(&list, fd, std::string(), it);
+		}
+	}
+#ifndef _WIN32
+	if (fd >= 0) ::close(fd);
+#endif //_WIN32
+}
+
+int
+file_write(char *path, size_t plen, const char *data, size_t dlen, int sync)
+{
+	static std::atomic<uint32_t> seq(0);
+
+	size_t flen = 0;
+	const char *f = __file_fullpath(path, plen, &flen);
+	std::string fpath(f, flen);
+	// unique across processes and restarts, another writer never truncates this temp.
+	char tail[64];
+	snprintf(tail, sizeof(tail), ".%u.%llx.%u.tmp", (unsigned)getpid(), (unsigned long long)time(nullptr), (unsigned)seq++);
+	std::string tpath = fpath + tail;
+	__file_mkdir(&tpath[0], __file_dirname(tpath.c_str(), tpath.size()));
+	__file_sweep(fpath);
+
+	bool ok = false;
+#ifdef _WIN32
+	FILE *file = ::fopen(tpath.c_str(), "wb");
+	if (nullptr == file) {
+		return 0;
+	}
+	ok = dlen == ::fwrite(data, 1, dlen, file);
+	ok = ok && (0 == ::fflush(file)) && (!sync || 0 == ::_commit(::_fileno(file)));
+	ok = (0 == ::fclose(file)) && ok;
+	ok = ok && ::MoveFileExA(tpath.c_str(), fpath.c_str(), MOVEFILE_REPLACE_EXISTING | (sync ? MOVEFILE_WRITE_THROUGH : 0));
+#else //_WIN32
+	int fd = ::open(tpath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+	if (fd < 0) {
+		return 0;
+	}
+	ok = true;
+	for (size_t off = 0; off < dlen && ok; ) {
+		ssize_t n = ::write(fd, data + off, dlen - off);
+		if (n < 0 && EINTR != errno) {
+			ok = false;
+		} else if (n > 0) {
+			off += (size_t)n;
+		}
+	}
+	ok = ok && (!sync || 0 == ::fsync(fd));
+	ok = (0 == ::close(fd)) && ok;
+	ok = ok && 0 == ::rename(tpath.c_str(), fpath.c_str());
+	if (ok && sync) {
+		// the rename is only durable once the directory is.
+		size_t dl = __file_dirname(fpath.c_str(), fpath.size());
+		std::string dir = 0 == dl ? std::string(".") : fpath.substr(0, dl);
+		int dfd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (dfd >= 0) {
+			::fsync(dfd);
+			::close(dfd);
+		}
+	}
+#endif //_WIN32
+
+	if (!ok) {
+		int err = errno;
+		::remove(tpath.c_str());
+		errno = err;
+	}
+	__stat_drop(fpath.c_str(), fpath.size());
+	return ok ? 1 : 0;
+}
+
+void*
+file_map(const char *fpath, size_t *size)
+{
+	void *data = nullptr;
+	*size = 0;
+#ifdef _WIN32
+	HANDLE file = ::CreateFileA(fpath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (INVALID_HANDLE_VALUE == file) {
+		return nullptr;
+	}
+	LARGE_INTEGER fs;
+	if (::GetFileSizeEx(file, &fs) && fs.QuadPart > 0) {
+		HANDLE fmap = ::CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (NULL != fmap) {
+			data = ::MapViewOfFile(fmap, FILE_MAP_READ, 0, 0, 0);
+			if (nullptr != data) {
+				*size = (size_t)fs.QuadPart;
+			}
+			::CloseHandle(fmap);
+		}
+	}
+	::CloseHandle(file);
+#else //_WIN32
+	int fd = ::open(fpath, O_RDONLY);
+	if (-1 == fd) {
+		return nullptr;
+	}
+	struct stat st;
+	if (0 == ::fstat(fd, &st) && st.st_size > 0) {
+		data = ::mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (MAP_FAILED == data) {
+			data = nullptr;
+		} else {
+			*size = (size_t)st.st_size;
+		}
+	}
+	::close(fd);
+#endif //_WIN32
+
+	return data;
+}
+
+void
+file_unmap(void *data, size_t size)
+{
+	if (nullptr == data) {
+		return;
+	}
+#ifdef _WIN32
+	::UnmapViewOfFile(data);
+#else //_WIN32
+	::munmap(data, size);
+#endif //_WIN32
+}
+
+int
+file_clog(log_site *site, int lv, const char *fmt, ...)
 {	
+	if (!log_enabled(lv)) {
+		return 0;
+	}
+
 	va_list vl;
 	va_start(vl, fmt);
-	char *p = _F->_lbuff + __LOG_HEAD_SIZE;
-	*p++ = 'C'; *p++ = LOG_SPLIT;
-	int dlen = vsnprintf(p, _F->_lbuff + sizeof(_F->_lbuff) - p - 1, fmt, vl) + 2;
+	int ret = log_args(site, lv, fmt, vl);
 	va_end(vl);
-	return __file_log(lv, dlen);
+	return ret;
 }
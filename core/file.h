@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include <time.h>
+#include <log.h>
 
 enum {
 	LOG_DEBUG = 0,
@@ -14,20 +15,40 @@ enum {
 };
 #define LOG_SPLIT ' '
 #define PATH_SIZE  256
-#define LOGD(...)  file_clog(LOG_DEBUG, __VA_ARGS__)
-#define LOGI(...)  file_clog(LOG_INFO, __VA_ARGS__)
-#define LOGW(...)  file_clog(LOG_WARN, __VA_ARGS__)
-#define LOGE(...)  file_clog(LOG_ERROR, __VA_ARGS__)
-#define LOGF(...)  file_clog(LOG_FATAL, __VA_ARGS__)
+#define LOG_LINE   4096
+#define FILE_MAP     (64 << 10) // cfile.read maps files from this size up
+#define FILE_TTL     2000       // ms a cached stat holds without a directory watch
+#define FILE_WTTL    30000      // ms it holds with one, ancestors moving go unnoticed by the watch
+#define FILE_STATS   (1 << 16)  // cached stats before the cache starts over
+#define FILE_WATCHES 4096       // directories watched at most
+#define FILE_STALE   600        // s before a leftover file_write temp is removed
+#define LOG_SITE(lv, ...) do { static log_site __log_site = { __FILE__, __LINE__, { 0 }, { 0 }, { 0 } }; file_clog(&__log_site, (lv), __VA_ARGS__); } while (0)
+#define LOGD(...)  LOG_SITE(LOG_DEBUG, __VA_ARGS__)
+#define LOGI(...)  LOG_SITE(LOG_INFO, __VA_ARGS__)
+#define LOGW(...)  LOG_SITE(LOG_WARN, __VA_ARGS__)
+#define LOGE(...)  LOG_SITE(LOG_ERROR, __VA_ARGS__)
+#define LOGF(...)  LOG_SITE(LOG_FATAL, __VA_ARGS__)
 
 struct lua_State;
 
 void
 file_init(lua_State *L, const char *home, size_t hlen);
 
+void
+file_require(lua_State *L);
+
+void
+file_reload(lua_State *L);
+
 void
 file_fini(lua_State *L);
 
+int
+file_mkdir(char *path, size_t plen);
+
+const char*
+file_path(char *path, size_t plen, size_t *flen);
+
 void*
 file_open(char *path, size_t plen, const char *mode);
 
@@ -35,6 +56,25 @@ int
 file_utime(char *path, size_t plen, time_t mtime, time_t atime);
 
 int
-file_clog(int lv, const char *fmt, ...);
+file_rename(char *from, size_t flen, char *to, size_t tlen);
+
+int
+file_remove(char *path, size_t plen);
+
+// writes a temp file beside path and renames it over path, readers see the old or the new
+// content and never a torn one. sync also flushes the data and the rename to disk.
+int
+file_write(char *path, size_t plen, const char *data, size_t dlen, int sync);
+
+// maps a whole file read-only, path is taken as is and not resolved against home.
+void*
+file_map(const char *path, size_t *size);
+
+void
+file_unmap(void *data, size_t size);
+
+// the arguments are captured as they are, formatting happens on the log writer.
+int
+file_clog(log_site *site, int lv, const char *fmt, ...);
 
 #endif // __PD_FILE__
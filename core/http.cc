@@ -1,6 +1,8 @@
 #include <http.h>
 #include <loop.h>
 #include <file.h>
+#include <trace.h>
+#include <util.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -42,9 +44,12 @@ struct http_task
 	time_t       _mtime;
 	FILE        *_file;
 	std::string *_data;
+	util_hash   *_hash;
+	std::string  _url;
 	int          _lfun;
+	bool         _orphan; // its callback went with a reloaded state, nobody attached a new one yet
 
-	http_task(void) : _type(0), _easy(nullptr), _plen(0), _mtime(0), _file(nullptr), _data(nullptr), _lfun(LUA_NOREF)
+	http_task(void) : _type(0), _easy(nullptr), _plen(0), _mtime(0), _file(nullptr), _data(nullptr), _hash(nullptr), _lfun(LUA_NOREF), _orphan(false)
 	{
 		this->_path[0] = '\0';
 	}
@@ -70,6 +75,9 @@ __curl_write_function(char *ptr, size_t size, size_t nmemb, void *userdata)
 			if (nullptr != task->_file)
 			{
 				ret = ::fwrite(ptr, size, nmemb, task->_file);
+				if (nullptr != task->_hash) {
+					util_hash_update(task->_hash, ptr, ret * size);
+				}
 			}
 		}
 
@@ -101,7 +109,7 @@ static inline http_task*
 __curl_easy(void)
 {
 	if (_H->_tasks.size() > REQ_MAX) {
-		LOGW("curl req limit %u", _H->_tasks.size());
+		LOGW("curl req limit %u", (unsigned int)_H->_tasks.size());
 		return nullptr;
 	}
 
@@ -132,6 +140,7 @@ __curl_execute(http_task *task, const char *url)
 {
 	bool ret = false;
 
+	task->_url.assign(url);
 	curl_easy_setopt(task->_easy, CURLOPT_URL, url);
 	if (CURLM_OK == curl_multi_add_handle(_H->_M, task->_easy)) {
 		int easy_count = 0;
@@ -158,6 +167,13 @@ __done_request(lua_State *L, http_task *task, bool succ)
 		}
 	}
 
+	// a transfer started before a reload and never attached again is announced as an event,
+	// type "chttp.done", data the url, sign "ok" or "fail".
+	if (task->_orphan) {
+		loop_event("chttp.done", task->_url.c_str(), succ ? "ok" : "fail");
+		return;
+	}
+
 	if (LUA_NOREF == task->_lfun) {
 		return;
 	}
@@ -171,6 +187,15 @@ __done_request(lua_State *L, http_task *task, bool succ)
 		n += 1;
 	}
 
+	if (succ && nullptr != task->_hash) {
+		uint8_t bin[UTIL_DIGEST];
+		char hex[UTIL_DIGEST * 2];
+		size_t blen = util_hash_final(task->_hash, bin);
+		util_hex(bin, blen, hex);
+		lua_pushlstring(L, hex, blen * 2);
+		n += 1;
+	}
+
 	loop_call(L, n, 0);
 }
 
@@ -193,6 +218,11 @@ __stop_request(lua_State *L, http_task *task)
 		task->_data = nullptr;
 	}
 
+	if (nullptr != task->_hash) {
+		delete task->_hash;
+		task->_hash = nullptr;
+	}
+
 	if (LUA_NOREF != task->_lfun) {
 		luaL_unref(L, LUA_REGISTRYINDEX, task->_lfun);
 		task->_lfun = LUA_NOREF;
@@ -322,6 +352,19 @@ __start_fget(lua_State *L)
 
 		task->_mtime = (time_t)lua_tointeger(L, 4);
 
+		// the file is hashed as it is written, the digest follows the task in the callback.
+		size_t klen = 0;
+		const char *kind = lua_tolstring(L, 6, &klen);
+		if (nullptr != kind) {
+			int k = util_hash_kind(kind, klen);
+			if (k < 0) {
+				break;
+			}
+			task->_hash = new util_hash();
+			util_hash_init(task->_hash, k);
+			lua_settop(L, 5);
+		}
+
 		if (lua_isfunction(L, 5)) {
 			task->_lfun = luaL_ref(L, LUA_REGISTRYINDEX);
 		}
@@ -389,14 +432,84 @@ __start_fput(lua_State *L)
 	return 0;
 }
 
+static http_task*
+__http_orphan(void *p)
+{
+	for (auto it : _H->_tasks) {
+		if (it == p && it->_orphan) {
+			return it;
+		}
+	}
+	return nullptr;
+}
+
+// chttp:pending(), the transfers a reload left running, task to url. chttp:attach gives
+// each of them the callback it would have had, the results are the same.
+static int
+__l2c_pending(lua_State *L)
+{
+	lua_newtable(L);
+	for (auto it : _H->_tasks) {
+		if (it->_orphan) {
+			lua_pushlightuserdata(L, (void*)it);
+			lua_pushlstring(L, it->_url.data(), it->_url.size());
+			lua_rawset(L, -3);
+		}
+	}
+	return 1;
+}
+
+// chttp:attach(task, fn), false when the task is done or was never orphaned.
+static int
+__l2c_attach(lua_State *L)
+{
+	luaL_checktype(L, 2, LUA_TLIGHTUSERDATA);
+	luaL_checktype(L, 3, LUA_TFUNCTION);
+	http_task *task = __http_orphan(lua_touserdata(L, 2));
+	if (nullptr == task) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+
+	lua_settop(L, 3);
+	task->_lfun = luaL_ref(L, LUA_REGISTRYINDEX);
+	task->_orphan = false;
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+// curl is only set up when chttp is first required or a log is first shipped.
+static int
+__http_start(void)
+{
+	if (nullptr != _H) {
+		return 1;
+	}
+
+	CURLM *multi = curl_multi_init();
+	if (nullptr == multi) {
+		return 0;
+	}
+
+	_H = new http_data();
+	_H->_M = multi;
+	return 1;
+}
+
 static int 
 __luaopen_http(lua_State *L)
 {
+	if (!__http_start()) {
+		return luaL_error(L, "curl multi init failed");
+	}
+
 	luaL_Reg r[] = {
 		{ "get", __start_get },
 		{ "post", __start_post },
 		{ "fget", __start_fget },
 		{ "fput", __start_fput },
+		{ "pending", __l2c_pending },
+		{ "attach", __l2c_attach },
 		{ nullptr, nullptr },
 	};
 	luaL_newlib(L, r);
@@ -406,14 +519,7 @@ __luaopen_http(lua_State *L)
 void
 http_init(lua_State *L)
 {
-	if (nullptr != _H) {
-		return;
-	}
-
-	_H = new http_data();
-	_H->_M = curl_multi_init();
-
-    luaL_requiref(L, "chttp", __luaopen_http, 0);
+    util_preload(L, "chttp", __luaopen_http);
 }
 
 size_t
@@ -423,6 +529,8 @@ http_loop(lua_State *L)
 		return 0;
 	}
 
+	TRACE_BEGIN("http_loop", nullptr, 0);
+
 	long timeout_ms = 0;
 	curl_multi_timeout(_H->_M, &timeout_ms);
 	if (timeout_ms <= 0 || timeout_ms > 10)
@@ -438,10 +546,14 @@ http_loop(lua_State *L)
 	int maxfd = -1;
 	curl_multi_fdset(_H->_M, &fdr, &fdw, &fde, &maxfd);
 
+	TRACE_BEGIN("http-select", nullptr, maxfd);
 	select(maxfd+1, &fdr, &fdw, &fde, &tv);
+	TRACE_END("http-select", nullptr, maxfd);
 
+	TRACE_BEGIN("http-perform", nullptr, 0);
 	int easy_count = 0;
 	for (int i = 0; i < 256 && CURLM_CALL_MULTI_PERFORM == curl_multi_perform(_H->_M, &easy_count) && easy_count > 0; ++i);
+	TRACE_END("http-perform", nullptr, easy_count);
 
 	CURLMsg *msg = nullptr;
 	int num = 0;
@@ -460,21 +572,24 @@ http_loop(lua_State *L)
 					curl_easy_getinfo(task->_easy, CURLINFO_RESPONSE_CODE, &code);
 					ok = (code < 400);
 				}
+				TRACE_BEGIN("http-done", nullptr, (uintptr_t)task);
 				__done_request(L, task, ok);
 				__stop_request(L, task);
 				_H->_tasks.remove(task);
+				TRACE_END("http-done", nullptr, (uintptr_t)task);
 				break;
 			}
 		}
 	}
 
+	TRACE_END("http_loop", nullptr, _H->_tasks.size());
 	return _H->_tasks.size();
 }
 
 int
 http_push(char *url, size_t ulen, char *log, size_t llen)
 {
-	if (nullptr == _H || _H->_tasks.size() > REQ_MAX) {
+	if (!__http_start() || _H->_tasks.size() > REQ_MAX) {
 		return 0;
 	}
 
@@ -483,8 +598,9 @@ http_push(char *url, size_t ulen, char *log, size_t llen)
 
 	curl_easy_setopt(task->_easy, CURLOPT_POST, 1L);
 
-	curl_easy_setopt(task->_easy, CURLOPT_POSTFIELDS, log);
+	// copied, the caller's buffer does not live as long as the transfer.
 	curl_easy_setopt(task->_easy, CURLOPT_POSTFIELDSIZE, (long)llen);
+	curl_easy_setopt(task->_easy, CURLOPT_COPYPOSTFIELDS, log);
 
 	if (!__curl_execute(task, url)) {
 		__stop_request(nullptr, task);
@@ -494,6 +610,25 @@ http_push(char *url, size_t ulen, char *log, size_t llen)
 	return 1;
 }
 
+void
+http_reload(lua_State *L)
+{
+	util_preload(L, "chttp", __luaopen_http);
+
+	if (nullptr == _H) {
+		return;
+	}
+
+	// transfers keep running. the new state finds them through chttp:pending and attaches
+	// callbacks again, or hears of them through the event handler when they finish.
+	for (auto it : _H->_tasks) {
+		if (LUA_NOREF != it->_lfun) {
+			it->_orphan = true;
+		}
+		it->_lfun = LUA_NOREF;
+	}
+}
+
 void
 http_fini(lua_State *L)
 {
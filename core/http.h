@@ -17,6 +17,9 @@ http_loop(lua_State *L);
 int
 http_push(char *url, size_t ulen, char *log, size_t llen);
 
+void
+http_reload(lua_State *L);
+
 void
 http_fini(lua_State *L);
 
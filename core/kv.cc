@@ -0,0 +1,1113 @@
+#include <kv.h>
+#include <util.h>
+#include <file.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <lua/lauxlib.h>
+#include <lua/lua.h>
+#include <lua/lualib.h>
+#ifdef __cplusplus
+} //extern "C"
+#endif //__cplusplus
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <windows.h>
+#else //_WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif //_WIN32
+
+// the log is a header and records appended one after the other:
+//   header: "PDKV", u32 version, u64 generation
+//   record: u32 crc of the rest, u8 op, 3 pad, u32 key length, u32 value length, key, value
+// op is 'P' put or 'D' delete, KV_MORE set on all but the last record of a batch, a batch
+// cut short by a crash is dropped as a whole when the log is read back.
+// the index is a header and an open addressing table of slots, mapped and updated in place
+// after each append. it covers the log up to _tail, what is past that is replayed at open,
+// and it is rebuilt from the log when it does not belong to it or was not closed cleanly:
+// the mapped pages reach the disk on their own, after a power loss the header can be there
+// while the slots are not.
+#define KV_MAGIC   "PDKV"
+#define KV_IMAGIC  "PDKI"
+#define KV_VERSION 1
+#define KV_LOGHEAD 16
+#define KV_MORE    0x80
+#define KV_EMPTY   0
+#define KV_GONE    1
+
+static const char *__KV_METATABLE = "__KV_METATABLE__";
+
+struct kv_head
+{
+	char     _magic[4];
+	uint32_t _version;
+	uint64_t _gen;
+	uint64_t _cap;   // slots, a power of two
+	uint64_t _count; // live keys
+	uint64_t _used;  // slots taken, live or deleted
+	uint64_t _tail;  // log bytes the index covers
+	uint64_t _live;  // log bytes of live records
+	uint64_t _dead;  // log bytes of replaced and deleted ones
+	uint64_t _clean; // 1 once everything was synced at close, cleared again at open
+};
+
+struct kv_slot
+{
+	uint64_t _hash;
+	uint64_t _off;     // of the record in the log, KV_EMPTY or KV_GONE
+	uint32_t _klen;
+	uint32_t _vlen;
+	char     _head[8]; // first bytes of the key, prefix scans only read keys that match them
+};
+
+struct kv_rec
+{
+	uint32_t _crc;
+	uint8_t  _op;
+	uint8_t  _pad[3];
+	uint32_t _klen;
+	uint32_t _vlen;
+};
+
+struct kv_store
+{
+	std::string _name;
+	std::string _path;  // without the extension
+	int         _log;
+	int         _idx;
+	uint64_t    _size;  // of the log
+	uint64_t    _gen;
+	kv_head    *_head;
+	kv_slot    *_slots;
+	size_t      _msize;
+#ifdef _WIN32
+	HANDLE      _fmap;
+#endif //_WIN32
+
+	kv_store(void) : _log(-1), _idx(-1), _size(0), _gen(0), _head(nullptr), _slots(nullptr), _msize(0)
+#ifdef _WIN32
+		, _fmap(NULL)
+#endif //_WIN32
+	{
+	}
+};
+
+struct kv_data
+{
+	std::string _home;
+	std::unordered_map<std::string, kv_store*> _stores;
+};
+
+static kv_data *_V = nullptr;
+
+static uint32_t __kv_crcs[256];
+
+static void
+__kv_crc_init(void)
+{
+	for (uint32_t i = 0; i < 256; ++i) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; ++k) {
+			c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+		}
+		__kv_crcs[i] = c;
+	}
+}
+
+static uint32_t
+__kv_crc(uint32_t crc, const char *data, size_t dlen)
+{
+	crc = ~crc;
+	for (size_t i = 0; i < dlen; ++i) {
+		crc = __kv_crcs[(crc ^ (uint8_t)data[i]) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+// fnv-1a, keys are short.
+static uint64_t
+__kv_hash(const char *key, size_t klen)
+{
+	uint64_t h = 0xcbf29ce484222325ull;
+	for (size_t i = 0; i < klen; ++i) {
+		h = (h ^ (uint8_t)key[i]) * 0x100000001b3ull;
+	}
+	return h;
+}
+
+static int
+__kv_fopen(const std::string &path, bool append)
+{
+#ifdef _WIN32
+	return ::_open(path.c_str(), _O_RDWR | _O_CREAT | _O_BINARY | (append ? _O_APPEND : 0), _S_IREAD | _S_IWRITE);
+#else //_WIN32
+	return ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC | (append ? O_APPEND : 0), 0666);
+#endif //_WIN32
+}
+
+static void
+__kv_fclose(int fd)
+{
+	if (fd < 0) {
+		return;
+	}
+#ifdef _WIN32
+	::_close(fd);
+#else //_WIN32
+	::close(fd);
+#endif //_WIN32
+}
+
+static uint64_t
+__kv_fsize(int fd)
+{
+#ifdef _WIN32
+	__int64 size = ::_filelengthi64(fd);
+	return size < 0 ? 0 : (uint64_t)size;
+#else //_WIN32
+	struct stat st;
+	return 0 == ::fstat(fd, &st) ? (uint64_t)st.st_size : 0;
+#endif //_WIN32
+}
+
+static int
+__kv_truncate(int fd, uint64_t size)
+{
+#ifdef _WIN32
+	return 0 == ::_chsize_s(fd, (__int64)size) ? 1 : 0;
+#else //_WIN32
+	return 0 == ::ftruncate(fd, (off_t)size) ? 1 : 0;
+#endif //_WIN32
+}
+
+static int
+__kv_fsync(int fd)
+{
+#ifdef _WIN32
+	return 0 == ::_commit(fd) ? 1 : 0;
+#else //_WIN32
+	return 0 == ::fsync(fd) ? 1 : 0;
+#endif //_WIN32
+}
+
+static int
+__kv_pread(int fd, void *data, size_t size, uint64_t off)
+{
+#ifdef _WIN32
+	if (::_lseeki64(fd, (__int64)off, SEEK_SET) < 0) {
+		return 0;
+	}
+	return (int)size == ::_read(fd, data, (unsigned int)size) ? 1 : 0;
+#else //_WIN32
+	char *p = (char*)data;
+	while (size > 0) {
+		ssize_t n = ::pread(fd, p, size, (off_t)off);
+		if (n <= 0) {
+			if (n < 0 && EINTR == errno) continue;
+			return 0;
+		}
+		p += n; size -= (size_t)n; off += (uint64_t)n;
+	}
+	return 1;
+#endif //_WIN32
+}
+
+static int
+__kv_write(int fd, const void *data, size_t size)
+{
+	const char *p = (const char*)data;
+	while (size > 0) {
+#ifdef _WIN32
+		int n = ::_write(fd, p, (unsigned int)size);
+#else //_WIN32
+		ssize_t n = ::write(fd, p, size);
+		if (n < 0 && EINTR == errno) continue;
+#endif //_WIN32
+		if (n <= 0) {
+			return 0;
+		}
+		p += n; size -= (size_t)n;
+	}
+	return 1;
+}
+
+static int
+__kv_rename(const std::string &from, const std::string &to)
+{
+#ifdef _WIN32
+	return ::MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) ? 1 : 0;
+#else //_WIN32
+	return 0 == ::rename(from.c_str(), to.c_str()) ? 1 : 0;
+#endif //_WIN32
+}
+
+static void
+__kv_unmap(kv_store *kv)
+{
+	if (nullptr == kv->_head) {
+		return;
+	}
+#ifdef _WIN32
+	::UnmapViewOfFile(kv->_head);
+	::CloseHandle(kv->_fmap); kv->_fmap = NULL;
+#else //_WIN32
+	::munmap(kv->_head, kv->_msize);
+#endif //_WIN32
+	kv->_head = nullptr; kv->_slots = nullptr; kv->_msize = 0;
+}
+
+// maps the index file of kv at size, it is grown to it first.
+static int
+__kv_map(kv_store *kv, size_t size)
+{
+	if (__kv_fsize(kv->_idx) != size && !__kv_truncate(kv->_idx, size)) {
+		return 0;
+	}
+	void *data = nullptr;
+#ifdef _WIN32
+	kv->_fmap = ::CreateFileMappingA((HANDLE)::_get_osfhandle(kv->_idx), NULL, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32), (DWORD)size, NULL);
+	if (NULL == kv->_fmap) {
+		return 0;
+	}
+	data = ::MapViewOfFile(kv->_fmap, FILE_MAP_WRITE, 0, 0, size);
+	if (nullptr == data) {
+		::CloseHandle(kv->_fmap); kv->_fmap = NULL;
+		return 0;
+	}
+#else //_WIN32
+	data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, kv->_idx, 0);
+	if (MAP_FAILED == data) {
+		return 0;
+	}
+#endif //_WIN32
+	kv->_head = (kv_head*)data;
+	kv->_slots = (kv_slot*)(kv->_head + 1);
+	kv->_msize = size;
+	return 1;
+}
+
+static int
+__kv_msync(kv_store *kv)
+{
+	if (nullptr == kv->_head) {
+		return 0;
+	}
+#ifdef _WIN32
+	return ::FlushViewOfFile(kv->_head, kv->_msize) ? 1 : 0;
+#else //_WIN32
+	return 0 == ::msync(kv->_head, kv->_msize, MS_SYNC) ? 1 : 0;
+#endif //_WIN32
+}
+
+// the slots are synced before the header says so, the flag never covers pages still in flight.
+static int
+__kv_mark(kv_store *kv, uint64_t clean)
+{
+	kv->_head->_clean = clean;
+#ifdef _WIN32
+	return ::FlushViewOfFile(kv->_head, sizeof(kv_head)) ? 1 : 0;
+#else //_WIN32
+	return 0 == ::msync(kv->_head, sizeof(kv_head), MS_SYNC) ? 1 : 0;
+#endif //_WIN32
+}
+
+static uint64_t
+__kv_recsize(uint32_t klen, uint32_t vlen)
+{
+	return sizeof(kv_rec) + klen + vlen;
+}
+
+// the slot key is in, or the one it would go to. *found tells which.
+static kv_slot*
+__kv_find(kv_store *kv, const char *key, size_t klen, uint64_t hash, bool *found)
+{
+	uint64_t mask = kv->_head->_cap - 1;
+	kv_slot *free = nullptr;
+	std::string temp;
+	for (uint64_t i = hash & mask, n = 0; n <= mask; i = (i + 1) & mask, ++n) {
+		kv_slot *s = kv->_slots + i;
+		if (KV_EMPTY == s->_off) {
+			*found = false;
+			return nullptr != free ? free : s;
+		}
+		if (KV_GONE == s->_off) {
+			if (nullptr == free) free = s;
+			continue;
+		}
+		if (s->_hash != hash || s->_klen != klen || 0 != memcmp(s->_head, key, std::min(klen, sizeof(s->_head)))) {
+			continue;
+		}
+		if (klen > sizeof(s->_head)) {
+			temp.resize(klen);
+			if (!__kv_pread(kv->_log, &temp[0], klen, s->_off + sizeof(kv_rec)) || 0 != memcmp(temp.data(), key, klen)) {
+				continue;
+			}
+		}
+		*found = true;
+		return s;
+	}
+	*found = false;
+	return free;
+}
+
+static int __kv_grow(kv_store *kv, uint64_t cap);
+
+// points the index at the record at off. applying a record twice changes nothing,
+// which is what lets the log past _tail be replayed after a crash.
+static int
+__kv_apply(kv_store *kv, uint8_t op, const char *key, uint32_t klen, uint32_t vlen, uint64_t off)
+{
+	kv_head *h = kv->_head;
+	if ((h->_used + 1) * 100 > h->_cap * KV_LOAD && !__kv_grow(kv, h->_cap * 2)) {
+		return 0;
+	}
+	h = kv->_head;
+
+	uint64_t hash = __kv_hash(key, klen);
+	uint64_t rsize = __kv_recsize(klen, vlen);
+	bool found = false;
+	kv_slot *s = __kv_find(kv, key, klen, hash, &found);
+	if (nullptr == s) {
+		return 0;
+	}
+	if (found && s->_off == off) {
+		return 1;
+	}
+
+	if (found) {
+		uint64_t osize = __kv_recsize(s->_klen, s->_vlen);
+		h->_live -= std::min(h->_live, osize);
+		h->_dead += osize;
+	}
+
+	if ('D' == op) {
+		h->_dead += rsize;
+		if (found) {
+			s->_off = KV_GONE;
+			--h->_count;
+		}
+		return 1;
+	}
+
+	if (!found) {
+		if (KV_EMPTY == s->_off) ++h->_used;
+		++h->_count;
+	}
+	s->_hash = hash;
+	s->_off = off;
+	s->_klen = klen;
+	s->_vlen = vlen;
+	memset(s->_head, 0, sizeof(s->_head));
+	memcpy(s->_head, key, std::min((size_t)klen, sizeof(s->_head)));
+	h->_live += rsize;
+	return 1;
+}
+
+static void
+__kv_fresh(kv_head *h, uint64_t gen, uint64_t cap)
+{
+	memset(h, 0, sizeof(*h));
+	memcpy(h->_magic, KV_IMAGIC, 4);
+	h->_version = KV_VERSION;
+	h->_gen = gen;
+	h->_cap = cap;
+	h->_tail = KV_LOGHEAD;
+}
+
+// rebuilds the index at cap slots from the live slots of the current one, through a
+// temp file renamed over the index.
+static int
+__kv_grow(kv_store *kv, uint64_t cap)
+{
+	std::string ipath = kv->_path + ".idx", tpath = ipath + ".tmp";
+	int fd = __kv_fopen(tpath, false);
+	if (fd < 0) {
+		return 0;
+	}
+
+	kv_store tmp;
+	tmp._idx = fd;
+	tmp._log = kv->_log;
+	if (!__kv_truncate(fd, 0) || !__kv_map(&tmp, sizeof(kv_head) + cap * sizeof(kv_slot))) {
+		__kv_fclose(fd);
+		return 0;
+	}
+
+	kv_head *h = tmp._head;
+	*h = *kv->_head;
+	h->_cap = cap;
+	h->_used = h->_count;
+	uint64_t mask = cap - 1;
+	for (uint64_t i = 0; nullptr != kv->_head && i < kv->_head->_cap; ++i) {
+		const kv_slot *s = kv->_slots + i;
+		if (s->_off <= KV_GONE) {
+			continue;
+		}
+		uint64_t j = s->_hash & mask;
+		while (KV_EMPTY != tmp._slots[j]._off) j = (j + 1) & mask;
+		tmp._slots[j] = *s;
+	}
+
+	__kv_unmap(&tmp);
+	__kv_fclose(fd);
+	__kv_unmap(kv);
+	__kv_fclose(kv->_idx); kv->_idx = -1;
+	if (!__kv_rename(tpath, ipath)) {
+		return 0;
+	}
+	kv->_idx = __kv_fopen(ipath, false);
+	return kv->_idx >= 0 && __kv_map(kv, sizeof(kv_head) + cap * sizeof(kv_slot));
+}
+
+// applies the log from off on, up to where it is torn, and cuts the log there.
+static int
+__kv_replay(kv_store *kv, uint64_t off)
+{
+	std::vector<char> buf;
+	struct pending { uint8_t _op; uint32_t _klen, _vlen; uint64_t _off; std::string _key; };
+	std::vector<pending> batch;
+	uint64_t good = off;
+	while (off + sizeof(kv_rec) <= kv->_size) {
+		kv_rec rec;
+		if (!__kv_pread(kv->_log, &rec, sizeof(rec), off)) {
+			break;
+		}
+		uint64_t rsize = __kv_recsize(rec._klen, rec._vlen);
+		uint8_t op = rec._op & ~KV_MORE;
+		if (('P' != op && 'D' != op) || off + rsize > kv->_size) {
+			break;
+		}
+		buf.resize((size_t)(rsize - sizeof(uint32_t)));
+		if (!__kv_pread(kv->_log, &buf[0], buf.size(), off + sizeof(uint32_t)) || rec._crc != __kv_crc(0, buf.data(), buf.size())) {
+			break;
+		}
+
+		pending p;
+		p._op = op; p._klen = rec._klen; p._vlen = rec._vlen; p._off = off;
+		p._key.assign(buf.data() + sizeof(kv_rec) - sizeof(uint32_t), rec._klen);
+		batch.push_back(std::move(p));
+		off += rsize;
+		if (0 != (rec._op & KV_MORE)) {
+			continue;
+		}
+
+		for (auto &it : batch) {
+			if (!__kv_apply(kv, it._op, it._key.data(), it._klen, it._vlen, it._off)) {
+				return 0;
+			}
+		}
+		batch.clear();
+		good = off;
+		kv->_head->_tail = good;
+	}
+
+	if (good < kv->_size) {
+		LOGW("kv %s: log cut at %llu of %llu", kv->_name.c_str(), (unsigned long long)good, (unsigned long long)kv->_size);
+		if (!__kv_truncate(kv->_log, good)) {
+			return 0;
+		}
+		kv->_size = good;
+	}
+	kv->_head->_tail = good;
+	return 1;
+}
+
+// a new index over the whole log.
+static int
+__kv_rebuild(kv_store *kv)
+{
+	__kv_unmap(kv);
+	uint64_t cap = KV_SLOTS;
+	while (cap * KV_LOAD / 100 < kv->_size / 256) cap *= 2;
+	if (!__kv_truncate(kv->_idx, 0) || !__kv_map(kv, sizeof(kv_head) + cap * sizeof(kv_slot))) {
+		return 0;
+	}
+	__kv_fresh(kv->_head, kv->_gen, cap);
+	return __kv_replay(kv, KV_LOGHEAD);
+}
+
+static int
+__kv_loghead(kv_store *kv)
+{
+	char head[KV_LOGHEAD];
+	kv->_size = __kv_fsize(kv->_log);
+	if (kv->_size < sizeof(head)) {
+		// new, or torn before its header made it.
+		kv->_gen = (uint64_t)time(nullptr);
+		memcpy(head, KV_MAGIC, 4);
+		uint32_t v = KV_VERSION;
+		memcpy(head + 4, &v, 4);
+		memcpy(head + 8, &kv->_gen, 8);
+		if (!__kv_truncate(kv->_log, 0) || !__kv_write(kv->_log, head, sizeof(head))) {
+			return 0;
+		}
+		kv->_size = sizeof(head);
+		return 1;
+	}
+
+	uint32_t v = 0;
+	if (!__kv_pread(kv->_log, head, sizeof(head), 0) || 0 != memcmp(head, KV_MAGIC, 4) || (memcpy(&v, head + 4, 4), KV_VERSION != v)) {
+		LOGE("kv %s: not a store log", kv->_name.c_str());
+		return 0;
+	}
+	memcpy(&kv->_gen, head + 8, 8);
+	return 1;
+}
+
+static int
+__kv_load(kv_store *kv)
+{
+	kv->_log = __kv_fopen(kv->_path + ".log", true);
+	kv->_idx = __kv_fopen(kv->_path + ".idx", false);
+	if (kv->_log < 0 || kv->_idx < 0 || !__kv_loghead(kv)) {
+		return 0;
+	}
+
+	uint64_t isize = __kv_fsize(kv->_idx);
+	kv_head h;
+	bool ok = isize >= sizeof(h) && __kv_pread(kv->_idx, &h, sizeof(h), 0)
+		&& 0 == memcmp(h._magic, KV_IMAGIC, 4) && KV_VERSION == h._version && kv->_gen == h._gen
+		&& h._cap >= KV_SLOTS && 0 == (h._cap & (h._cap - 1)) && isize == sizeof(h) + h._cap * sizeof(kv_slot)
+		&& h._tail >= KV_LOGHEAD && h._tail <= kv->_size && 1 == h._clean;
+	if (ok && (!__kv_map(kv, (size_t)isize) || !__kv_mark(kv, 0))) {
+		return 0;
+	}
+
+	if (ok && h._tail < kv->_size) {
+		// the process died after an append, the slots must not point past the covered log.
+		for (uint64_t i = 0; ok && i < h._cap; ++i) {
+			const kv_slot *s = kv->_slots + i;
+			ok = s->_off <= KV_GONE || s->_off + __kv_recsize(s->_klen, s->_vlen) <= kv->_size;
+		}
+		ok = ok && __kv_replay(kv, h._tail);
+	}
+
+	if (!ok) {
+		if (isize > 0) {
+			LOGW("kv %s: index rebuilt from the log", kv->_name.c_str());
+		}
+		return __kv_rebuild(kv);
+	}
+	return 1;
+}
+
+static void
+__kv_unload(kv_store *kv)
+{
+	__kv_unmap(kv);
+	__kv_fclose(kv->_idx); kv->_idx = -1;
+	__kv_fclose(kv->_log); kv->_log = -1;
+}
+
+kv_store*
+kv_open(const char *name, size_t nlen)
+{
+	if (nullptr == _V || 0 == nlen) {
+		return nullptr;
+	}
+	for (size_t i = 0; i < nlen; ++i) {
+		char c = name[i];
+		if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || '_' == c || '-' == c || '.' == c)) {
+			return nullptr;
+		}
+	}
+
+	std::string key(name, nlen);
+	kv_store *&kv = _V->_stores[key];
+	if (nullptr == kv) {
+		kv = new kv_store();
+		kv->_name = key;
+		kv->_path = _V->_home + key;
+	}
+	if (nullptr != kv->_head) {
+		return kv;
+	}
+
+	std::string dir = _V->_home;
+	file_mkdir(&dir[0], dir.size());
+	if (!__kv_load(kv)) {
+		__kv_unload(kv);
+		return nullptr;
+	}
+	return kv;
+}
+
+// appends the records of a batch in one write, then points the index at them.
+struct kv_op
+{
+	const char *_key;
+	size_t      _klen;
+	const char *_val;
+	size_t      _vlen;
+	uint8_t     _op;
+};
+
+static int
+__kv_commit(kv_store *kv, const std::vector<kv_op> &ops, int sync)
+{
+	if (nullptr == kv || nullptr == kv->_head) {
+		return 0;
+	}
+	if (ops.empty()) {
+		return 1;
+	}
+
+	std::string buf;
+	for (size_t i = 0; i < ops.size(); ++i) {
+		const kv_op &o = ops[i];
+		if (o._klen > 0xffffffffu || o._vlen > 0xffffffffu) {
+			return 0;
+		}
+		size_t at = buf.size();
+		kv_rec rec;
+		rec._crc = 0;
+		rec._op = o._op | (i + 1 < ops.size() ? KV_MORE : 0);
+		memset(rec._pad, 0, sizeof(rec._pad));
+		rec._klen = (uint32_t)o._klen;
+		rec._vlen = (uint32_t)o._vlen;
+		buf.append((const char*)&rec, sizeof(rec));
+		buf.append(o._key, o._klen);
+		buf.append(o._val, o._vlen);
+		rec._crc = __kv_crc(0, buf.data() + at + sizeof(uint32_t), buf.size() - at - sizeof(uint32_t));
+		memcpy(&buf[at], &rec._crc, sizeof(rec._crc));
+	}
+
+	uint64_t off = kv->_size;
+	if (!__kv_write(kv->_log, buf.data(), buf.size())) {
+		// a partial write is cut off by the next open.
+		LOGE("kv %s: append failed: %s", kv->_name.c_str(), strerror(errno));
+		kv->_size = __kv_fsize(kv->_log);
+		return 0;
+	}
+	kv->_size += buf.size();
+	if (sync && !__kv_fsync(kv->_log)) {
+		return 0;
+	}
+
+	for (auto &o : ops) {
+		if (!__kv_apply(kv, o._op, o._key, (uint32_t)o._klen, (uint32_t)o._vlen, off)) {
+			return 0;
+		}
+		off += __kv_recsize((uint32_t)o._klen, (uint32_t)o._vlen);
+	}
+	kv->_head->_tail = kv->_size;
+	if (sync) {
+		__kv_msync(kv);
+	}
+
+	if (kv->_head->_dead > KV_COMPACT && kv->_head->_dead > kv->_head->_live) {
+		kv_compact(kv);
+	}
+	return 1;
+}
+
+int
+kv_get(kv_store *kv, const char *key, size_t klen, std::string &val)
+{
+	if (nullptr == kv || nullptr == kv->_head) {
+		return 0;
+	}
+	bool found = false;
+	kv_slot *s = __kv_find(kv, key, klen, __kv_hash(key, klen), &found);
+	if (!found) {
+		return 0;
+	}
+	val.resize(s->_vlen);
+	return 0 == s->_vlen || __kv_pread(kv->_log, &val[0], s->_vlen, s->_off + sizeof(kv_rec) + s->_klen) ? 1 : 0;
+}
+
+int
+kv_put(kv_store *kv, const char *key, size_t klen, const char *val, size_t vlen, int sync)
+{
+	std::vector<kv_op> ops(1);
+	ops[0]._key = key; ops[0]._klen = klen;
+	ops[0]._val = val; ops[0]._vlen = vlen;
+	ops[0]._op = 'P';
+	return __kv_commit(kv, ops, sync);
+}
+
+int
+kv_del(kv_store *kv, const char *key, size_t klen, int sync)
+{
+	if (nullptr == kv || nullptr == kv->_head) {
+		return 0;
+	}
+	bool found = false;
+	__kv_find(kv, key, klen, __kv_hash(key, klen), &found);
+	if (!found) {
+		return 1;
+	}
+
+	std::vector<kv_op> ops(1);
+	ops[0]._key = key; ops[0]._klen = klen;
+	ops[0]._val = ""; ops[0]._vlen = 0;
+	ops[0]._op = 'D';
+	return __kv_commit(kv, ops, sync);
+}
+
+// writes the live records to a new log of the next generation and renames it over the old one.
+// the index is renamed after it, a crash in between leaves an index of the old generation,
+// which is rebuilt from the new log at the next open.
+int
+kv_compact(kv_store *kv)
+{
+	if (nullptr == kv || nullptr == kv->_head) {
+		return 0;
+	}
+
+	std::string lpath = kv->_path + ".log", ltmp = lpath + ".tmp";
+	std::string ipath = kv->_path + ".idx", itmp = ipath + ".tmp";
+	kv_store tmp;
+	tmp._name = kv->_name;
+	tmp._path = kv->_path;
+	tmp._log = __kv_fopen(ltmp, true);
+	tmp._idx = __kv_fopen(itmp, false);
+	bool ok = tmp._log >= 0 && tmp._idx >= 0 && __kv_truncate(tmp._log, 0);
+	tmp._gen = kv->_gen + 1;
+
+	// sized so it never grows while it is filled, a grow would rename it over the live index.
+	uint64_t cap = KV_SLOTS;
+	while (cap * KV_LOAD / 100 <= kv->_head->_count * 2) cap *= 2;
+	if (ok) {
+		char head[KV_LOGHEAD];
+		memcpy(head, KV_MAGIC, 4);
+		uint32_t v = KV_VERSION;
+		memcpy(head + 4, &v, 4);
+		memcpy(head + 8, &tmp._gen, 8);
+		ok = __kv_write(tmp._log, head, sizeof(head)) && __kv_truncate(tmp._idx, 0) && __kv_map(&tmp, sizeof(kv_head) + cap * sizeof(kv_slot));
+		tmp._size = sizeof(head);
+	}
+	if (ok) {
+		__kv_fresh(tmp._head, tmp._gen, cap);
+	}
+
+	std::string buf, rec;
+	for (uint64_t i = 0; ok && i < kv->_head->_cap; ++i) {
+		const kv_slot *s = kv->_slots + i;
+		if (s->_off <= KV_GONE) {
+			continue;
+		}
+		uint64_t rsize = __kv_recsize(s->_klen, s->_vlen);
+		rec.resize((size_t)rsize);
+		ok = __kv_pread(kv->_log, &rec[0], rec.size(), s->_off);
+		if (!ok) {
+			break;
+		}
+		// a record of a batch stands alone now.
+		rec[4] = (char)(rec[4] & ~KV_MORE);
+		uint32_t crc = __kv_crc(0, rec.data() + sizeof(uint32_t), rec.size() - sizeof(uint32_t));
+		memcpy(&rec[0], &crc, sizeof(crc));
+		uint64_t off = tmp._size + buf.size();
+		buf.append(rec);
+		ok = __kv_apply(&tmp, 'P', rec.data() + sizeof(kv_rec), s->_klen, s->_vlen, off);
+		if (ok && buf.size() >= (1 << 20)) {
+			ok = __kv_write(tmp._log, buf.data(), buf.size());
+			tmp._size += buf.size();
+			buf.clear();
+		}
+	}
+	if (ok && !buf.empty()) {
+		ok = __kv_write(tmp._log, buf.data(), buf.size());
+		tmp._size += buf.size();
+	}
+	if (ok) {
+		tmp._head->_tail = tmp._size;
+		ok = __kv_fsync(tmp._log) && __kv_msync(&tmp) && __kv_mark(&tmp, 1);
+	}
+
+	uint64_t before = kv->_size;
+	__kv_unload(&tmp);
+	if (!ok) {
+		LOGE("kv %s: compaction failed: %s", kv->_name.c_str(), strerror(errno));
+		::remove(ltmp.c_str());
+		::remove(itmp.c_str());
+		return 0;
+	}
+
+	__kv_unload(kv);
+	ok = __kv_rename(ltmp, lpath) && __kv_rename(itmp, ipath);
+	if (!__kv_load(kv)) {
+		__kv_unload(kv);
+		return 0;
+	}
+	LOGI("kv %s: compacted %llu to %llu bytes", kv->_name.c_str(), (unsigned long long)before, (unsigned long long)kv->_size);
+	return ok ? 1 : 0;
+}
+
+void
+kv_close(kv_store *kv)
+{
+	if (nullptr == kv || nullptr == kv->_head) {
+		return;
+	}
+	kv->_head->_tail = kv->_size;
+	if (__kv_fsync(kv->_log) && __kv_msync(kv)) {
+		__kv_mark(kv, 1);
+	}
+	__kv_unload(kv);
+}
+
+struct kv_ud
+{
+	kv_store *_kv;
+};
+
+static kv_store*
+__kv_check(lua_State *L)
+{
+	kv_ud *ud = (kv_ud*)luaL_checkudata(L, 1, __KV_METATABLE);
+	luaL_argcheck(L, nullptr != ud->_kv && nullptr != ud->_kv->_head, 1, "closed store");
+	return ud->_kv;
+}
+
+static int
+__l2c_open(lua_State *L)
+{
+	size_t nlen = 0;
+	const char *name = luaL_checklstring(L, 1, &nlen);
+	kv_store *kv = kv_open(name, nlen);
+	if (nullptr == kv) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "kv %s: cannot open", name);
+		return 2;
+	}
+
+	kv_ud *ud = (kv_ud*)lua_newuserdata(L, sizeof(kv_ud));
+	ud->_kv = kv;
+	luaL_getmetatable(L, __KV_METATABLE);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+static int
+__l2c_get(lua_State *L)
+{
+	kv_store *kv = __kv_check(L);
+	size_t klen = 0;
+	const char *key = luaL_checklstring(L, 2, &klen);
+
+	std::string val;
+	if (!kv_get(kv, key, klen, val)) {
+		return 0;
+	}
+	lua_pushlstring(L, val.data(), val.size());
+	return 1;
+}
+
+static int
+__l2c_put(lua_State *L)
+{
+	kv_store *kv = __kv_check(L);
+	size_t klen = 0, vlen = 0;
+	const char *key = luaL_checklstring(L, 2, &klen);
+	const char *val = luaL_checklstring(L, 3, &vlen);
+
+	lua_pushboolean(L, kv_put(kv, key, klen, val, vlen, lua_toboolean(L, 4)));
+	return 1;
+}
+
+static int
+__l2c_del(lua_State *L)
+{
+	kv_store *kv = __kv_check(L);
+	size_t klen = 0;
+	const char *key = luaL_checklstring(L, 2, &klen);
+
+	lua_pushboolean(L, kv_del(kv, key, klen, lua_toboolean(L, 3)));
+	return 1;
+}
+
+// db:batch({ key = value or false, ... }[, sync]), false deletes. written as one, a crash
+// keeps all of it or none.
+static int
+__l2c_batch(lua_State *L)
+{
+	kv_store *kv = __kv_check(L);
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	std::vector<kv_op> ops;
+	lua_pushnil(L);
+	while (0 != lua_next(L, 2)) {
+		kv_op o;
+		if (LUA_TSTRING != lua_type(L, -2)) {
+			return luaL_argerror(L, 2, "keys must be strings");
+		}
+		o._key = lua_tolstring(L, -2, &o._klen);
+		if (lua_isboolean(L, -1) && !lua_toboolean(L, -1)) {
+			o._val = ""; o._vlen = 0;
+			o._op = 'D';
+		} else if (LUA_TSTRING == lua_type(L, -1)) {
+			o._val = lua_tolstring(L, -1, &o._vlen);
+			o._op = 'P';
+		} else {
+			return luaL_argerror(L, 2, "values must be strings or false");
+		}
+		// the strings stay alive in the table, only the value is popped.
+		ops.push_back(o);
+		lua_pop(L, 1);
+	}
+
+	lua_pushboolean(L, __kv_commit(kv, ops, lua_toboolean(L, 3)));
+	return 1;
+}
+
+// db:scan(prefix[, limit]), key -> value of the keys starting with prefix, the first limit
+// of them in key order.
+static int
+__l2c_scan(lua_State *L)
+{
+	kv_store *kv = __kv_check(L);
+	size_t plen = 0;
+	const char *prefix = luaL_optlstring(L, 2, "", &plen);
+	lua_Integer limit = luaL_optinteger(L, 3, 0);
+
+	struct hit { std::string _key; const kv_slot *_slot; };
+	std::vector<hit> hits;
+	size_t hlen = std::min(plen, sizeof(kv->_slots->_head));
+	for (uint64_t i = 0; i < kv->_head->_cap; ++i) {
+		const kv_slot *s = kv->_slots + i;
+		if (s->_off <= KV_GONE || s->_klen < plen || 0 != memcmp(s->_head, prefix, hlen)) {
+			continue;
+		}
+		hit h;
+		h._key.resize(s->_klen);
+		if (s->_klen > 0 && !__kv_pread(kv->_log, &h._key[0], s->_klen, s->_off + sizeof(kv_rec))) {
+			continue;
+		}
+		if (0 == memcmp(h._key.data(), prefix, plen)) {
+			h._slot = s;
+			hits.push_back(std::move(h));
+		}
+	}
+	std::sort(hits.begin(), hits.end(), [](const hit &a, const hit &b) { return a._key < b._key; });
+	if (limit > 0 && (size_t)limit < hits.size()) {
+		hits.resize((size_t)limit);
+	}
+
+	lua_createtable(L, 0, (int)hits.size());
+	std::string val;
+	for (auto &it : hits) {
+		val.resize(it._slot->_vlen);
+		if (it._slot->_vlen > 0 && !__kv_pread(kv->_log, &val[0], val.size(), it._slot->_off + sizeof(kv_rec) + it._slot->_klen)) {
+			continue;
+		}
+		lua_pushlstring(L, it._key.data(), it._key.size());
+		lua_pushlstring(L, val.data(), val.size());
+		lua_rawset(L, -3);
+	}
+	return 1;
+}
+
+static int
+__l2c_compact(lua_State *L)
+{
+	lua_pushboolean(L, kv_compact(__kv_check(L)));
+	return 1;
+}
+
+static int
+__l2c_sync(lua_State *L)
+{
+	kv_store *kv = __kv_check(L);
+	lua_pushboolean(L, __kv_fsync(kv->_log) && __kv_msync(kv));
+	return 1;
+}
+
+// db:stat(), keys, live and dead log bytes.
+static int
+__l2c_stat(lua_State *L)
+{
+	kv_store *kv = __kv_check(L);
+	lua_pushnumber(L, (lua_Number)kv->_head->_count);
+	lua_pushnumber(L, (lua_Number)kv->_head->_live);
+	lua_pushnumber(L, (lua_Number)kv->_head->_dead);
+	return 3;
+}
+
+static int
+__l2c_close(lua_State *L)
+{
+	kv_ud *ud = (kv_ud*)luaL_checkudata(L, 1, __KV_METATABLE);
+	kv_close(ud->_kv);
+	return 0;
+}
+
+static int
+__luaopen_kv(lua_State *L)
+{
+	luaL_Reg m[] = {
+		{ "get", __l2c_get },
+		{ "put", __l2c_put },
+		{ "del", __l2c_del },
+		{ "batch", __l2c_batch },
+		{ "scan", __l2c_scan },
+		{ "compact", __l2c_compact },
+		{ "sync", __l2c_sync },
+		{ "stat", __l2c_stat },
+		{ "close", __l2c_close },
+		{ nullptr, nullptr },
+	};
+	luaL_newmetatable(L, __KV_METATABLE);
+	luaL_newlib(L, m);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	luaL_Reg r[] = {
+		{ "open", __l2c_open },
+		{ nullptr, nullptr },
+	};
+	luaL_newlib(L, r);
+	return 1;
+}
+
+void
+kv_init(lua_State *L, const char *home, size_t hlen)
+{
+	if (nullptr == _V) {
+		_V = new kv_data();
+		_V->_home.assign(home, hlen);
+		_V->_home.append("kv/");
+		__kv_crc_init();
+	}
+
+	util_preload(L, "ckv", __luaopen_kv);
+}
+
+void
+kv_reload(lua_State *L)
+{
+	if (nullptr == _V) {
+		return;
+	}
+
+	// stores stay open, the new state opens them again by name.
+	util_preload(L, "ckv", __luaopen_kv);
+}
+
+void
+kv_fini(lua_State *L)
+{
+	if (nullptr == _V) {
+		return;
+	}
+
+	for (auto &it : _V->_stores) {
+		kv_close(it.second);
+		delete it.second;
+	}
+	delete _V; _V = nullptr;
+}
@@ -0,0 +1,46 @@
+#ifndef __PD_KV__
+#define __PD_KV__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#define KV_SLOTS   1024      // index slots a new store starts with
+#define KV_LOAD    70        // percent of the slots taken before the index grows
+#define KV_COMPACT (1 << 20) // dead log bytes a store keeps before it compacts, once they outweigh the live ones
+
+struct lua_State;
+struct kv_store;
+
+void
+kv_init(lua_State *L, const char *home, size_t hlen);
+
+// HOME/kv/<name>.log holds the records, HOME/kv/<name>.idx the mapped hash index over them.
+// a store stays open until kv_close or kv_fini, opening it again gives the same one.
+kv_store*
+kv_open(const char *name, size_t nlen);
+
+// 1 and the value in val, 0 when there is no such key.
+int
+kv_get(kv_store *kv, const char *key, size_t klen, std::string &val);
+
+int
+kv_put(kv_store *kv, const char *key, size_t klen, const char *val, size_t vlen, int sync);
+
+int
+kv_del(kv_store *kv, const char *key, size_t klen, int sync);
+
+// rewrites the log with only the live records.
+int
+kv_compact(kv_store *kv);
+
+void
+kv_close(kv_store *kv);
+
+void
+kv_reload(lua_State *L);
+
+void
+kv_fini(lua_State *L);
+
+#endif // __PD_KV__
@@ -2,6 +2,7 @@
 #include <loop.h>
 #include <file.h>
 #include <util.h>
+#include <trace.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -523,7 +524,9 @@ __l2c_send(lua_State *L)
 		} else {
 			memcpy(link->_sbuf, ((char*)v[1].iov_base) + n - v[0].iov_len, vl - n);
 		}
+		TRACE_BEGIN("link-send", nullptr, link->_sock);
 		__link_send(link);
+		TRACE_END("link-send", nullptr, link->_sock);
 	} else {
 		link->_step = link_item::_CLOSE;
 	}
@@ -563,7 +566,9 @@ __l2c_fsend(lua_State *L)
 	link->_sbuf = (char*)::malloc(link_item::FILE_BUFF_SIZE);
 	link->_slen = snprintf(link->_sbuf, link_item::FILE_BUFF_SIZE, "HTTP/1.1 200 OK\r\n%sContent-Length: %u\r\n\r\n", h, (unsigned int)link->_flen);
 
+	TRACE_BEGIN("link-send", nullptr, link->_sock);
 	__link_fsend(link);
+	TRACE_END("link-send", nullptr, link->_sock);
 
 	return 0;
 }
@@ -598,32 +603,19 @@ __l2c_bind(lua_State *L)
 	return 0;
 }
 
+// sockets are only set up, and 9527 only listened on, when clink is first required.
 static int
-__luaopen_link(lua_State *L)
-{
-	luaL_Reg r[] = {
-			{ "bind", __l2c_bind },
-			{ "send", __l2c_send },
-			{ "fsend", __l2c_fsend },
-			{ "close", __l2c_close },
-			{ nullptr, nullptr },
-	};
-	luaL_newlib(L, r);
-	return 1;
-}
-
-void
-link_init(lua_State *L)
+__link_start(void)
 {
 	if (nullptr != _K) {
-		return;
+		return 1;
 	}
 
 #ifdef  _WIN32
 	WSADATA wsa;
 	int ret = WSAStartup(MAKEWORD(2, 2), &wsa);
 	if (0 != ret || 2 != LOBYTE(wsa.wVersion) || 2 != HIBYTE(wsa.wVersion)) {
-		return;
+		return 0;
 	}
 #endif//_WIN32
 
@@ -631,11 +623,38 @@ link_init(lua_State *L)
 	if (!__link_listen()) {
 		LOGF("link-listen failed");
 		delete _K; _K = nullptr;
-		return;
+#ifdef  _WIN32
+		::WSACleanup();
+#endif//_WIN32
+		return 0;
 	}
 	LOGE("link-listen success");
 
-	luaL_requiref(L, "clink", __luaopen_link, 0);
+	return 1;
+}
+
+static int
+__luaopen_link(lua_State *L)
+{
+	if (!__link_start()) {
+		return luaL_error(L, "link-listen failed");
+	}
+
+	luaL_Reg r[] = {
+			{ "bind", __l2c_bind },
+			{ "send", __l2c_send },
+			{ "fsend", __l2c_fsend },
+			{ "close", __l2c_close },
+			{ nullptr, nullptr },
+	};
+	luaL_newlib(L, r);
+	return 1;
+}
+
+void
+link_init(lua_State *L)
+{
+	util_preload(L, "clink", __luaopen_link);
 }
 
 void
@@ -644,10 +663,16 @@ link_loop(lua_State *L) {
 		return;
 	}
 
+	TRACE_BEGIN("link_loop", nullptr, 0);
+
+	TRACE_BEGIN("link-accept", nullptr, 0);
 	__link_accept();
+	TRACE_END("link-accept", nullptr, 0);
 
 	for (auto it : _K->_links) {
+		TRACE_BEGIN("link-recv", nullptr, it->_sock);
 		__link_recv(L, it);
+		TRACE_END("link-recv", nullptr, it->_sock);
 	}
 
 	typedef std::list<link_item*>::iterator link_item_it;
@@ -661,6 +686,26 @@ link_loop(lua_State *L) {
 			++it;
 		}
 	}
+
+	TRACE_END("link_loop", nullptr, 0);
+}
+
+void
+link_reload(lua_State *L)
+{
+	util_preload(L, "clink", __luaopen_link);
+
+	if (nullptr == _K) {
+		return;
+	}
+
+	// requests handed to the old state will never be answered, pending sends go on.
+	_K->_c2l_recv = LUA_NOREF;
+	for (auto it : _K->_links) {
+		if (link_item::_RECV == it->_step) {
+			it->_step = link_item::_CLOSE;
+		}
+	}
 }
 
 void
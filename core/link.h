@@ -11,6 +11,9 @@ link_init(lua_State *L);
 void
 link_loop(lua_State *L);
 
+void
+link_reload(lua_State *L);
+
 void
 link_fini(lua_State *L);
 
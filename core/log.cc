@@ -0,0 +1,1152 @@
+#include <log.h>
+#include <logfmt.h>
+#include <file.h>
+#include <http.h>
+#include <util.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <unordered_map>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#else //_WIN32
+#include <dirent.h>
+#include <zlib.h>
+#endif //_WIN32
+
+#ifdef ANDROID
+#include <android/log.h>
+#define lprint(...)  __android_log_print(ANDROID_LOG_ERROR, "daemon", "%s", __VA_ARGS__)
+#else //ANDROID
+#define lprint(...)  printf("%s", __VA_ARGS__)
+#endif//ANDROID
+
+#define LOG_SHIP (1 << 20) // bytes kept for the shipper before lines are dropped
+#define LOG_WAIT 10        // ms the writer sleeps when the rings are empty
+#define LOG_SUMS 1000000   // usec between "suppressed" summaries
+#define LOG_SLOTS 256      // lua sites each thread remembers, a power of 2
+
+// a record in a ring, the line follows and the whole is padded to 16 bytes.
+struct log_rec
+{
+	uint32_t _size; // LOG_SKIP marks the unused tail of the ring
+	uint8_t  _lv;
+	char     _tag;
+	uint16_t _kind; // LOG_TEXT, or LOG_ARGS: site and fmt pointers then the captured arguments
+	uint64_t _time; // wall clock, usec
+};
+
+enum { LOG_TEXT = 0, LOG_ARGS = 1 };
+
+// what the writer needs from the setters, copied once per pass.
+struct log_conf
+{
+	std::string _path;
+	size_t      _pgen;
+	std::string _url;
+	bool        _bin;
+	uint64_t    _size;  // rotation
+	size_t      _count; // retention
+	uint64_t    _age;
+	uint64_t    _bytes;
+	size_t      _roll;  // bumped by log_roll
+};
+
+static const uint32_t LOG_SKIP = 0xffffffff;
+
+#define LOG_ALIGN(n) (((n) + 15) & ~(size_t)15)
+
+// single producer, single consumer: the owning thread writes, the writer thread reads.
+struct log_ring
+{
+	std::atomic<size_t> _head;
+	std::atomic<size_t> _tail;
+	std::atomic<size_t> _lost;
+	char                _data[LOG_RING];
+
+	log_ring(void) : _head(0), _tail(0), _lost(0)
+	{
+	}
+};
+
+// a cfile.log call site, named by its lua source.
+struct log_lsite : log_site
+{
+	std::string _name;
+};
+
+struct log_data
+{
+	std::atomic<size_t>     _mask;
+	std::atomic<uint32_t>   _rate;
+	std::atomic<uint32_t>   _burst;
+	std::atomic<uint32_t>   _sample;
+
+	std::mutex              _slock;
+	std::vector<log_site*>  _pending; // sites with throttled lines not yet summarised
+	std::unordered_map<std::string, log_lsite*> _lsites;
+	uint64_t                _wall; // usec since the epoch at _mono
+	uint64_t                _mono;
+	size_t                  _gen;
+
+	std::mutex              _rlock;
+	std::vector<log_ring*>  _rings;
+
+	std::thread             _thread;
+	std::mutex              _lock; // guards what follows
+	std::condition_variable _cond;
+	std::condition_variable _done;
+	bool                    _quit;
+	size_t                  _pass;
+	log_conf                _conf;
+	std::string             _ship;
+	std::thread             _zthread; // compresses closed segments and applies retention
+	std::condition_variable _zcond;
+	std::deque<std::string> _zjobs;
+	bool                    _zkeep; // retention changed
+	std::string             _zstamp; // the last segment name, so a name freed by retention is not reused
+	int                     _zseq;
+
+	// writer thread only.
+	FILE                   *_file;
+	char                    _date[8]; // "yyyymmdd" of the open file
+	std::string             _fpath;
+	uint64_t                _fsize;
+	size_t                  _fgen;
+	size_t                  _froll;
+	bool                    _fbin;
+	time_t                  _sec;
+	char                    _stamp[16];
+	std::string             _out;  // bytes for the file
+	std::string             _txt;  // text for the shipper
+	std::string             _line;
+	bool                    _fresh; // binary: a session record is due
+	uint64_t                _last;
+	uint64_t                _sums;
+	std::unordered_map<const log_site*, uint32_t> _sites;
+
+	log_data(void) : _mask(0xff), _rate(LOG_RATE), _burst(LOG_BURST), _sample(1), _wall(0), _mono(0), _gen(0), _quit(false), _pass(0), _zkeep(false), _zseq(0), _file(nullptr), _fsize(0), _fgen(0), _froll(0), _fbin(false), _sec(0), _fresh(true), _last(0), _sums(0)
+	{
+		this->_conf._pgen = 0;
+		this->_conf._bin = false;
+		this->_conf._size = LOG_SIZE;
+		this->_conf._count = LOG_COUNT;
+		this->_conf._age = 0;
+		this->_conf._bytes = 0;
+		this->_conf._roll = 0;
+		this->_date[0] = '\0';
+		this->_stamp[0] = '\0';
+	}
+
+	~log_data(void)
+	{
+		if (nullptr != this->_file) {
+			::fclose(this->_file);
+		}
+		for (auto it : this->_rings) {
+			delete it;
+		}
+		for (auto it : this->_lsites) {
+			delete it.second;
+		}
+	}
+};
+
+static log_data *_O = nullptr;
+static size_t __log_gens = 0;
+
+// the ring of this thread, only trusted while its generation matches the running writer.
+static THREAD_LOCAL log_ring *__log_ring = nullptr;
+
+// lua sites this thread interned, by a hash of source and line. same generation rule as the ring.
+struct log_slot
+{
+	log_lsite *_site;
+	size_t     _gen;
+};
+static THREAD_LOCAL log_slot __log_slots[LOG_SLOTS];
+static THREAD_LOCAL size_t __log_gen = 0;
+
+static log_ring*
+__log_ring_get(void)
+{
+	if (nullptr != __log_ring && __log_gen == _O->_gen) {
+		return __log_ring;
+	}
+
+	log_ring *ring = new log_ring();
+	{
+		std::lock_guard<std::mutex> lock(_O->_rlock);
+		_O->_rings.push_back(ring);
+	}
+	__log_ring = ring;
+	__log_gen = _O->_gen;
+	return ring;
+}
+
+static int
+__log_ring_push(log_ring *ring, int lv, char tag, int kind, const char *data, size_t dlen)
+{
+	if (sizeof(log_rec) + dlen > LOG_RING / 2) {
+		if (LOG_ARGS == kind) {
+			return 0;
+		}
+		dlen = LOG_RING / 2 - sizeof(log_rec);
+	}
+
+	size_t need = LOG_ALIGN(sizeof(log_rec) + dlen);
+	size_t head = ring->_head.load(std::memory_order_relaxed);
+	size_t tail = ring->_tail.load(std::memory_order_acquire);
+	size_t off = head % LOG_RING, room = LOG_RING - off;
+	size_t skip = room < need ? room : 0;
+	if (head + skip + need - tail > LOG_RING) {
+		ring->_lost.fetch_add(1, std::memory_order_relaxed);
+		return 0;
+	}
+
+	if (skip > 0) {
+		((log_rec*)(ring->_data + off))->_size = LOG_SKIP;
+		head += skip; off = 0;
+	}
+
+	log_rec *rec = (log_rec*)(ring->_data + off);
+	rec->_size = (uint32_t)dlen;
+	rec->_lv = (uint8_t)lv;
+	rec->_tag = tag;
+	rec->_kind = (uint16_t)kind;
+	rec->_time = _O->_wall + (util_clock() - _O->_mono);
+	memcpy(rec + 1, data, dlen);
+
+	ring->_head.store(head + need, std::memory_order_release);
+
+	// past half full the writer is woken rather than left to its next poll.
+	if (head + need - tail > LOG_RING / 2) {
+		_O->_cond.notify_one();
+	}
+	return 1;
+}
+
+static inline void
+__log_drop(log_site *site)
+{
+	// only the first drop since the last summary puts the site on the list.
+	if (0 == site->_dropped.fetch_add(1, std::memory_order_relaxed)) {
+		std::lock_guard<std::mutex> lock(_O->_slock);
+		_O->_pending.push_back(site);
+	}
+}
+
+// 1-in-n sampling then a token bucket, both lock free and kept in the site.
+static inline bool
+__log_admit(log_site *site, int lv)
+{
+	if (nullptr == site || LOG_FATAL == lv) {
+		return true;
+	}
+
+	uint32_t sample = _O->_sample.load(std::memory_order_relaxed);
+	if (sample > 1 && lv < LOG_WARN && 0 != site->_seen.fetch_add(1, std::memory_order_relaxed) % sample) {
+		return false;
+	}
+
+	uint64_t rate = _O->_rate.load(std::memory_order_relaxed);
+	if (0 == rate) {
+		return true;
+	}
+	uint64_t full = (uint64_t)_O->_burst.load(std::memory_order_relaxed) << 8;
+	uint64_t now = (util_clock() - _O->_mono) / 1000 + 1;
+
+	uint64_t s = site->_bucket.load(std::memory_order_relaxed);
+	while (true) {
+		// a site never seen starts with a full bucket, now is never 0 so neither is a used one.
+		uint64_t last = s >> 24, tok = 0 == s ? full : s & 0xffffff;
+		uint64_t dt = now > last ? now - last : 0;
+		if (dt > 1000000) {
+			dt = 1000000;
+		}
+		tok += dt * rate * 256 / 1000;
+		if (tok > full) {
+			tok = full;
+		}
+		bool ok = tok >= 256;
+		if (ok) {
+			tok -= 256;
+		}
+		if (site->_bucket.compare_exchange_weak(s, (now << 24) | tok, std::memory_order_relaxed)) {
+			if (!ok) {
+				__log_drop(site);
+			}
+			return ok;
+		}
+	}
+}
+
+static void
+__log_localtime(time_t sec, struct tm *tm)
+{
+#ifdef _WIN32
+	localtime_s(tm, &sec);
+#else //_WIN32
+	localtime_r(&sec, tm);
+#endif //_WIN32
+}
+
+static inline bool
+__log_digits(const char *p, size_t n)
+{
+	for (size_t i = 0; i < n; ++i) {
+		if (p[i] < '0' || p[i] > '9') return false;
+	}
+	return true;
+}
+
+static inline bool
+__log_ends(const std::string &s, const char *tail)
+{
+	size_t tlen = strlen(tail);
+	return s.size() >= tlen && 0 == s.compare(s.size() - tlen, tlen, tail);
+}
+
+// <base>yyyymmdd.txt or .bin, the day file being written.
+static inline bool
+__log_is_day(const std::string &name, const std::string &base)
+{
+	return name.size() == base.size() + 12 && 0 == name.compare(0, base.size(), base)
+		&& __log_digits(name.c_str() + base.size(), 8) && (__log_ends(name, ".txt") || __log_ends(name, ".bin"));
+}
+
+// <base>yyyymmddHHMMSS[.n].txt or .bin, optionally .gz, a closed segment.
+static inline bool
+__log_is_seg(const std::string &name, const std::string &base)
+{
+	return name.size() >= base.size() + 18 && 0 == name.compare(0, base.size(), base) && __log_digits(name.c_str() + base.size(), 14)
+		&& (__log_ends(name, ".txt") || __log_ends(name, ".bin") || __log_ends(name, ".txt.gz") || __log_ends(name, ".bin.gz"));
+}
+
+// segments order by their stamp, then by the .n a same second roll got.
+static inline uint64_t
+__log_seq(const std::string &name, size_t at)
+{
+	return '.' == name[at] && name[at + 1] >= '0' && name[at + 1] <= '9' ? strtoull(name.c_str() + at + 1, nullptr, 10) : 0;
+}
+
+static void
+__log_list(const std::string &dir, std::vector<std::string> &names)
+{
+#ifdef _WIN32
+	struct _finddata_t fd;
+	intptr_t h = _findfirst((dir + "*").c_str(), &fd);
+	if (-1 == h) {
+		return;
+	}
+	do {
+		names.push_back(fd.name);
+	} while (0 == _findnext(h, &fd));
+	_findclose(h);
+#else //_WIN32
+	DIR *d = opendir(dir.empty() ? "." : dir.c_str());
+	if (nullptr == d) {
+		return;
+	}
+	struct dirent *e = nullptr;
+	while (nullptr != (e = readdir(d))) {
+		names.push_back(e->d_name);
+	}
+	closedir(d);
+#endif //_WIN32
+}
+
+// done leaves out segments still waiting for the compressor.
+static size_t
+__log_segs(const std::string &prefix, std::vector<log_segment> &segs, bool done)
+{
+	size_t slash = prefix.find_last_of('/');
+	std::string dir = std::string::npos == slash ? std::string() : prefix.substr(0, slash + 1);
+	std::string base = prefix.substr(dir.size());
+
+	std::vector<std::string> names;
+	__log_list(dir, names);
+	size_t at = base.size() + 14;
+	// stamp, then the .n of a same second roll, then the whole name, a strict order for any names.
+	std::sort(names.begin(), names.end(), [at](const std::string &a, const std::string &b) {
+		int c = a.compare(0, at, b, 0, at);
+		if (0 != c) {
+			return c < 0;
+		}
+		uint64_t sa = a.size() > at ? __log_seq(a, at) : 0, sb = b.size() > at ? __log_seq(b, at) : 0;
+		return sa != sb ? sa < sb : a < b;
+	});
+
+	for (auto &name : names) {
+		if (!__log_is_seg(name, base)) {
+			continue;
+		}
+#ifndef _WIN32
+		if (done && !__log_ends(name, ".gz")) {
+			continue;
+		}
+#endif //_WIN32
+		log_segment seg;
+		seg._path = dir + name;
+		struct stat st;
+		if (0 != stat(seg._path.c_str(), &st)) {
+			continue;
+		}
+		seg._size = (uint64_t)st.st_size;
+		seg._time = st.st_mtime;
+		segs.push_back(seg);
+	}
+	return segs.size();
+}
+
+// renames a finished day file into a segment named after stamp and queues it for compression.
+static void
+__log_seal(const std::string &fpath, const std::string &prefix, const char *stamp)
+{
+	std::string ext = fpath.substr(fpath.size() - 4);
+	std::string spath, name(stamp, 14);
+
+	std::lock_guard<std::mutex> lock(_O->_lock);
+	int n = (name == _O->_zstamp) ? _O->_zseq + 1 : 0;
+	for (struct stat st; n < 1000; ++n) {
+		spath = prefix + name;
+		if (n > 0) {
+			spath.push_back('.');
+			spath.append(std::to_string(n));
+		}
+		spath.append(ext);
+		if (0 != stat(spath.c_str(), &st) && 0 != stat((spath + ".gz").c_str(), &st)) {
+			break;
+		}
+	}
+	_O->_zstamp = name;
+	_O->_zseq = n;
+
+	if (0 != ::rename(fpath.c_str(), spath.c_str())) {
+		return;
+	}
+
+	_O->_zjobs.push_back(spath);
+	_O->_zcond.notify_one();
+}
+
+static void
+__log_close(bool seal, const std::string &prefix)
+{
+	if (nullptr != _O->_file) {
+		::fclose(_O->_file); _O->_file = nullptr;
+		if (seal && _O->_fsize > 0) {
+			__log_seal(_O->_fpath, prefix, _O->_stamp);
+		}
+	}
+	_O->_fsize = 0;
+	_O->_fresh = true;
+}
+
+#ifndef _WIN32
+static int
+__log_gzip(const std::string &path)
+{
+	std::string zpath = path + ".gz", tpath = zpath + ".tmp";
+	FILE *in = ::fopen(path.c_str(), "rb");
+	if (nullptr == in) {
+		return 0;
+	}
+	gzFile out = gzopen(tpath.c_str(), "wb6");
+	if (nullptr == out) {
+		::fclose(in);
+		return 0;
+	}
+
+	char temp[1 << 15];
+	size_t n = 0;
+	bool ok = true;
+	while (ok && 0 < (n = ::fread(temp, 1, sizeof(temp), in))) {
+		ok = (int)n == gzwrite(out, temp, (unsigned)n);
+	}
+	::fclose(in);
+	ok = (Z_OK == gzclose(out)) && ok;
+
+	if (!ok || 0 != ::rename(tpath.c_str(), zpath.c_str())) {
+		::remove(tpath.c_str());
+		return 0;
+	}
+	::remove(path.c_str());
+	return 1;
+}
+#endif //_WIN32
+
+// oldest segments go first, until count, age and total size are all within limits.
+static void
+__log_retain(const log_conf &conf)
+{
+	std::vector<log_segment> segs;
+	__log_segs(conf._path, segs, false);
+
+	uint64_t total = 0;
+	for (auto &seg : segs) {
+		total += seg._size;
+	}
+
+	time_t now = ::time(NULL);
+	size_t count = segs.size();
+	for (auto &seg : segs) {
+		bool drop = (conf._count > 0 && count > conf._count) || (conf._bytes > 0 && total > conf._bytes)
+			|| (conf._age > 0 && (uint64_t)(now - seg._time) > conf._age);
+		if (!drop) {
+			break;
+		}
+		if (0 == ::remove(seg._path.c_str())) {
+			--count;
+			total -= seg._size;
+		}
+	}
+}
+
+// day files left from earlier days and segments a crash left uncompressed are picked up at start.
+static void
+__log_sweep(const log_conf &conf, std::deque<std::string> &jobs)
+{
+	size_t slash = conf._path.find_last_of('/');
+	std::string dir = std::string::npos == slash ? std::string() : conf._path.substr(0, slash + 1);
+	std::string base = conf._path.substr(dir.size());
+
+	char today[16];
+	time_t now = ::time(NULL);
+	struct tm tm;
+	__log_localtime(now, &tm);
+	strftime(today, sizeof(today), "%Y%m%d", &tm);
+
+	std::vector<std::string> names;
+	__log_list(dir, names);
+	for (auto &name : names) {
+		std::string path = dir + name;
+		if (__log_ends(name, ".gz.tmp")) {
+			::remove(path.c_str());
+		} else if (__log_is_day(name, base) && 0 != name.compare(base.size(), 8, today)) {
+			struct stat st;
+			if (0 == stat(path.c_str(), &st)) {
+				char stamp[16];
+				__log_localtime(st.st_mtime, &tm);
+				strftime(stamp, sizeof(stamp), "%Y%m%d%H%M%S", &tm);
+				__log_seal(path, conf._path, stamp);
+			}
+		} else if (__log_is_seg(name, base) && !__log_ends(name, ".gz")) {
+			jobs.push_back(path);
+		}
+	}
+}
+
+static void
+__log_zmain(void)
+{
+	log_conf conf;
+	std::deque<std::string> jobs;
+	{
+		std::lock_guard<std::mutex> lock(_O->_lock);
+		conf = _O->_conf;
+	}
+	__log_sweep(conf, jobs);
+
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(_O->_lock);
+			while (jobs.empty() && _O->_zjobs.empty() && !_O->_zkeep && !_O->_quit) {
+				_O->_zcond.wait(lock);
+			}
+			_O->_zkeep = false;
+			if (_O->_quit) {
+				break;
+			}
+			while (!_O->_zjobs.empty()) {
+				jobs.push_back(_O->_zjobs.front()); _O->_zjobs.pop_front();
+			}
+			conf = _O->_conf;
+		}
+
+		while (!jobs.empty()) {
+#ifndef _WIN32
+			__log_gzip(jobs.front());
+#endif //_WIN32
+			jobs.pop_front();
+		}
+		__log_retain(conf);
+	}
+}
+
+// writes what the pass gathered to the day file and hands the text to the shipper.
+static void
+__log_flush(const log_conf &conf)
+{
+	if (!_O->_out.empty() && !conf._path.empty() && nullptr == _O->_file) {
+		std::string fpath(conf._path);
+		fpath.append(_O->_date, sizeof(_O->_date)).append(_O->_fbin ? ".bin" : ".txt");
+		_O->_fpath = fpath;
+		if (nullptr == (_O->_file = ::fopen(fpath.c_str(), "ab"))) {
+			// the log directory is only made once something is logged.
+			size_t dlen = fpath.find_last_of('/');
+			if (std::string::npos != dlen) {
+				file_mkdir((char*)fpath.c_str(), dlen);
+			}
+			_O->_file = ::fopen(fpath.c_str(), "ab");
+		}
+		if (nullptr != _O->_file) {
+			::fseek(_O->_file, 0, SEEK_END);
+			_O->_fsize = (uint64_t)::ftell(_O->_file);
+			if (0 == _O->_fsize && _O->_fbin) {
+				char head[5] = { 'P', 'D', 'L', 'B', LOGBIN_VERSION };
+				_O->_fsize += ::fwrite(head, 1, sizeof(head), _O->_file);
+			}
+		}
+	}
+	if (nullptr != _O->_file && !_O->_out.empty()) {
+		_O->_fsize += ::fwrite(_O->_out.data(), 1, _O->_out.size(), _O->_file);
+		::fflush(_O->_file);
+	}
+	_O->_out.clear();
+
+	// a full day file is rolled, the day goes on in a fresh one.
+	if (nullptr != _O->_file && conf._size > 0 && _O->_fsize >= conf._size) {
+		__log_close(true, conf._path);
+	}
+
+	if (!_O->_txt.empty()) {
+		std::lock_guard<std::mutex> lock(_O->_lock);
+		if (_O->_ship.size() + _O->_txt.size() <= LOG_SHIP) {
+			_O->_ship.append(_O->_txt);
+		}
+	}
+	_O->_txt.clear();
+}
+
+static inline void
+__log_bin_uint(std::string &out, uint64_t v)
+{
+	char b[10];
+	out.append(b, logfmt_uint(b, b + sizeof(b), v) - b);
+}
+
+static inline void
+__log_bin_u64(std::string &out, uint64_t v)
+{
+	for (int i = 0; i < 8; ++i) {
+		out.push_back((char)(v >> (i * 8)));
+	}
+}
+
+static inline void
+__log_bin_str(std::string &out, const char *s, size_t slen)
+{
+	__log_bin_uint(out, slen);
+	out.append(s, slen);
+}
+
+// appends the record to _out in the binary format, the site is described the first time it shows up.
+static void
+__log_bin(const log_rec *rec, const log_site *site, const char *fmt, const char *args, size_t alen)
+{
+	std::string &out = _O->_out;
+	if (_O->_fresh) {
+		time_t sec = (time_t)(rec->_time / 1000000);
+		struct tm lt, gt;
+		__log_localtime(sec, &lt);
+#ifdef _WIN32
+		gmtime_s(&gt, &sec);
+#else //_WIN32
+		gmtime_r(&sec, &gt);
+#endif //_WIN32
+		gt.tm_isdst = lt.tm_isdst;
+		int64_t off = (int64_t)difftime(mktime(&lt), mktime(&gt));
+
+		out.push_back('S');
+		__log_bin_u64(out, rec->_time);
+		__log_bin_uint(out, ((uint64_t)off << 1) ^ (uint64_t)(off >> 63));
+		_O->_sites.clear();
+		_O->_last = rec->_time;
+		_O->_fresh = false;
+	}
+
+	// rings are drained one after the other and clocks get set back, deltas only go forward.
+	if (rec->_time < _O->_last) {
+		out.push_back('A');
+		__log_bin_u64(out, rec->_time);
+		_O->_last = rec->_time;
+	}
+	uint64_t dt = rec->_time - _O->_last;
+	_O->_last = rec->_time;
+
+	if (nullptr == site) {
+		out.push_back('T');
+		out.push_back((char)rec->_lv);
+		__log_bin_uint(out, dt);
+		__log_bin_str(out, (const char*)(rec + 1), rec->_size);
+		return;
+	}
+
+	auto it = _O->_sites.find(site);
+	uint32_t id = 0;
+	if (_O->_sites.end() == it) {
+		id = (uint32_t)_O->_sites.size();
+		_O->_sites[site] = id;
+		out.push_back('D');
+		__log_bin_uint(out, id);
+		__log_bin_uint(out, (uint64_t)site->_line);
+		__log_bin_str(out, site->_file, strlen(site->_file));
+		__log_bin_str(out, fmt, strlen(fmt));
+	} else {
+		id = it->second;
+	}
+
+	out.push_back('L');
+	__log_bin_uint(out, id);
+	out.push_back((char)rec->_lv);
+	__log_bin_uint(out, dt);
+	__log_bin_str(out, args, alen);
+}
+
+static void
+__log_line(const log_rec *rec, const log_conf &conf)
+{
+	time_t sec = (time_t)(rec->_time / 1000000);
+	char stamp[sizeof(_O->_stamp)];
+	memcpy(stamp, _O->_stamp, sizeof(stamp));
+	if (sec != _O->_sec) {
+		struct tm tm;
+		__log_localtime(sec, &tm);
+		strftime(stamp, sizeof(stamp), "%Y%m%d%H%M%S", &tm);
+	}
+
+	// a new day, a new path or a new format closes the file into a segment. _stamp still
+	// holds the last line of that file, the segment is named after the day it belongs to.
+	if (_O->_fgen != conf._pgen || _O->_fbin != conf._bin || 0 != memcmp(_O->_date, stamp, sizeof(_O->_date))) {
+		__log_flush(conf);
+		__log_close(true, _O->_fgen != conf._pgen ? _O->_fpath.substr(0, _O->_fpath.size() - 12) : conf._path);
+		memcpy(_O->_date, stamp, sizeof(_O->_date));
+		_O->_fgen = conf._pgen;
+		_O->_fbin = conf._bin;
+	}
+	memcpy(_O->_stamp, stamp, sizeof(stamp));
+	_O->_sec = sec;
+
+	const log_site *site = nullptr;
+	const char *fmt = nullptr, *args = nullptr;
+	size_t alen = 0;
+	if (LOG_ARGS == rec->_kind) {
+		memcpy(&site, rec + 1, sizeof(site));
+		memcpy(&fmt, (const char*)(rec + 1) + sizeof(site), sizeof(fmt));
+		args = (const char*)(rec + 1) + sizeof(site) + sizeof(fmt);
+		alen = rec->_size - sizeof(site) - sizeof(fmt);
+	}
+
+	if (_O->_fbin) {
+		__log_bin(rec, site, fmt, args, alen);
+	}
+
+	// binary files leave formatting to tool/logdump, only the shipper still wants text.
+	if (!_O->_fbin || !conf._url.empty()) {
+		static const char lvs[LOG_MAX] = { 'D', 'I', 'W', 'E', 'F' };
+		std::string &line = _O->_line;
+		line.clear();
+		line.push_back(rec->_lv < LOG_MAX ? lvs[rec->_lv] : '?');
+		line.push_back(LOG_SPLIT);
+		line.append(_O->_stamp, 14);
+		line.push_back(LOG_SPLIT);
+		if ('\0' != rec->_tag) {
+			line.push_back(rec->_tag);
+			line.push_back(LOG_SPLIT);
+		}
+		if (nullptr != site) {
+			logfmt_render(fmt, args, alen, line);
+		} else {
+			line.append((const char*)(rec + 1), rec->_size);
+		}
+		line.push_back('\n');
+
+		if (!_O->_fbin) {
+			_O->_out.append(line);
+			lprint(line.c_str());
+		}
+		if (!conf._url.empty()) {
+			_O->_txt.append(line);
+		}
+	}
+
+	if (_O->_out.size() >= LOG_BATCH) {
+		__log_flush(conf);
+	}
+}
+
+// drains every ring once, returns the number of lines written. the last pass summarises right away.
+static size_t
+__log_drain(bool last)
+{
+	log_conf conf;
+	{
+		std::lock_guard<std::mutex> lock(_O->_lock);
+		conf = _O->_conf;
+	}
+
+	std::vector<log_ring*> rings;
+	{
+		std::lock_guard<std::mutex> lock(_O->_rlock);
+		rings = _O->_rings;
+	}
+
+	if (_O->_froll != conf._roll) {
+		__log_flush(conf);
+		__log_close(true, conf._path);
+		_O->_froll = conf._roll;
+	}
+
+	size_t n = 0;
+	for (auto ring : rings) {
+		size_t tail = ring->_tail.load(std::memory_order_relaxed);
+		size_t head = ring->_head.load(std::memory_order_acquire);
+		while (tail < head) {
+			size_t off = tail % LOG_RING;
+			const log_rec *rec = (const log_rec*)(ring->_data + off);
+			if (LOG_SKIP == rec->_size) {
+				tail += LOG_RING - off;
+				continue;
+			}
+			__log_line(rec, conf);
+			tail += LOG_ALIGN(sizeof(log_rec) + rec->_size);
+			++n;
+		}
+		ring->_tail.store(tail, std::memory_order_release);
+
+		size_t lost = ring->_lost.exchange(0, std::memory_order_relaxed);
+		if (lost > 0) {
+			struct { log_rec _rec; char _text[48]; } temp;
+			temp._rec._size = (uint32_t)snprintf(temp._text, sizeof(temp._text), "log ring full, %u lines dropped", (unsigned)lost);
+			temp._rec._lv = LOG_WARN;
+			temp._rec._tag = 'C';
+			temp._rec._kind = LOG_TEXT;
+			temp._rec._time = _O->_wall + (util_clock() - _O->_mono);
+			__log_line(&temp._rec, conf);
+		}
+	}
+
+	// throttled sites are summarised once a second, by how many lines they lost.
+	uint64_t now = util_clock();
+	if (last || now - _O->_sums >= LOG_SUMS) {
+		_O->_sums = now;
+		std::vector<log_site*> pending;
+		{
+			std::lock_guard<std::mutex> lock(_O->_slock);
+			pending.swap(_O->_pending);
+		}
+		for (auto site : pending) {
+			uint32_t dropped = site->_dropped.exchange(0, std::memory_order_relaxed);
+			if (0 == dropped) {
+				continue;
+			}
+			struct { log_rec _rec; char _text[PATH_SIZE + 64]; } temp;
+			int tlen = snprintf(temp._text, sizeof(temp._text), "suppressed %u lines from %s:%d", (unsigned int)dropped, site->_file, site->_line);
+			temp._rec._size = (uint32_t)(tlen < (int)sizeof(temp._text) ? tlen : sizeof(temp._text) - 1);
+			temp._rec._lv = LOG_WARN;
+			temp._rec._tag = 'C';
+			temp._rec._kind = LOG_TEXT;
+			temp._rec._time = _O->_wall + (now - _O->_mono);
+			__log_line(&temp._rec, conf);
+		}
+	}
+
+	__log_flush(conf);
+	return n;
+}
+
+static void
+__log_main(void)
+{
+	_O->_out.reserve(LOG_BATCH + LOG_LINE);
+
+	while (true) {
+		size_t n = __log_drain(false);
+
+		std::unique_lock<std::mutex> lock(_O->_lock);
+		++_O->_pass;
+		_O->_done.notify_all();
+		if (_O->_quit) {
+			break;
+		}
+		if (0 == n) {
+			_O->_cond.wait_for(lock, std::chrono::milliseconds(LOG_WAIT));
+		}
+	}
+
+	__log_drain(true);
+}
+
+void
+log_init(const char *home, size_t hlen)
+{
+	if (nullptr != _O) {
+		return;
+	}
+
+	_O = new log_data();
+	_O->_gen = ++__log_gens;
+	_O->_mono = util_clock();
+	_O->_wall = (uint64_t)::time(NULL) * 1000000;
+	_O->_conf._path.assign(home, hlen);
+	_O->_conf._pgen = 1;
+
+	_O->_thread = std::thread(__log_main);
+	_O->_zthread = std::thread(__log_zmain);
+}
+
+int
+log_enabled(int lv)
+{
+	return (nullptr != _O && 0 != (_O->_mask.load(std::memory_order_relaxed) & (1 << lv))) ? 1 : 0;
+}
+
+int
+log_write(log_site *site, int lv, const char *data, size_t dlen)
+{
+	if (!log_enabled(lv) || !__log_admit(site, lv)) {
+		return 0;
+	}
+
+	int ret = __log_ring_push(__log_ring_get(), lv, '\0', LOG_TEXT, data, dlen);
+	if (LOG_FATAL == lv) {
+		log_flush();
+	}
+	return ret;
+}
+
+int
+log_args(log_site *site, int lv, const char *fmt, va_list vl)
+{
+	if (!log_enabled(lv) || !__log_admit(site, lv)) {
+		return 0;
+	}
+
+	char temp[LOG_LINE];
+	memcpy(temp, &site, sizeof(site));
+	memcpy(temp + sizeof(site), &fmt, sizeof(fmt));
+	size_t head = sizeof(site) + sizeof(fmt);
+	size_t alen = logfmt_pack(fmt, vl, temp + head, sizeof(temp) - head);
+
+	int ret = __log_ring_push(__log_ring_get(), lv, 'C', LOG_ARGS, temp, head + alen);
+	if (LOG_FATAL == lv) {
+		log_flush();
+	}
+	return ret;
+}
+
+log_site*
+log_intern(const char *source, int line)
+{
+	if (nullptr == _O) {
+		return nullptr;
+	}
+
+	// a hit costs a hash and a compare, the lock, the key and the map are for first uses.
+	uint32_t h = 2166136261u;
+	for (const char *p = source; '\0' != *p; ++p) {
+		h = (h ^ (uint8_t)*p) * 16777619u;
+	}
+	log_slot &slot = __log_slots[(h ^ ((uint32_t)line * 2654435761u)) & (LOG_SLOTS - 1)];
+	if (slot._gen == _O->_gen && slot._site->_line == line && slot._site->_name == source) {
+		return slot._site;
+	}
+
+	std::string key(source);
+	key.push_back(':');
+	key.append(std::to_string(line));
+
+	std::lock_guard<std::mutex> lock(_O->_slock);
+	log_lsite *&site = _O->_lsites[key];
+	if (nullptr == site) {
+		site = new log_lsite();
+		site->_name = source;
+		site->_file = site->_name.c_str();
+		site->_line = line;
+		site->_bucket.store(0);
+		site->_seen.store(0);
+		site->_dropped.store(0);
+	}
+	slot._site = site;
+	slot._gen = _O->_gen;
+	return site;
+}
+
+void
+log_limit(uint32_t rate, uint32_t burst, uint32_t sample)
+{
+	if (nullptr == _O) {
+		return;
+	}
+
+	_O->_rate.store(rate, std::memory_order_relaxed);
+	_O->_burst.store(burst < 1 ? 1 : burst > 0xffff ? 0xffff : burst, std::memory_order_relaxed);
+	_O->_sample.store(sample, std::memory_order_relaxed);
+}
+
+void
+log_format(int bin)
+{
+	if (nullptr == _O) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(_O->_lock);
+	_O->_conf._bin = (0 != bin);
+}
+
+void
+log_mask(size_t mask)
+{
+	if (nullptr == _O) {
+		return;
+	}
+
+	_O->_mask.store(mask, std::memory_order_relaxed);
+}
+
+void
+log_path(const char *path, size_t plen)
+{
+	if (nullptr == _O) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(_O->_lock);
+	_O->_conf._path.assign(path, plen);
+	++_O->_conf._pgen;
+}
+
+void
+log_push(const char *url, size_t ulen)
+{
+	if (nullptr == _O) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(_O->_lock);
+	_O->_conf._url.assign(url, ulen);
+	if (_O->_conf._url.empty()) {
+		_O->_ship.clear();
+	}
+}
+
+void
+log_keep(uint64_t size, size_t count, uint64_t age, uint64_t bytes)
+{
+	if (nullptr == _O) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(_O->_lock);
+	_O->_conf._size = size;
+	_O->_conf._count = count;
+	_O->_conf._age = age;
+	_O->_conf._bytes = bytes;
+	// retention is applied right away, not only when the next segment closes.
+	_O->_zkeep = true;
+	_O->_zcond.notify_one();
+}
+
+void
+log_roll(void)
+{
+	if (nullptr == _O) {
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(_O->_lock);
+		++_O->_conf._roll;
+	}
+	_O->_cond.notify_one();
+}
+
+size_t
+log_segments(std::vector<log_segment> &segs)
+{
+	if (nullptr == _O) {
+		return 0;
+	}
+
+	std::string path;
+	{
+		std::lock_guard<std::mutex> lock(_O->_lock);
+		path = _O->_conf._path;
+	}
+	return __log_segs(path, segs, true);
+}
+
+void
+log_loop(lua_State *L)
+{
+	if (nullptr == _O) {
+		return;
+	}
+
+	std::string ship, url;
+	{
+		std::lock_guard<std::mutex> lock(_O->_lock);
+		if (_O->_ship.empty()) {
+			return;
+		}
+		ship.swap(_O->_ship);
+		url = _O->_conf._url;
+	}
+
+	// one post carries every line the writer gathered since the last tick.
+	http_push((char*)url.c_str(), url.size(), (char*)ship.data(), ship.size());
+}
+
+void
+log_flush(void)
+{
+	if (nullptr == _O) {
+		return;
+	}
+
+	// the writer cannot wait for itself.
+	if (std::this_thread::get_id() == _O->_thread.get_id()) {
+		return;
+	}
+
+	// two passes, the one running may have started before the caller's lines.
+	std::unique_lock<std::mutex> lock(_O->_lock);
+	size_t pass = _O->_pass + 2;
+	_O->_cond.notify_one();
+	while (!_O->_quit && _O->_pass < pass) {
+		_O->_done.wait(lock);
+	}
+}
+
+void
+log_fini(void)
+{
+	if (nullptr == _O) {
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(_O->_lock);
+		_O->_quit = true;
+	}
+	_O->_cond.notify_one();
+	_O->_zcond.notify_one();
+	_O->_thread.join();
+	_O->_zthread.join();
+
+	delete _O; _O = nullptr;
+}
@@ -0,0 +1,103 @@
+#ifndef __PD_LOG__
+#define __PD_LOG__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#define LOG_RING  (1 << 16) // bytes per producer thread
+#define LOG_BATCH (1 << 16) // bytes the writer gathers before one write
+#define LOG_SIZE  (4 << 20) // bytes a day file grows to before it is rolled into a segment
+#define LOG_COUNT 32        // closed segments kept
+#define LOG_RATE  100       // lines per second a call site may log before it is throttled
+#define LOG_BURST 500
+
+struct lua_State;
+
+// a closed log file, <path><yyyymmddHHMMSS>.txt or .bin, gzipped once the compressor got to it.
+struct log_segment
+{
+	std::string _path;
+	uint64_t    _size;
+	time_t      _time;
+};
+
+// one LOGx statement, or one cfile.log call site, its lines are recorded against it and
+// formatted by the writer. the rest is the site's rate limit state, zero at start.
+struct log_site
+{
+	const char           *_file;
+	int                   _line;
+	std::atomic<uint64_t> _bucket;  // ms of the last refill << 24 | tokens * 256
+	std::atomic<uint32_t> _seen;    // lines seen, for 1-in-n sampling
+	std::atomic<uint32_t> _dropped; // lines throttled since the last summary
+};
+
+// starts the writer thread, lines go to <home>yyyymmdd.txt until log_path says otherwise.
+void
+log_init(const char *home, size_t hlen);
+
+// copies one line into the calling thread's ring, site is optional and only used for limits.
+int
+log_write(log_site *site, int lv, const char *data, size_t dlen);
+
+// captures the arguments of fmt, they are only formatted on the writer thread.
+int
+log_args(log_site *site, int lv, const char *fmt, va_list vl);
+
+// the site of a lua source line, made on first use and kept until log_fini.
+log_site*
+log_intern(const char *source, int line);
+
+// per site token bucket, rate lines per second up to burst, 0 rate turns it off.
+// sample keeps one debug or info line in every sample, warnings and up are never sampled.
+// fatal lines are never limited.
+void
+log_limit(uint32_t rate, uint32_t burst, uint32_t sample);
+
+int
+log_enabled(int lv);
+
+// 1 writes binary .bin files formatted offline by tool/logdump, 0 plain .txt files.
+void
+log_format(int bin);
+
+void
+log_mask(size_t mask);
+
+// path is the prefix the day is appended to, already resolved.
+void
+log_path(const char *path, size_t plen);
+
+void
+log_push(const char *url, size_t ulen);
+
+// rotation size and retention by count, age in seconds and total bytes, 0 turns a limit off.
+void
+log_keep(uint64_t size, size_t count, uint64_t age, uint64_t bytes);
+
+// closes the day file now, it becomes a segment like one that reached its size.
+void
+log_roll(void);
+
+// closed segments ready to ship, oldest first. where there is zlib only the compressed ones.
+size_t
+log_segments(std::vector<log_segment> &segs);
+
+// hands what the writer gathered for the shipper to http, on the loop thread.
+void
+log_loop(lua_State *L);
+
+// waits until the writer has written every line logged before the call.
+// fatal lines do this by themselves, they are on disk before LOGF returns.
+void
+log_flush(void);
+
+void
+log_fini(void);
+
+#endif // __PD_LOG__
@@ -0,0 +1,317 @@
+#ifndef __PD_LOGFMT__
+#define __PD_LOGFMT__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+// printf arguments captured without formatting them, and rendered again later,
+// by the log writer or offline by tool/logdump. fmt is walked the way printf does:
+// '*' width and precision take an int, integers are stored as (zigzag) varints,
+// floating point as raw doubles, %s as a varint length and the bytes, %p as a varint.
+// positional arguments and %n are not supported, %n is skipped.
+//
+// binary log files (yyyymmdd.bin) hold these records after a "PDLB" magic and a version byte,
+// the first byte of each record is its type:
+//   'S' session:  u64 le wall clock usec, zigzag utc offset in seconds. ids restart here.
+//   'A' absolute: u64 le wall clock usec, where a record is older than the one before it.
+//   'D' site:     id, line, file, fmt
+//   'L' line:     id, level, usec since the previous record, args length, args
+//   'T' text:     level, usec since the previous record, text
+// numbers are varints, file, fmt and text a varint length and the bytes.
+#define LOGBIN_MAGIC   "PDLB"
+#define LOGBIN_VERSION 1
+
+enum {
+	LOGFMT_NONE = 0,
+	LOGFMT_INT,
+	LOGFMT_UINT,
+	LOGFMT_DBL,
+	LOGFMT_STR,
+	LOGFMT_PTR,
+	LOGFMT_SKIP,
+};
+
+// one conversion of fmt, [_head, _tail) is the spec from '%' to the conversion char.
+struct logfmt_spec
+{
+	const char *_head;
+	const char *_tail;
+	const char *_mods;  // where the length modifier starts
+	int         _kind;
+	int         _size;  // -2 char, -1 short, 0 int, 1 long, 2 long long / size_t / intmax_t, 3 long double
+	int         _stars; // '*' width and precision, each an int argument before the value
+};
+
+// moves *fmt past the next conversion, copying the literal text before it into lit when set.
+// returns 0 at the end of fmt.
+static inline int
+logfmt_next(const char **fmt, logfmt_spec *spec, std::string *lit)
+{
+	const char *p = *fmt;
+	while (true) {
+		const char *q = strchr(p, '%');
+		if (nullptr == q) {
+			if (nullptr != lit) lit->append(p);
+			*fmt = p + strlen(p);
+			return 0;
+		}
+		if (nullptr != lit) lit->append(p, q - p);
+		if ('%' == q[1]) {
+			if (nullptr != lit) lit->push_back('%');
+			p = q + 2;
+			continue;
+		}
+
+		spec->_head = q++;
+		spec->_size = 0;
+		spec->_stars = 0;
+		while ('\0' != *q && nullptr != strchr("-+ #0", *q)) ++q;
+		if ('*' == *q) { ++spec->_stars; ++q; } else while (*q >= '0' && *q <= '9') ++q;
+		if ('.' == *q) {
+			++q;
+			if ('*' == *q) { ++spec->_stars; ++q; } else while (*q >= '0' && *q <= '9') ++q;
+		}
+		spec->_mods = q;
+		switch (*q) {
+		case 'h': ++q; spec->_size = -1; if ('h' == *q) { ++q; spec->_size = -2; } break;
+		case 'l': ++q; spec->_size = 1; if ('l' == *q) { ++q; spec->_size = 2; } break;
+		case 'z': case 'j': case 't': case 'q': ++q; spec->_size = 2; break;
+		case 'L': ++q; spec->_size = 3; break;
+		case 'I':
+			if ('6' == q[1] && '4' == q[2]) { q += 3; spec->_size = 2; }
+			else if ('3' == q[1] && '2' == q[2]) { q += 3; }
+			else { ++q; spec->_size = 2; }
+			break;
+		}
+
+		switch (*q) {
+		case 'd': case 'i': case 'c':
+			spec->_kind = LOGFMT_INT; break;
+		case 'u': case 'o': case 'x': case 'X':
+			spec->_kind = LOGFMT_UINT; break;
+		case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+			spec->_kind = LOGFMT_DBL; break;
+		case 's':
+			spec->_kind = LOGFMT_STR; break;
+		case 'p':
+			spec->_kind = LOGFMT_PTR; break;
+		case 'n':
+			spec->_kind = LOGFMT_SKIP; break;
+		default:
+			// not a conversion printf knows, it stays literal text.
+			if (nullptr != lit) lit->append(spec->_head, q - spec->_head);
+			p = q;
+			continue;
+		}
+
+		spec->_tail = q + 1;
+		*fmt = q + 1;
+		return 1;
+	}
+}
+
+static inline char*
+logfmt_uint(char *p, char *e, uint64_t v)
+{
+	while (p < e) {
+		if (v < 0x80) {
+			*p++ = (char)v;
+			return p;
+		}
+		*p++ = (char)(v | 0x80);
+		v >>= 7;
+	}
+	return nullptr;
+}
+
+static inline int
+logfmt_ruint(const char **p, const char *e, uint64_t *v)
+{
+	uint64_t r = 0;
+	for (int s = 0; *p < e && s < 64; s += 7) {
+		uint8_t c = (uint8_t)*(*p)++;
+		r |= (uint64_t)(c & 0x7f) << s;
+		if (0 == (c & 0x80)) {
+			*v = r;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static inline char*
+logfmt_int(char *p, char *e, int64_t v)
+{
+	return logfmt_uint(p, e, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+static inline int
+logfmt_rint(const char **p, const char *e, int64_t *v)
+{
+	uint64_t u = 0;
+	if (!logfmt_ruint(p, e, &u)) {
+		return 0;
+	}
+	*v = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+	return 1;
+}
+
+// captures the arguments of fmt into out, strings are cut to what fits. returns bytes used.
+static inline size_t
+logfmt_pack(const char *fmt, va_list vl, char *out, size_t osize)
+{
+	char *p = out, *e = out + osize;
+	logfmt_spec spec;
+	while (nullptr != p && logfmt_next(&fmt, &spec, nullptr)) {
+		for (int i = 0; i < spec._stars && nullptr != p; ++i) {
+			p = logfmt_int(p, e, va_arg(vl, int));
+		}
+		if (nullptr == p) {
+			break;
+		}
+
+		switch (spec._kind) {
+		case LOGFMT_INT: {
+			int64_t v = spec._size <= 0 ? va_arg(vl, int) : 1 == spec._size ? va_arg(vl, long) : va_arg(vl, long long);
+			p = logfmt_int(p, e, -2 == spec._size ? (signed char)v : -1 == spec._size ? (short)v : v);
+			break;
+		}
+		case LOGFMT_UINT: {
+			uint64_t v = spec._size <= 0 ? va_arg(vl, unsigned int) : 1 == spec._size ? va_arg(vl, unsigned long) : va_arg(vl, unsigned long long);
+			p = logfmt_uint(p, e, -2 == spec._size ? (unsigned char)v : -1 == spec._size ? (unsigned short)v : v);
+			break;
+		}
+		case LOGFMT_DBL: {
+			double v = 3 == spec._size ? (double)va_arg(vl, long double) : va_arg(vl, double);
+			if (e - p < (ptrdiff_t)sizeof(v)) {
+				p = nullptr;
+			} else {
+				memcpy(p, &v, sizeof(v)); p += sizeof(v);
+			}
+			break;
+		}
+		case LOGFMT_STR: {
+			const char *s = va_arg(vl, const char*);
+			size_t slen = nullptr == s ? 0 : strlen(s);
+			if (nullptr == s) {
+				s = "(null)"; slen = 6;
+			}
+			if (slen + 10 > (size_t)(e - p)) {
+				slen = (size_t)(e - p) > 10 ? (size_t)(e - p) - 10 : 0;
+			}
+			p = logfmt_uint(p, e, slen);
+			if (nullptr != p) {
+				memcpy(p, s, slen); p += slen;
+			}
+			break;
+		}
+		case LOGFMT_PTR:
+			p = logfmt_uint(p, e, (uint64_t)(uintptr_t)va_arg(vl, void*));
+			break;
+		case LOGFMT_SKIP:
+			(void)va_arg(vl, void*);
+			break;
+		}
+	}
+
+	return nullptr == p ? osize : (size_t)(p - out);
+}
+
+template <typename T>
+static inline int
+logfmt_print(char *temp, size_t tsize, const char *conv, const logfmt_spec &spec, const int *star, T v)
+{
+	switch (spec._stars) {
+	case 0: return snprintf(temp, tsize, conv, v);
+	case 1: return snprintf(temp, tsize, conv, star[0], v);
+	default: return snprintf(temp, tsize, conv, star[0], star[1], v);
+	}
+}
+
+// renders fmt with arguments captured by logfmt_pack, missing arguments show as '?'.
+static inline void
+logfmt_render(const char *fmt, const char *args, size_t alen, std::string &out)
+{
+	const char *p = args, *e = args + alen;
+	logfmt_spec spec;
+	char temp[512], conv[48];
+	while (logfmt_next(&fmt, &spec, &out)) {
+		int star[2] = { 0, 0 };
+		bool ok = true;
+		for (int i = 0; i < spec._stars && ok; ++i) {
+			int64_t v = 0;
+			ok = 0 != logfmt_rint(&p, e, &v);
+			star[i] = (int)v;
+		}
+
+		// the spec is rebuilt with the length modifier the stored value needs.
+		size_t clen = (size_t)(spec._mods - spec._head);
+		if (clen > sizeof(conv) - 4) {
+			clen = sizeof(conv) - 4;
+		}
+		memcpy(conv, spec._head, clen);
+		char cc = spec._tail[-1];
+		if ((LOGFMT_INT == spec._kind && 'c' != cc) || LOGFMT_UINT == spec._kind) {
+			conv[clen++] = 'l'; conv[clen++] = 'l';
+		}
+		conv[clen++] = cc; conv[clen] = '\0';
+
+		int n = -1;
+		switch (ok ? spec._kind : LOGFMT_NONE) {
+		case LOGFMT_INT: {
+			int64_t v = 0;
+			if (!logfmt_rint(&p, e, &v)) break;
+			n = ('c' == cc) ? logfmt_print(temp, sizeof(temp), conv, spec, star, (int)v) : logfmt_print(temp, sizeof(temp), conv, spec, star, (long long)v);
+			break;
+		}
+		case LOGFMT_UINT: {
+			uint64_t v = 0;
+			if (!logfmt_ruint(&p, e, &v)) break;
+			n = logfmt_print(temp, sizeof(temp), conv, spec, star, (unsigned long long)v);
+			break;
+		}
+		case LOGFMT_DBL: {
+			double v = 0;
+			if (e - p < (ptrdiff_t)sizeof(v)) break;
+			memcpy(&v, p, sizeof(v)); p += sizeof(v);
+			n = logfmt_print(temp, sizeof(temp), conv, spec, star, v);
+			break;
+		}
+		case LOGFMT_STR: {
+			uint64_t slen = 0;
+			if (!logfmt_ruint(&p, e, &slen) || slen > (uint64_t)(e - p)) break;
+			// plain %s is copied as is, widths and precisions go through printf.
+			if (2 == clen) {
+				out.append(p, (size_t)slen);
+				n = 0;
+			} else {
+				std::string s(p, (size_t)slen);
+				n = logfmt_print(temp, sizeof(temp), conv, spec, star, s.c_str());
+			}
+			p += slen;
+			break;
+		}
+		case LOGFMT_PTR: {
+			uint64_t v = 0;
+			if (!logfmt_ruint(&p, e, &v)) break;
+			n = snprintf(temp, sizeof(temp), "0x%llx", (unsigned long long)v);
+			break;
+		}
+		case LOGFMT_SKIP:
+			n = 0;
+			break;
+		}
+
+		if (n < 0) {
+			out.push_back('?');
+		} else {
+			out.append(temp, (size_t)n < sizeof(temp) ? (size_t)n : sizeof(temp) - 1);
+		}
+	}
+}
+
+#endif // __PD_LOGFMT__
@@ -5,6 +5,16 @@
 #include <http.h>
 #include <file.h>
 #include <util.h>
+#include <pool.h>
+#include <work.h>
+#include <queue.h>
+#include <prof.h>
+#include <trace.h>
+#include <pkg.h>
+#include <pack.h>
+#include <log.h>
+#include <kv.h>
+#include <wire.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -19,22 +29,67 @@ extern "C" {
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <string>
+#include <vector>
+#include <set>
+#include <unordered_map>
 
 #define RESIDENT_LUA_ERROR  1
 #define RESIDENT_TOP  1
 
+struct loop_msg
+{
+    enum { _TYPE = 1, _DATA = 2, _SIGN = 4, _WIRE = 8 };
+
+    std::atomic<loop_msg*> _next;
+    std::string _type;
+    std::string _data;
+    std::string _sign;
+    int         _args;
+
+    loop_msg() : _next(nullptr), _args(0)
+    {
+    }
+};
+
+// events may be posted from any thread, they are queued here and drained by loop_update.
+static mpsc_queue<loop_msg> __loop_msgs;
+
+struct bind_entry
+{
+    std::string  _type;
+    bind_fn      _fn;
+    bind_wire_fn _wfn;
+    int          _flags;
+
+    bind_entry(const char *type, size_t tlen) : _type(type, tlen), _fn(nullptr), _wfn(nullptr), _flags(0)
+    {
+    }
+};
+
+// host handlers, a handle is 1 + the index of its entry. the types are hashed once,
+// when they are resolved, calls by handle only index the vector.
+static std::vector<bind_entry>              __bind_entries;
+static std::unordered_map<std::string, int> __bind_types;
+
 struct loop_data 
 {
     lua_State *_L;
+    char       _home[PATH_SIZE];
+    size_t     _hlen;
 
     int _c2l_loop;
     int _c2l_stop;
     int _c2l_event;
 	int _err_flag;
 
-    loop_data() : _L(nullptr),
+    std::vector<loop_msg*> _msgs;
+    std::set<std::string>  _coalesce;
+
+    loop_data() : _L(nullptr), _hlen(0),
 		_c2l_loop(LUA_NOREF), _c2l_stop(LUA_NOREF), _c2l_event(LUA_NOREF), _err_flag(0)
     {
+        this->_home[0] = '\0';
     }
     ~loop_data()
     {
@@ -48,6 +103,7 @@ static loop_data *_D = nullptr;
 static int
 __lua_panic(lua_State *L) 
 {
+    // lua aborts once this returns, fatal lines are written out before LOGF returns.
     const char * err = lua_tostring(L,-1);
     LOGF("%s", err);
 	_D->_err_flag++;
@@ -88,7 +144,13 @@ __lua_call(lua_State *L, int n, int r)
     //assert((RESIDENT_TOP + 1 + n) == lua_gettop(L));
 	_D->_err_flag++;
 
+    prof_site *site = prof_enter(L, -(n + 1));
+    TRACE_BEGIN("lua-call", prof_name(site), 0);
+    uint64_t t = util_clock();
     int err = lua_pcall(L, n, r, 1);
+    prof_leave(site, util_clock() - t);
+    TRACE_END("lua-call", prof_name(site), 0);
+    TRACE_COUNT("lua-heap-kb", lua_gc(L, LUA_GCCOUNT, 0));
     switch(err) {
     case LUA_OK:
 		_D->_err_flag--;
@@ -159,14 +221,173 @@ __l2c_bind(lua_State *L)
     return 0;
 }
 
+int
+bind_handle(const char *type, size_t tlen)
+{
+    std::string t(type, tlen);
+    auto it = __bind_types.find(t);
+    if (__bind_types.end() != it) {
+        return it->second;
+    }
+
+    __bind_entries.emplace_back(type, tlen);
+    int h = (int)__bind_entries.size();
+    __bind_types.emplace(std::move(t), h);
+    return h;
+}
+
+int
+bind_register(const char *type, bind_fn fn)
+{
+    int h = bind_handle(type, strlen(type));
+    bind_entry &e = __bind_entries[h - 1];
+    e._fn = fn; e._wfn = nullptr; e._flags = 0;
+    return h;
+}
+
+int
+bind_register_wire(const char *type, bind_wire_fn fn, int flags)
+{
+    int h = bind_handle(type, strlen(type));
+    bind_entry &e = __bind_entries[h - 1];
+    e._fn = nullptr; e._wfn = fn; e._flags = nullptr == fn ? 0 : flags;
+    return h;
+}
+
+// calls a structured handler and pushes what it returned. results of BIND_CONST types
+// are kept decoded in a registry table by handle, [0] holding their count.
+static int
+__bind_wire(lua_State *L, int h, const std::string &args)
+{
+    const bind_entry &e = __bind_entries[h - 1];
+    std::string out;
+    if (nullptr == L) {
+        e._wfn(args.data(), args.size(), out);
+        return 0;
+    }
+
+    int cache = 0;
+    if (0 != (e._flags & BIND_CONST)) {
+        lua_rawgetp(L, LUA_REGISTRYINDEX, &__bind_entries);
+        if (!lua_istable(L, -1)) {
+            lua_pop(L, 1);
+            lua_newtable(L);
+            lua_pushvalue(L, -1);
+            lua_rawsetp(L, LUA_REGISTRYINDEX, &__bind_entries);
+        }
+        cache = lua_gettop(L);
+        lua_rawgeti(L, cache, h);
+        if (lua_istable(L, -1)) {
+            lua_rawgeti(L, -1, 0);
+            int n = (int)lua_tointeger(L, -1);
+            lua_pop(L, 1);
+            luaL_checkstack(L, n, "bind results");
+            for (int i = 1; i <= n; ++i) {
+                lua_rawgeti(L, cache + 1, i);
+            }
+            lua_remove(L, cache + 1);
+            lua_remove(L, cache);
+            return n;
+        }
+        lua_pop(L, 1);
+    }
+
+    int n = 0;
+    if (e._wfn(args.data(), args.size(), out)) {
+        n = wire_unpack(L, out.data(), out.size());
+        if (n < 0) {
+            LOGE("bind-call\t%s bad results", e._type.c_str());
+            n = 0;
+        }
+    }
+
+    if (0 != cache) {
+        if (n > 0) {
+            lua_createtable(L, n, 1);
+            for (int i = 1; i <= n; ++i) {
+                lua_pushvalue(L, cache + i);
+                lua_rawseti(L, -2, i);
+            }
+            lua_pushinteger(L, n);
+            lua_rawseti(L, -2, 0);
+            lua_rawseti(L, cache, h);
+        }
+        lua_remove(L, cache);
+    }
+    return n;
+}
+
+int
+bind_invoke(int handle, const char *data, const char *sign, lua_State *L)
+{
+    if (handle < 1 || handle > (int)__bind_entries.size()) {
+        return 0;
+    }
+
+    const bind_entry &e = __bind_entries[handle - 1];
+    if (nullptr != e._fn) {
+        return e._fn(data, sign, L);
+    }
+    if (nullptr != e._wfn) {
+        std::string args;
+        if (nullptr != data || nullptr != sign) {
+            if (nullptr != data) wire_str(args, data, strlen(data)); else wire_nil(args);
+        }
+        if (nullptr != sign) {
+            wire_str(args, sign, strlen(sign));
+        }
+        return __bind_wire(L, handle, args);
+    }
+    return bind_call(e._type.c_str(), data, sign, L);
+}
+
+static int
+__l2c_handle(lua_State *L)
+{
+    size_t tlen = 0;
+    const char *type = luaL_checklstring(L, 1, &tlen);
+    lua_pushinteger(L, bind_handle(type, tlen));
+    return 1;
+}
+
 static int
 __l2c_call(lua_State *L)
 {
-    const char *type = lua_tostring(L, 1);
+    int h = 0;
+    if (LUA_TNUMBER == lua_type(L, 1)) {
+        h = (int)lua_tointeger(L, 1);
+        luaL_argcheck(L, h >= 1 && h <= (int)__bind_entries.size(), 1, "unknown handle");
+    } else {
+        // types seen by this state map to their handle in the upvalue, the lookup
+        // uses the hash lua keeps in the interned string.
+        luaL_checktype(L, 1, LUA_TSTRING);
+        lua_pushvalue(L, 1);
+        lua_rawget(L, lua_upvalueindex(1));
+        h = (int)lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        if (0 == h) {
+            size_t tlen = 0;
+            const char *type = lua_tolstring(L, 1, &tlen);
+            h = bind_handle(type, tlen);
+            lua_pushvalue(L, 1);
+            lua_pushinteger(L, h);
+            lua_rawset(L, lua_upvalueindex(1));
+        }
+    }
+
+    // structured handlers take the arguments as they are.
+    if (nullptr != __bind_entries[h - 1]._wfn) {
+        std::string args;
+        if (!wire_pack(L, 2, lua_gettop(L) - 1, args)) {
+            return luaL_argerror(L, 2, "unsupported argument type");
+        }
+        return __bind_wire(L, h, args);
+    }
+
     const char *data = lua_tostring(L, 2);
     const char *sign = lua_tostring(L, 3);
 
-    return bind_call(type, data, sign, L);
+    return bind_invoke(h, data, sign, L);
 }
 
 static int
@@ -177,33 +398,56 @@ __l2c_read(lua_State *L)
 	size_t plen = 0;
 	const char *path = lua_tolstring(L, 1, &plen);
 	if (nullptr != path && plen > 0) {
-		ret = bind_read(path, plen, L);
+		const char *data = nullptr;
+		size_t dlen = 0;
+		if (pack_find(path, plen, &data, &dlen)) {
+			lua_pushlstring(L, data, dlen);
+			ret = 1;
+		} else {
+			ret = bind_read(path, plen, L);
+		}
 	}
 
 	return ret;
 }
 
+static int
+__l2c_coalesce(lua_State *L)
+{
+    size_t tlen = 0;
+    const char *type = luaL_checklstring(L, 1, &tlen);
+    if (lua_isnone(L, 2) || lua_toboolean(L, 2)) {
+        _D->_coalesce.insert(std::string(type, tlen));
+    } else {
+        _D->_coalesce.erase(std::string(type, tlen));
+    }
+
+    return 0;
+}
+
 static int
 __luaopen_bind(lua_State *L)
 {
     luaL_Reg r[] = {
         { "bind", __l2c_bind },
-        { "call", __l2c_call },
+        { "handle", __l2c_handle },
         { "read", __l2c_read },
+        { "coalesce", __l2c_coalesce },
         { nullptr, nullptr },
     };
     luaL_newlib(L, r);
+
+    lua_newtable(L);
+    lua_pushcclosure(L, __l2c_call, 1);
+    lua_setfield(L, -2, "call");
     return 1;
 }
 
-int
-loop_start(const char *home)
+static void
+__lua_open(void)
 {
-    if (nullptr != _D) {
-        return 0;
-    }
+    assert(nullptr != _D && nullptr == _D->_L);
 
-    _D = new loop_data();
     _D->_L = luaL_newstate();
     lua_atpanic(_D->_L, __lua_panic);
     luaL_openlibs(_D->_L);
@@ -216,22 +460,53 @@ loop_start(const char *home)
     lua_pushglobaltable(_D->_L);
     luaL_setfuncs(_D->_L, g, 0);
 
+	lua_pushlstring(_D->_L, "HOME", sizeof("HOME") - 1);
+	lua_pushlstring(_D->_L, _D->_home, _D->_hlen);
+	lua_rawset(_D->_L, -3);
+    //assert(RESIDENT_LUA_ERROR == lua_gettop(_D->_L));
+}
+
+static void
+__lua_stop(void)
+{
+    if (LUA_NOREF != _D->_c2l_stop) {
+        lua_rawgeti(_D->_L, LUA_REGISTRYINDEX, _D->_c2l_stop);
+        __lua_call(_D->_L, 0, 1);
+        lua_settop(_D->_L, RESIDENT_TOP);
+    }
+}
+
+int
+loop_start(const char *home)
+{
+    if (nullptr != _D) {
+        return 0;
+    }
+
+    _D = new loop_data();
+
 	size_t hlen = 0;
 	if (nullptr == home) {
 		home = "./";
 		hlen = sizeof("./") - 1;
 	} else {
-		hlen = strnlen(home, PATH_SIZE);
+		hlen = strnlen(home, PATH_SIZE - 1);
 	}
-	lua_pushlstring(_D->_L, "HOME", sizeof("HOME") - 1);
-	lua_pushlstring(_D->_L, home, hlen);
-	lua_rawset(_D->_L, -3);
-    //assert(RESIDENT_LUA_ERROR == lua_gettop(_D->_L));
+	memcpy(_D->_home, home, hlen); _D->_home[hlen] = '\0';
+	_D->_hlen = hlen;
+
+    __lua_open();
 
     util_init(_D->_L);
-    file_init(_D->_L, home, hlen);
+    file_init(_D->_L, _D->_home, _D->_hlen);
     http_init(_D->_L);
     link_init(_D->_L);
+    pkg_init(_D->_L);
+    kv_init(_D->_L, _D->_home, _D->_hlen);
+    prof_init(_D->_L);
+    trace_init(_D->_L);
+    pool_init(0);
+    work_init(_D->_L, _D->_home, _D->_hlen);
     luaL_requiref(_D->_L, "cbind", __luaopen_bind, 0);
     //assert(RESIDENT_LUA_ERROR == lua_gettop(_D->_L));
 
@@ -241,6 +516,122 @@ loop_start(const char *home)
     return 1;
 }
 
+int
+loop_reload(void)
+{
+    if (nullptr == _D) {
+        return 0;
+    }
+
+    // only the lua state is rebuilt, subsystems keep their sockets, transfers and caches
+    // and forget every reference they held into the old state.
+    __lua_stop();
+
+    lua_close(_D->_L); _D->_L = nullptr;
+    _D->_c2l_loop = LUA_NOREF;
+    _D->_c2l_stop = LUA_NOREF;
+    _D->_c2l_event = LUA_NOREF;
+    _D->_err_flag = 0;
+
+    __lua_open();
+
+    util_reload(_D->_L);
+    file_reload(_D->_L);
+    http_reload(_D->_L);
+    link_reload(_D->_L);
+    pkg_reload(_D->_L);
+    kv_reload(_D->_L);
+    prof_reload(_D->_L);
+    trace_reload(_D->_L);
+    pool_reload();
+    work_reload(_D->_L);
+    luaL_requiref(_D->_L, "cbind", __luaopen_bind, 0);
+
+    __lua_boot();
+
+    lua_settop(_D->_L, RESIDENT_TOP);
+    return 1;
+}
+
+static void
+__loop_msgs_drain(void)
+{
+    std::vector<loop_msg*> &msgs = _D->_msgs;
+    loop_msg *m = nullptr;
+    while (nullptr != (m = __loop_msgs.pop())) {
+        msgs.push_back(m);
+    }
+
+    // only the newest event of a coalesced type is delivered.
+    if (!_D->_coalesce.empty() && msgs.size() > 1) {
+        std::set<std::string> seen;
+        for (size_t i = msgs.size(); i-- > 0;) {
+            if (_D->_coalesce.count(msgs[i]->_type) > 0 && !seen.insert(msgs[i]->_type).second) {
+                delete msgs[i]; msgs[i] = nullptr;
+            }
+        }
+    }
+
+    for (auto it : msgs) {
+        if (nullptr == it) {
+            continue;
+        }
+
+        // the profiler is driven by the host directly, it must work even when scripts misbehave.
+        if (0 != (it->_args & loop_msg::_WIRE)) {
+            // structured events skip the host commands below.
+        } else if (0 == it->_type.compare("prof.start")) {
+            prof_start((uint64_t)atoi(it->_data.c_str()));
+            delete it; continue;
+        } else if (0 == it->_type.compare("prof.stop")) {
+            prof_stop(it->_data.data(), it->_data.size());
+            delete it; continue;
+        } else if (0 == it->_type.compare("trace.start")) {
+            trace_start((size_t)atoi(it->_data.c_str()));
+            delete it; continue;
+        } else if (0 == it->_type.compare("trace.stop")) {
+            trace_stop();
+            trace_dump(it->_data.data(), it->_data.size());
+            delete it; continue;
+        }
+
+        if (LUA_NOREF != _D->_c2l_event && 0 != (it->_args & loop_msg::_WIRE)) {
+            lua_rawgeti(_D->_L, LUA_REGISTRYINDEX, _D->_c2l_event);
+            lua_pushlstring(_D->_L, it->_type.data(), it->_type.size());
+            int n = wire_unpack(_D->_L, it->_data.data(), it->_data.size());
+            if (n < 0) {
+                LOGE("loop-event\t%s bad payload", it->_type.c_str());
+            } else {
+                __lua_call(_D->_L, 1 + n, 0);
+            }
+
+            lua_settop(_D->_L, RESIDENT_TOP);
+        } else if (LUA_NOREF != _D->_c2l_event) {
+            lua_rawgeti(_D->_L, LUA_REGISTRYINDEX, _D->_c2l_event);
+            if (0 != (it->_args & loop_msg::_TYPE)) {
+                lua_pushlstring(_D->_L, it->_type.data(), it->_type.size());
+            } else {
+                lua_pushnil(_D->_L);
+            }
+            if (0 != (it->_args & loop_msg::_DATA)) {
+                lua_pushlstring(_D->_L, it->_data.data(), it->_data.size());
+            } else {
+                lua_pushnil(_D->_L);
+            }
+            if (0 != (it->_args & loop_msg::_SIGN)) {
+                lua_pushlstring(_D->_L, it->_sign.data(), it->_sign.size());
+            } else {
+                lua_pushnil(_D->_L);
+            }
+            __lua_call(_D->_L, 3, 0);
+
+            lua_settop(_D->_L, RESIDENT_TOP);
+        }
+        delete it;
+    }
+    msgs.clear();
+}
+
 int
 loop_update(void)
 {
@@ -248,11 +639,17 @@ loop_update(void)
 		return 0;
 	}
 	LOGI("loop-update");
+	TRACE_BEGIN("loop_update", nullptr, 0);
+
+	__loop_msgs_drain();
 
 	link_loop(_D->_L);
+	log_loop(_D->_L);
 
 	size_t n = http_loop(_D->_L);
 
+	n += pool_loop(_D->_L);
+
 	if (0 == _D->_err_flag) {
 		if (LUA_NOREF != _D->_c2l_loop) {
 			lua_rawgeti(_D->_L, LUA_REGISTRYINDEX, _D->_c2l_loop);
@@ -260,28 +657,42 @@ loop_update(void)
 		}
 	} else {
 		if (0 == n) {
-			bind_call("loop.restart", "5000", "");
+			bind_invoke(bind_handle("loop.restart", sizeof("loop.restart") - 1), "5000", "");
 		}
 	}
 
 	lua_settop(_D->_L, RESIDENT_TOP);
 
+	TRACE_END("loop_update", nullptr, 0);
 	return 0;
 }
 
 void
 loop_event(const char *type, const char *data, const char *sign)
 {
-    if (nullptr != _D && LUA_NOREF != _D->_c2l_event) {
+    loop_msg *m = new loop_msg();
+    if (nullptr != type) {
+        m->_type.assign(type); m->_args |= loop_msg::_TYPE;
+    }
+    if (nullptr != data) {
+        m->_data.assign(data); m->_args |= loop_msg::_DATA;
+    }
+    if (nullptr != sign) {
+        m->_sign.assign(sign); m->_args |= loop_msg::_SIGN;
+    }
 
-        lua_rawgeti(_D->_L, LUA_REGISTRYINDEX, _D->_c2l_event);
-        lua_pushstring(_D->_L, type);
-        lua_pushstring(_D->_L, data);
-        lua_pushstring(_D->_L, sign);
-        __lua_call(_D->_L, 3, 0);
+    __loop_msgs.push(m);
+}
 
-        lua_settop(_D->_L, RESIDENT_TOP);
-    }
+void
+loop_post(const char *type, const char *data, size_t dlen)
+{
+    loop_msg *m = new loop_msg();
+    m->_type.assign(nullptr == type ? "" : type);
+    m->_data.assign(data, dlen);
+    m->_args = loop_msg::_TYPE | loop_msg::_WIRE;
+
+    __loop_msgs.push(m);
 }
 
 void
@@ -294,12 +705,19 @@ void
 loop_stop(void)
 {
     if (nullptr != _D) {
-        if (LUA_NOREF != _D->_c2l_stop) {
-            lua_rawgeti(_D->_L, LUA_REGISTRYINDEX, _D->_c2l_stop);
-            __lua_call(_D->_L, 0, 1);
-            lua_settop(_D->_L, RESIDENT_TOP);
+        __lua_stop();
+
+        loop_msg *m = nullptr;
+        while (nullptr != (m = __loop_msgs.pop())) {
+            delete m;
         }
 
+		pool_fini();
+		work_fini(_D->_L);
+		prof_fini(_D->_L);
+		pkg_fini(_D->_L);
+		kv_fini(_D->_L);
+		trace_fini(_D->_L);
 		link_fini(_D->_L);
         http_fini(_D->_L);
         file_fini(_D->_L);
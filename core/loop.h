@@ -1,6 +1,8 @@
 #ifndef __PD_LOOP_H__
 #define __PD_LOOP_H__
 
+#include <stddef.h>
+
 struct lua_State;
 
 int
@@ -9,9 +11,17 @@ loop_start(const char *home);
 int
 loop_update(void);
 
+int
+loop_reload(void);
+
 void
 loop_event(const char *type, const char *data, const char *sign);
 
+// a structured event, data holds wire encoded values (see wire.h) which the
+// lua event handler receives decoded, after the type.
+void
+loop_post(const char *type, const char *data, size_t dlen);
+
 void
 loop_call(lua_State *L, int n, int r);
 
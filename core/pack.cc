@@ -0,0 +1,111 @@
+#include <pack.h>
+#include <file.h>
+
+#include <string.h>
+
+struct pack_data
+{
+	char            *_data;
+	size_t           _size;
+	const pack_item *_items;
+	uint32_t         _count;
+
+	pack_data(void) : _data(nullptr), _size(0), _items(nullptr), _count(0)
+	{
+	}
+
+	~pack_data(void)
+	{
+		file_unmap(this->_data, this->_size);
+	}
+};
+
+static pack_data *_A = nullptr;
+
+static inline bool
+__pack_check(pack_data *a)
+{
+	if (a->_size < sizeof(pack_head)) {
+		return false;
+	}
+
+	const pack_head *h = (const pack_head*)a->_data;
+	if (0 != memcmp(h->_magic, PACK_MAGIC, sizeof(h->_magic)) || PACK_VERSION != h->_version) {
+		return false;
+	}
+	if ((a->_size - sizeof(pack_head)) / sizeof(pack_item) < h->_count) {
+		return false;
+	}
+
+	const pack_item *items = (const pack_item*)(a->_data + sizeof(pack_head));
+	for (uint32_t i = 0; i < h->_count; ++i) {
+		const pack_item &it = items[i];
+		if ((uint64_t)it._noff + it._nlen > a->_size || it._doff > a->_size || it._size > a->_size - it._doff || 0 != it._flags) {
+			return false;
+		}
+	}
+
+	a->_items = items;
+	a->_count = h->_count;
+	return true;
+}
+
+int
+pack_open(const char *path)
+{
+	pack_data *a = new pack_data();
+	a->_data = (char*)file_map(path, &a->_size);
+	if (nullptr == a->_data || !__pack_check(a)) {
+		LOGW("pack-open\t%s failed", path);
+		delete a;
+		return 0;
+	}
+
+	pack_close();
+	_A = a;
+
+	LOGI("pack-open\t%s %u", path, (unsigned int)_A->_count);
+	return 1;
+}
+
+int
+pack_find(const char *name, size_t nlen, const char **data, size_t *size)
+{
+	if (nullptr == _A) {
+		return 0;
+	}
+
+	// binary search, names are sorted bytewise with the shorter prefix first.
+	uint32_t lo = 0, hi = _A->_count;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		const pack_item &it = _A->_items[mid];
+		size_t n = it._nlen < nlen ? it._nlen : nlen;
+		int c = memcmp(_A->_data + it._noff, name, n);
+		if (0 == c) {
+			c = it._nlen < nlen ? -1 : (it._nlen > nlen ? 1 : 0);
+		}
+		if (0 == c) {
+			*data = _A->_data + it._doff;
+			*size = (size_t)it._size;
+			return 1;
+		}
+		if (c < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return 0;
+}
+
+void
+pack_close(void)
+{
+	if (nullptr == _A) {
+		return;
+	}
+
+	delete _A; _A = nullptr;
+}
@@ -0,0 +1,40 @@
+#ifndef __PD_PACK__
+#define __PD_PACK__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PACK_MAGIC "PDPK"
+#define PACK_VERSION 1
+
+// file layout, little endian:
+//   pack_head, pack_item[_count] sorted by name, names, then the blobs.
+//   all offsets are from the start of the file.
+struct pack_head
+{
+	char     _magic[4];
+	uint32_t _version;
+	uint32_t _count;
+	uint32_t _flags;
+};
+
+struct pack_item
+{
+	uint32_t _noff;
+	uint32_t _nlen;
+	uint64_t _doff;
+	uint64_t _size;
+	uint32_t _flags; // reserved for compressed blobs, none are written yet
+	uint32_t _rsvd;
+};
+
+int
+pack_open(const char *path);
+
+int
+pack_find(const char *name, size_t nlen, const char **data, size_t *size);
+
+void
+pack_close(void);
+
+#endif // __PD_PACK__
@@ -0,0 +1,566 @@
+#include <pkg.h>
+#include <file.h>
+#include <bind.h>
+#include <pack.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <lua/lauxlib.h>
+#include <lua/lua.h>
+#include <lua/lualib.h>
+#ifdef __cplusplus
+} //extern "C"
+#endif //__cplusplus
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <map>
+#include <unordered_map>
+
+#define PKG_DIR "luac/"
+#define PKG_INDEX "luac/index"
+#define PKG_INDEX_HEAD "PDIX 1"
+
+// one module in the index, an empty path is a known miss.
+struct pkg_entry
+{
+	std::string _path;
+	uint64_t    _size;
+	uint64_t    _mtime;
+};
+
+// module index kept across boots, answers require() without walking package.path on disk.
+struct pkg_data
+{
+	std::string                                _ppath; // package.path the index was built for
+	std::unordered_map<std::string, pkg_entry> _mods;
+	std::map<std::string, uint64_t>            _dirs;  // every directory probed, with its mtime
+	bool                                       _dirty;
+
+	void reset(const char *ppath) {
+		_ppath = ppath; _mods.clear(); _dirs.clear(); _dirty = true;
+	}
+};
+
+static pkg_data *_I = nullptr;
+
+// every cached chunk starts with this header, the chunk is only used when it matches the source.
+struct pkg_head
+{
+	char     _magic[4];
+	uint32_t _version;
+	uint64_t _size;
+	uint64_t _stamp; // source mtime, or a hash when the source has no file behind it
+};
+
+static const char __PKG_MAGIC[4] = { 'P', 'D', 'L', 'C' };
+
+static inline uint64_t
+__pkg_hash(const char *data, size_t dlen)
+{
+	uint64_t h = 14695981039346656037ULL;
+	const unsigned char *p = (const unsigned char*)data, *e = p + dlen;
+	while (p < e) {
+		h ^= *p++;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static inline size_t
+__pkg_cpath(const char *name, size_t nlen, char *cpath, size_t csize)
+{
+	size_t clen = sizeof(PKG_DIR) - 1;
+	if (clen + nlen + sizeof(".luac") > csize) {
+		return 0;
+	}
+
+	memcpy(cpath, PKG_DIR, clen);
+	for (size_t i = 0; i < nlen; ++i) {
+		char c = name[i];
+		cpath[clen++] = ('/' == c || '\\' == c || ':' == c) ? '.' : c;
+	}
+	memcpy(cpath + clen, ".luac", sizeof(".luac"));
+	return clen + sizeof(".luac") - 1;
+}
+
+static inline int
+__pkg_stat(const char *path, uint64_t *size, uint64_t *mtime)
+{
+	struct stat st;
+	if (0 != stat(path, &st)) {
+		return 0;
+	}
+
+	*size = (uint64_t)st.st_size;
+	*mtime = (uint64_t)st.st_mtime;
+	return 1;
+}
+
+// written aside and renamed, a crash never leaves a torn file behind.
+static void
+__pkg_write(const char *path, size_t plen, const std::string &data)
+{
+	file_write((char*)path, plen, data.data(), data.size(), 0);
+}
+
+static int
+__pkg_writer(lua_State *L, const void *p, size_t sz, void *ud)
+{
+	((std::string*)ud)->append((const char*)p, sz);
+	return 0;
+}
+
+// loads the cached chunk of name when its header matches size and stamp.
+static int
+__pkg_cached(lua_State *L, const char *name, size_t nlen, uint64_t size, uint64_t stamp, const char *chunk)
+{
+	char cpath[PATH_SIZE];
+	size_t clen = __pkg_cpath(name, nlen, cpath, sizeof(cpath));
+	if (0 == clen) {
+		return 0;
+	}
+
+	size_t flen = 0, msize = 0;
+	char *data = (char*)file_map(file_path(cpath, clen, &flen), &msize);
+	if (nullptr == data) {
+		return 0;
+	}
+
+	int ret = 0;
+	pkg_head head;
+	if (msize > sizeof(head)) {
+		memcpy(&head, data, sizeof(head));
+		if (0 == memcmp(head._magic, __PKG_MAGIC, sizeof(__PKG_MAGIC)) && LUA_VERSION_NUM == head._version && size == head._size && stamp == head._stamp) {
+			ret = (LUA_OK == luaL_loadbufferx(L, data + sizeof(head), msize - sizeof(head), chunk, "b")) ? 1 : 0;
+			if (0 == ret) {
+				lua_pop(L, 1);
+			}
+		}
+	}
+	file_unmap(data, msize);
+
+	return ret;
+}
+
+// dumps the function on top of the stack into the cache.
+static void
+__pkg_store(lua_State *L, const char *name, size_t nlen, uint64_t size, uint64_t stamp)
+{
+	char cpath[PATH_SIZE];
+	size_t clen = __pkg_cpath(name, nlen, cpath, sizeof(cpath) - 4);
+	if (0 == clen) {
+		return;
+	}
+
+	std::string code;
+	if (0 != lua_dump(L, __pkg_writer, &code)) {
+		return;
+	}
+
+	pkg_head head;
+	memcpy(head._magic, __PKG_MAGIC, sizeof(__PKG_MAGIC));
+	head._version = LUA_VERSION_NUM;
+	head._size = size;
+	head._stamp = stamp;
+
+	code.insert(0, (const char*)&head, sizeof(head));
+	__pkg_write(cpath, clen, code);
+}
+
+static int
+__pkg_load(lua_State *L, const char *src, size_t slen, const char *chunk, size_t clen)
+{
+	uint64_t stamp = __pkg_hash(src, slen);
+	if (__pkg_cached(L, chunk, clen, (uint64_t)slen, stamp, chunk)) {
+		return 1;
+	}
+
+	if (LUA_OK != luaL_loadbufferx(L, src, slen, chunk, "t")) {
+		lua_pushnil(L);
+		lua_insert(L, -2);
+		return 2;
+	}
+
+	__pkg_store(L, chunk, clen, (uint64_t)slen, stamp);
+	return 1;
+}
+
+static int
+__pkg_loader(lua_State *L, const char *name, size_t nlen, pkg_entry &e)
+{
+	char chunk[PATH_SIZE + 1];
+	snprintf(chunk, sizeof(chunk), "@%s", e._path.c_str());
+
+	if (__pkg_cached(L, name, nlen, e._size, e._mtime, chunk)) {
+		return 1;
+	}
+
+	size_t slen = 0;
+	char *src = (char*)file_map(e._path.c_str(), &slen);
+	int err = luaL_loadbufferx(L, nullptr != src ? src : "", slen, chunk, "t");
+	file_unmap(src, slen);
+	if (LUA_OK != err) {
+		return luaL_error(L, "error loading module '%s' from file '%s':\n\t%s", name, e._path.c_str(), lua_tostring(L, -1));
+	}
+
+	__pkg_store(L, name, nlen, e._size, e._mtime);
+	return 1;
+}
+
+// walks package.path for name and records the answer, a hit or a miss, in the index.
+static pkg_entry&
+__pkg_probe(const std::string &name, const char *tp)
+{
+	pkg_entry &e = _I->_mods[name];
+	e._path.clear();
+	e._size = e._mtime = 0;
+	_I->_dirty = true;
+
+	std::string mod(name);
+	for (auto &c : mod) {
+		if ('.' == c) c = '/';
+	}
+
+	while (';' == *tp) ++tp;
+	while ('\0' != *tp) {
+		const char *te = strchr(tp, ';');
+		if (nullptr == te) {
+			te = tp + strlen(tp);
+		}
+
+		std::string path;
+		for (const char *c = tp; c < te; ++c) {
+			if ('?' == *c) {
+				path.append(mod);
+			} else {
+				path.push_back(*c);
+			}
+		}
+
+		// the index stays valid as long as the directories it looked into are unchanged.
+		std::string dir = path.substr(0, path.find_last_of('/') + 1);
+		if (!dir.empty() && 0 == _I->_dirs.count(dir)) {
+			uint64_t dsize = 0, dtime = 0;
+			__pkg_stat(dir.c_str(), &dsize, &dtime);
+			_I->_dirs[dir] = dtime;
+		}
+
+		if (__pkg_stat(path.c_str(), &e._size, &e._mtime)) {
+			e._path = path;
+			break;
+		}
+
+		tp = te;
+		while (';' == *tp) ++tp;
+	}
+
+	return e;
+}
+
+// checks every probed directory again, misses recorded before one of them changed are dropped.
+// modules downloaded at runtime become visible this way, writing a file touches its directory.
+static bool
+__pkg_recheck(void)
+{
+	bool changed = false;
+	for (auto &d : _I->_dirs) {
+		uint64_t dsize = 0, dtime = 0;
+		__pkg_stat(d.first.c_str(), &dsize, &dtime);
+		if (dtime != d.second) {
+			d.second = dtime;
+			changed = true;
+		}
+	}
+	if (!changed) {
+		return false;
+	}
+
+	for (auto it = _I->_mods.begin(); it != _I->_mods.end();) {
+		if (it->second._path.empty()) {
+			it = _I->_mods.erase(it);
+		} else {
+			++it;
+		}
+	}
+	_I->_dirty = true;
+	return true;
+}
+
+// package.searchers[2], answers from the module index, then home, then the asset pack.
+static int
+__pkg_searcher(lua_State *L)
+{
+	size_t nlen = 0;
+	const char *name = luaL_checklstring(L, 1, &nlen);
+	std::string key(name, nlen);
+
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "path");
+	const char *tp = lua_tostring(L, -1);
+	if (nullptr == tp) {
+		return 0;
+	}
+	if (0 != _I->_ppath.compare(tp)) {
+		_I->reset(tp);
+	}
+
+	// a hit is still checked against the file, it may have been edited or moved since.
+	auto it = _I->_mods.find(key);
+	pkg_entry *e = (_I->_mods.end() != it) ? &it->second : nullptr;
+	if (nullptr != e && !e->_path.empty()) {
+		uint64_t size = 0, mtime = 0;
+		if (!__pkg_stat(e->_path.c_str(), &size, &mtime)) {
+			e = nullptr;
+		} else if (size != e->_size || mtime != e->_mtime) {
+			e->_size = size; e->_mtime = mtime;
+			_I->_dirty = true;
+		}
+	} else if (nullptr != e && __pkg_recheck()) {
+		e = nullptr;
+	}
+	if (nullptr == e) {
+		e = &__pkg_probe(key, tp);
+	}
+
+	if (!e->_path.empty() && __pkg_loader(L, name, nlen, *e)) {
+		lua_pushlstring(L, e->_path.data(), e->_path.size());
+		return 2;
+	}
+
+	std::string asset(key);
+	for (auto &c : asset) {
+		if ('.' == c) c = '/';
+	}
+	asset.append(".lua");
+	const char *src = nullptr;
+	size_t slen = 0;
+	if (pack_find(asset.data(), asset.size(), &src, &slen)) {
+		std::string chunk("@" + asset);
+		if (1 != __pkg_load(L, src, slen, chunk.data(), chunk.size())) {
+			return luaL_error(L, "error loading module '%s' from pack:\n\t%s", name, lua_tostring(L, -1));
+		}
+		lua_pushlstring(L, asset.data(), asset.size());
+		return 2;
+	}
+
+	lua_pushfstring(L, "\n\tno module '%s' in index or pack", name);
+	return 1;
+}
+
+// cpkg.load(source, chunkname), load() for sources without a file behind them.
+static int
+__l2c_load(lua_State *L)
+{
+	size_t slen = 0, clen = 0;
+	const char *src = luaL_checklstring(L, 1, &slen);
+	const char *chunk = luaL_checklstring(L, 2, &clen);
+
+	return __pkg_load(L, src, slen, chunk, clen);
+}
+
+// cpkg.asset(name[, chunkname]), loads a script asset such as boot.lua, from the pack when it has one.
+static int
+__l2c_asset(lua_State *L)
+{
+	size_t nlen = 0, clen = 0;
+	const char *name = luaL_checklstring(L, 1, &nlen);
+	const char *chunk = luaL_optlstring(L, 2, name, &clen);
+
+	const char *src = nullptr;
+	size_t slen = 0;
+	if (!pack_find(name, nlen, &src, &slen)) {
+		lua_settop(L, 2);
+		if (0 == bind_read(name, nlen, L) || nullptr == (src = lua_tolstring(L, -1, &slen))) {
+			lua_pushnil(L);
+			lua_pushfstring(L, "asset %s not found", name);
+			return 2;
+		}
+	}
+
+	return __pkg_load(L, src, slen, chunk, clen);
+}
+
+static void
+__pkg_save(void)
+{
+	if (!_I->_dirty || _I->_ppath.empty()) {
+		return;
+	}
+
+	std::string data(PKG_INDEX_HEAD "\n");
+	data.append("P ").append(_I->_ppath).push_back('\n');
+	char temp[64];
+	for (auto &d : _I->_dirs) {
+		snprintf(temp, sizeof(temp), "D %llu ", (unsigned long long)d.second);
+		data.append(temp).append(d.first).push_back('\n');
+	}
+	for (auto &m : _I->_mods) {
+		if (m.second._path.empty()) {
+			data.append("N ").append(m.first).push_back('\n');
+		} else {
+			snprintf(temp, sizeof(temp), " %llu %llu ", (unsigned long long)m.second._size, (unsigned long long)m.second._mtime);
+			data.append("M ").append(m.first).append(temp).append(m.second._path).push_back('\n');
+		}
+	}
+
+	__pkg_write(PKG_INDEX, sizeof(PKG_INDEX) - 1, data);
+	_I->_dirty = false;
+}
+
+// reads the index back, the whole of it is dropped when any probed directory has changed.
+static void
+__pkg_index(void)
+{
+	_I->reset("");
+	_I->_dirty = false;
+
+	char ipath[] = PKG_INDEX;
+	size_t flen = 0, size = 0;
+	char *data = (char*)file_map(file_path(ipath, sizeof(ipath) - 1, &flen), &size);
+	if (nullptr == data) {
+		return;
+	}
+
+	const char *p = data, *e = data + size;
+	bool ok = false;
+	for (int n = 0; p < e; ++n) {
+		const char *l = (const char*)memchr(p, '\n', e - p);
+		if (nullptr == l) {
+			break;
+		}
+		std::string line(p, l - p);
+		p = l + 1;
+
+		if (0 == n) {
+			if (0 != line.compare(PKG_INDEX_HEAD)) break;
+			continue;
+		}
+
+		ok = false;
+		if (line.size() < 2 || ' ' != line[1]) break;
+		const char *v = line.c_str() + 2;
+		char *t = nullptr;
+		if ('P' == line[0]) {
+			_I->_ppath = v;
+		} else if ('D' == line[0]) {
+			uint64_t mtime = strtoull(v, &t, 10), dsize = 0, dtime = 0;
+			if (' ' != *t) break;
+			__pkg_stat(t + 1, &dsize, &dtime);
+			if (dtime != mtime) break;
+			_I->_dirs[t + 1] = mtime;
+		} else if ('N' == line[0]) {
+			_I->_mods[v];
+		} else if ('M' == line[0]) {
+			const char *s = strchr(v, ' ');
+			if (nullptr == s) break;
+			pkg_entry &m = _I->_mods[std::string(v, s - v)];
+			m._size = strtoull(s + 1, &t, 10);
+			if (' ' != *t) break;
+			m._mtime = strtoull(t + 1, &t, 10);
+			if (' ' != *t) break;
+			m._path = t + 1;
+		} else {
+			break;
+		}
+		ok = true;
+	}
+	file_unmap(data, size);
+
+	if (!ok || p != e) {
+		_I->reset("");
+		_I->_dirty = false;
+	}
+}
+
+// cpkg.rebuild(), forgets the module index, the next requires probe the disk again.
+static int
+__l2c_rebuild(lua_State *L)
+{
+	_I->reset("");
+	_I->_dirty = false;
+
+	char ipath[] = PKG_INDEX;
+	file_remove(ipath, sizeof(ipath) - 1);
+	return 0;
+}
+
+// cpkg.index(), the indexed modules as name = path, false for known misses.
+static int
+__l2c_index(lua_State *L)
+{
+	lua_createtable(L, 0, (int)_I->_mods.size());
+	for (auto &m : _I->_mods) {
+		lua_pushlstring(L, m.first.data(), m.first.size());
+		if (m.second._path.empty()) {
+			lua_pushboolean(L, 0);
+		} else {
+			lua_pushlstring(L, m.second._path.data(), m.second._path.size());
+		}
+		lua_rawset(L, -3);
+	}
+	return 1;
+}
+
+static int
+__luaopen_pkg(lua_State *L)
+{
+	luaL_Reg r[] = {
+		{ "load", __l2c_load },
+		{ "asset", __l2c_asset },
+		{ "rebuild", __l2c_rebuild },
+		{ "index", __l2c_index },
+		{ nullptr, nullptr },
+	};
+	luaL_newlib(L, r);
+	return 1;
+}
+
+static void
+__pkg_install(lua_State *L)
+{
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "searchers");
+	if (lua_istable(L, -1)) {
+		// takes the place of the stock lua file searcher, after preload.
+		lua_pushcfunction(L, __pkg_searcher);
+		lua_rawseti(L, -2, 2);
+	}
+	lua_pop(L, 2);
+
+	luaL_requiref(L, "cpkg", __luaopen_pkg, 0);
+}
+
+void
+pkg_init(lua_State *L)
+{
+	_I = new pkg_data();
+	__pkg_index();
+	__pkg_install(L);
+}
+
+void
+pkg_reload(lua_State *L)
+{
+	// a reload is when scripts change, so the index is revalidated against the disk.
+	__pkg_save();
+	__pkg_index();
+	__pkg_install(L);
+}
+
+void
+pkg_fini(lua_State *L)
+{
+	if (nullptr == _I) {
+		return;
+	}
+
+	__pkg_save();
+	delete _I; _I = nullptr;
+}
@@ -0,0 +1,17 @@
+#ifndef __PD_PKG__
+#define __PD_PKG__
+
+#include <stddef.h>
+
+struct lua_State;
+
+void
+pkg_init(lua_State *L);
+
+void
+pkg_reload(lua_State *L);
+
+void
+pkg_fini(lua_State *L);
+
+#endif // __PD_PKG__
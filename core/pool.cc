@@ -0,0 +1,211 @@
+#include <pool.h>
+#include <util.h>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <deque>
+#include <list>
+
+struct pool_job
+{
+	pool_work _work;
+	pool_done _done;
+	size_t    _gen;
+	bool      _busy; // pushed, counted in _busy until its done runs
+};
+
+struct pool_data
+{
+	std::vector<std::thread> _threads;
+	std::mutex               _lock;
+	std::condition_variable  _cond;
+	std::deque<pool_job*>    _jobs;
+	std::mutex               _dlock;
+	std::list<pool_job*>     _done;
+	size_t                   _busy;
+	size_t                   _gen;
+	bool                     _quit;
+
+	pool_data(void) : _busy(0), _gen(0), _quit(false)
+	{
+	}
+
+	~pool_data(void)
+	{
+		for (auto it : this->_jobs) {
+			delete it;
+		}
+		for (auto it : this->_done) {
+			delete it;
+		}
+	}
+};
+
+static pool_data *_P = nullptr;
+
+// generation of the job running on this thread, so pool_post tags progress the same way.
+static THREAD_LOCAL size_t __pool_gen = 0;
+
+static void
+__pool_main(int idx)
+{
+	while (true) {
+		pool_job *job = nullptr;
+		{
+			std::unique_lock<std::mutex> lock(_P->_lock);
+			while (!_P->_quit && _P->_jobs.empty()) {
+				_P->_cond.wait(lock);
+			}
+			if (_P->_quit) {
+				break;
+			}
+			job = _P->_jobs.front(); _P->_jobs.pop_front();
+		}
+
+		__pool_gen = job->_gen;
+		if (job->_work) {
+			job->_work(idx);
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(_P->_dlock);
+			_P->_done.push_back(job);
+		}
+	}
+}
+
+void
+pool_init(size_t n)
+{
+	if (nullptr != _P) {
+		return;
+	}
+
+	if (0 == n) {
+		n = std::thread::hardware_concurrency();
+		n = n > 1 ? n - 1 : 1;
+	}
+	if (n > POOL_MAX) {
+		n = POOL_MAX;
+	}
+
+	_P = new pool_data();
+	for (size_t i = 0; i < n; ++i) {
+		_P->_threads.push_back(std::thread(__pool_main, (int)i));
+	}
+}
+
+size_t
+pool_size(void)
+{
+	return nullptr == _P ? 0 : _P->_threads.size();
+}
+
+int
+pool_push(pool_work work, pool_done done)
+{
+	if (nullptr == _P) {
+		return 0;
+	}
+
+	pool_job *job = new pool_job();
+	job->_work = work;
+	job->_done = done;
+	job->_busy = true;
+	{
+		std::lock_guard<std::mutex> lock(_P->_lock);
+		job->_gen = _P->_gen;
+		_P->_jobs.push_back(job);
+		++_P->_busy;
+	}
+	_P->_cond.notify_one();
+
+	return 1;
+}
+
+int
+pool_post(pool_done done)
+{
+	if (nullptr == _P) {
+		return 0;
+	}
+
+	pool_job *job = new pool_job();
+	job->_done = done;
+	job->_gen = __pool_gen;
+	job->_busy = false;
+	{
+		std::lock_guard<std::mutex> lock(_P->_dlock);
+		_P->_done.push_back(job);
+	}
+
+	return 1;
+}
+
+size_t
+pool_loop(lua_State *L)
+{
+	if (nullptr == _P) {
+		return 0;
+	}
+
+	std::list<pool_job*> done;
+	{
+		std::lock_guard<std::mutex> lock(_P->_dlock);
+		done.swap(_P->_done);
+	}
+
+	size_t gen = 0, busy = 0;
+	{
+		std::lock_guard<std::mutex> lock(_P->_lock);
+		for (auto it : done) {
+			if (it->_busy) {
+				--_P->_busy;
+			}
+		}
+		gen = _P->_gen;
+		busy = _P->_busy;
+	}
+
+	// callbacks queued before a reload hold references into a closed state, drop them.
+	for (auto it : done) {
+		if (it->_done && gen == it->_gen) {
+			it->_done(L);
+		}
+		delete it;
+	}
+
+	return busy;
+}
+
+void
+pool_reload(void)
+{
+	if (nullptr == _P) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(_P->_lock);
+	++_P->_gen;
+}
+
+void
+pool_fini(void)
+{
+	if (nullptr == _P) {
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(_P->_lock);
+		_P->_quit = true;
+	}
+	_P->_cond.notify_all();
+	for (auto &it : _P->_threads) {
+		it.join();
+	}
+
+	delete _P; _P = nullptr;
+}
@@ -0,0 +1,36 @@
+#ifndef __PD_POOL__
+#define __PD_POOL__
+
+#include <stddef.h>
+#include <functional>
+
+#define POOL_MAX 8
+
+struct lua_State;
+
+// work runs on a pool thread and gets the thread index, done runs on the loop thread.
+typedef std::function<void(int)> pool_work;
+typedef std::function<void(lua_State*)> pool_done;
+
+void
+pool_init(size_t n);
+
+size_t
+pool_size(void);
+
+int
+pool_push(pool_work work, pool_done done);
+
+int
+pool_post(pool_done done);
+
+size_t
+pool_loop(lua_State *L);
+
+void
+pool_reload(void);
+
+void
+pool_fini(void);
+
+#endif // __PD_POOL__
@@ -0,0 +1,321 @@
+#include <prof.h>
+#include <util.h>
+#include <file.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <lua/lauxlib.h>
+#include <lua/lua.h>
+#include <lua/lualib.h>
+#ifdef __cplusplus
+} //extern "C"
+#endif //__cplusplus
+
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <string>
+#include <unordered_map>
+
+struct prof_site
+{
+	const char *_name;
+	uint64_t _count;
+	uint64_t _total;
+	uint64_t _max;
+	uint64_t _hist[PROF_HIST]; // [2^(i-1), 2^i) microseconds
+
+	prof_site(void) : _name(nullptr), _count(0), _total(0), _max(0)
+	{
+		memset(this->_hist, 0, sizeof(this->_hist));
+	}
+};
+
+struct prof_data
+{
+	lua_State *_L;
+
+	// sites by "source:line". keyed by content, source strings are collectable and their
+	// addresses get reused by other chunks. _key is scratch so a lookup doesn't allocate.
+	std::unordered_map<std::string, prof_site> _sites;
+	std::string _key;
+
+	// sampler, folded stacks "outer;...;inner" -> samples
+	int         _active;
+	uint64_t    _period;
+	uint64_t    _next;
+	std::string _stack;
+	std::unordered_map<std::string, uint64_t> _samples;
+
+	prof_data(void) : _L(nullptr), _active(0), _period(0), _next(0)
+	{
+	}
+};
+
+static prof_data *_R = nullptr;
+
+prof_site*
+prof_enter(lua_State *L, int fidx)
+{
+	if (nullptr == _R) {
+		return nullptr;
+	}
+
+	lua_Debug ar;
+	lua_pushvalue(L, fidx);
+	if (0 == lua_getinfo(L, ">S", &ar)) {
+		return nullptr;
+	}
+
+	char name[LUA_IDSIZE + 16];
+	int nlen = snprintf(name, sizeof(name), "%s:%d", ar.short_src, ar.linedefined);
+	if (nlen < 0) {
+		return nullptr;
+	}
+	_R->_key.assign(name, (size_t)nlen < sizeof(name) ? (size_t)nlen : sizeof(name) - 1);
+	auto it = _R->_sites.find(_R->_key);
+	if (_R->_sites.end() != it) {
+		return &it->second;
+	}
+
+	auto ins = _R->_sites.insert(std::make_pair(_R->_key, prof_site()));
+	prof_site *site = &ins.first->second;
+	site->_name = ins.first->first.c_str();
+
+	return site;
+}
+
+void
+prof_leave(prof_site *site, uint64_t usec)
+{
+	if (nullptr == site) {
+		return;
+	}
+
+	site->_count += 1;
+	site->_total += usec;
+	if (usec > site->_max) {
+		site->_max = usec;
+	}
+
+	int b = 0;
+	while (usec > 0 && b < PROF_HIST - 1) {
+		usec >>= 1; ++b;
+	}
+	site->_hist[b] += 1;
+}
+
+const char*
+prof_name(prof_site *site)
+{
+	return nullptr != site ? site->_name : "?";
+}
+
+static void
+__prof_hook(lua_State *L, lua_Debug *ar)
+{
+	// the count hook is cheap, a sample is only taken once per period.
+	uint64_t now = util_clock();
+	if (now < _R->_next) {
+		return;
+	}
+	_R->_next = now + _R->_period;
+
+	lua_Debug fr[PROF_DEPTH];
+	int n = 0;
+	while (n < PROF_DEPTH && 0 != lua_getstack(L, n, &fr[n])) {
+		lua_getinfo(L, "Sn", &fr[n]);
+		++n;
+	}
+
+	std::string &s = _R->_stack;
+	s.clear();
+	char name[LUA_IDSIZE + 64];
+	for (int i = n - 1; i >= 0; --i) {
+		lua_Debug &f = fr[i];
+		if ('C' == f.what[0]) {
+			snprintf(name, sizeof(name), "%s", nullptr != f.name ? f.name : "[C]");
+		} else {
+			snprintf(name, sizeof(name), "%s (%s:%d)", nullptr != f.name ? f.name : "?", f.short_src, f.linedefined);
+		}
+		if (!s.empty()) {
+			s.push_back(';');
+		}
+		for (char *c = name; '\0' != *c; ++c) {
+			s.push_back(';' == *c ? ':' : *c);
+		}
+	}
+
+	if (!s.empty()) {
+		_R->_samples[s] += 1;
+	}
+}
+
+static void
+__prof_hook_set(void)
+{
+	if (nullptr != _R->_L) {
+		lua_sethook(_R->_L, __prof_hook, LUA_MASKCOUNT, PROF_COUNT);
+	}
+}
+
+int
+prof_start(uint64_t usec)
+{
+	if (nullptr == _R || 0 != _R->_active) {
+		return 0;
+	}
+
+	_R->_active = 1;
+	_R->_period = usec > 0 ? usec : 1000;
+	_R->_next = 0;
+	_R->_samples.clear();
+	__prof_hook_set();
+
+	LOGI("prof-start\t%u", (unsigned int)_R->_period);
+	return 1;
+}
+
+int
+prof_stop(const char *path, size_t plen)
+{
+	if (nullptr == _R || 0 == _R->_active) {
+		return 0;
+	}
+
+	_R->_active = 0;
+	if (nullptr != _R->_L) {
+		lua_sethook(_R->_L, nullptr, 0, 0);
+	}
+
+	char temp[PATH_SIZE];
+	if (nullptr == path || 0 == plen || plen >= sizeof(temp)) {
+		time_t now = ::time(NULL);
+		plen = strftime(temp, sizeof(temp), "prof/%Y%m%d%H%M%S.folded", localtime(&now));
+	} else {
+		memcpy(temp, path, plen); temp[plen] = '\0';
+	}
+
+	FILE *file = (FILE*)file_open(temp, plen, "wb");
+	if (nullptr == file) {
+		LOGE("prof-stop\t%s", temp);
+		return 0;
+	}
+	for (auto &it : _R->_samples) {
+		fprintf(file, "%s %llu\n", it.first.c_str(), (unsigned long long)it.second);
+	}
+	::fclose(file);
+	_R->_samples.clear();
+
+	LOGI("prof-stop\t%s", temp);
+	return 1;
+}
+
+static int
+__l2c_start(lua_State *L)
+{
+	lua_pushboolean(L, prof_start((uint64_t)luaL_optnumber(L, 1, 1000)));
+	return 1;
+}
+
+static int
+__l2c_stop(lua_State *L)
+{
+	size_t plen = 0;
+	const char *path = luaL_optlstring(L, 1, nullptr, &plen);
+	lua_pushboolean(L, prof_stop(path, plen));
+	return 1;
+}
+
+static int
+__l2c_calls(lua_State *L)
+{
+	lua_createtable(L, 0, (int)_R->_sites.size());
+	for (auto &it : _R->_sites) {
+		prof_site &s = it.second;
+		lua_pushlstring(L, it.first.data(), it.first.size());
+		lua_createtable(L, 0, 4);
+
+		lua_pushnumber(L, (lua_Number)s._count);
+		lua_setfield(L, -2, "count");
+		lua_pushnumber(L, (lua_Number)s._total);
+		lua_setfield(L, -2, "total");
+		lua_pushnumber(L, (lua_Number)s._max);
+		lua_setfield(L, -2, "max");
+
+		lua_createtable(L, PROF_HIST, 0);
+		for (int i = 0; i < PROF_HIST; ++i) {
+			lua_pushnumber(L, (lua_Number)s._hist[i]);
+			lua_rawseti(L, -2, i + 1);
+		}
+		lua_setfield(L, -2, "hist");
+
+		lua_rawset(L, -3);
+	}
+
+	return 1;
+}
+
+static int
+__l2c_reset(lua_State *L)
+{
+	for (auto &it : _R->_sites) {
+		const char *name = it.second._name;
+		it.second = prof_site();
+		it.second._name = name;
+	}
+
+	return 0;
+}
+
+static int
+__luaopen_prof(lua_State *L)
+{
+	luaL_Reg r[] = {
+		{ "calls", __l2c_calls },
+		{ "reset", __l2c_reset },
+		{ "start", __l2c_start },
+		{ "stop", __l2c_stop },
+		{ nullptr, nullptr },
+	};
+	luaL_newlib(L, r);
+	return 1;
+}
+
+void
+prof_init(lua_State *L)
+{
+	if (nullptr == _R) {
+		_R = new prof_data();
+	}
+	_R->_L = L;
+
+	luaL_requiref(L, "cprof", __luaopen_prof, 0);
+}
+
+void
+prof_reload(lua_State *L)
+{
+	if (nullptr == _R) {
+		return;
+	}
+
+	// counters survive by name.
+	_R->_L = L;
+	if (0 != _R->_active) {
+		__prof_hook_set();
+	}
+
+	luaL_requiref(L, "cprof", __luaopen_prof, 0);
+}
+
+void
+prof_fini(lua_State *L)
+{
+	if (nullptr == _R) {
+		return;
+	}
+
+	delete _R; _R = nullptr;
+}
@@ -0,0 +1,38 @@
+#ifndef __PD_PROF__
+#define __PD_PROF__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PROF_HIST 20
+#define PROF_DEPTH 64
+#define PROF_COUNT 1000
+
+struct lua_State;
+struct prof_site;
+
+void
+prof_init(lua_State *L);
+
+prof_site*
+prof_enter(lua_State *L, int fidx);
+
+void
+prof_leave(prof_site *site, uint64_t usec);
+
+const char*
+prof_name(prof_site *site);
+
+int
+prof_start(uint64_t usec);
+
+int
+prof_stop(const char *path, size_t plen);
+
+void
+prof_reload(lua_State *L);
+
+void
+prof_fini(lua_State *L);
+
+#endif // __PD_PROF__
@@ -0,0 +1,65 @@
+#ifndef __PD_QUEUE__
+#define __PD_QUEUE__
+
+#include <stddef.h>
+#include <atomic>
+
+// intrusive lock-free multi-producer single-consumer queue (vyukov),
+// T needs a `std::atomic<T*> _next` member and a default constructor.
+// push is wait-free from any thread, pop must only be called by the one consumer.
+template <typename T>
+struct mpsc_queue
+{
+	std::atomic<T*> _head;
+	T              *_tail;
+	T               _stub;
+
+	mpsc_queue(void) : _head(&_stub), _tail(&_stub)
+	{
+		this->_stub._next.store(nullptr);
+	}
+
+	void
+	push(T *n)
+	{
+		n->_next.store(nullptr, std::memory_order_relaxed);
+		T *prev = this->_head.exchange(n, std::memory_order_acq_rel);
+		prev->_next.store(n, std::memory_order_release);
+	}
+
+	T*
+	pop(void)
+	{
+		T *tail = this->_tail;
+		T *next = tail->_next.load(std::memory_order_acquire);
+		if (&this->_stub == tail) {
+			if (nullptr == next) {
+				return nullptr;
+			}
+			this->_tail = next;
+			tail = next;
+			next = next->_next.load(std::memory_order_acquire);
+		}
+
+		if (nullptr != next) {
+			this->_tail = next;
+			return tail;
+		}
+
+		// a producer is between exchange and link, try again next time.
+		if (tail != this->_head.load(std::memory_order_acquire)) {
+			return nullptr;
+		}
+
+		this->push(&this->_stub);
+		next = tail->_next.load(std::memory_order_acquire);
+		if (nullptr != next) {
+			this->_tail = next;
+			return tail;
+		}
+
+		return nullptr;
+	}
+};
+
+#endif // __PD_QUEUE__
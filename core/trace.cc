@@ -0,0 +1,305 @@
+#include <trace.h>
+#include <util.h>
+#include <file.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <lua/lauxlib.h>
+#include <lua/lua.h>
+#include <lua/lualib.h>
+#ifdef __cplusplus
+} //extern "C"
+#endif //__cplusplus
+
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+
+std::atomic<int> __trace_on(0);
+
+struct trace_event
+{
+	std::atomic<uint64_t> _seq;
+	uint64_t    _ts;
+	const char *_name;
+	const char *_sarg;
+	uint64_t    _iarg;
+	uint32_t    _tid;
+	char        _ph;
+};
+
+struct trace_data
+{
+	// ring of events, writers claim a slot with one fetch_add and publish it through _seq.
+	trace_event          *_ring;
+	size_t                _mask;
+	std::atomic<uint64_t> _pos;
+	std::atomic<uint32_t> _tids;
+
+	// names marked from lua, owned here so events outlive the state that marked them.
+	std::mutex                      _nlock;
+	std::unordered_set<std::string> _names;
+
+	trace_data(void) : _ring(nullptr), _mask(0), _pos(0), _tids(0)
+	{
+	}
+
+	~trace_data(void)
+	{
+		if (nullptr != this->_ring) {
+			delete[] this->_ring;
+		}
+	}
+};
+
+static trace_data *_T = nullptr;
+
+static THREAD_LOCAL uint32_t __trace_tid = 0;
+
+void
+trace_mark(char ph, const char *name, const char *sarg, uint64_t iarg)
+{
+	if (nullptr == _T || nullptr == _T->_ring) {
+		return;
+	}
+
+	if (0 == __trace_tid) {
+		__trace_tid = ++_T->_tids;
+	}
+
+	uint64_t i = _T->_pos.fetch_add(1, std::memory_order_relaxed);
+	trace_event &e = _T->_ring[i & _T->_mask];
+	e._seq.store(~(uint64_t)0, std::memory_order_relaxed);
+	e._ts = util_clock();
+	e._name = name;
+	e._sarg = sarg;
+	e._iarg = iarg;
+	e._tid = __trace_tid;
+	e._ph = ph;
+	e._seq.store(i, std::memory_order_release);
+}
+
+int
+trace_start(size_t size)
+{
+	if (nullptr == _T) {
+		return 0;
+	}
+
+	if (nullptr == _T->_ring) {
+		size_t n = 1;
+		while (n < size) {
+			n <<= 1;
+		}
+		_T->_ring = new trace_event[n];
+		for (size_t i = 0; i < n; ++i) {
+			_T->_ring[i]._seq.store(~(uint64_t)0);
+		}
+		_T->_mask = n - 1;
+	}
+
+	__trace_on.store(1);
+	LOGI("trace-start\t%u", (unsigned int)(_T->_mask + 1));
+	return 1;
+}
+
+int
+trace_stop(void)
+{
+	__trace_on.store(0);
+	return 1;
+}
+
+static void
+__trace_json(FILE *file, const char *s)
+{
+	for (; '\0' != *s; ++s) {
+		unsigned char c = (unsigned char)*s;
+		if ('"' == c || '\\' == c) {
+			fputc('\\', file); fputc(c, file);
+		} else if (c < 0x20) {
+			fprintf(file, "\\u%04x", c);
+		} else {
+			fputc(c, file);
+		}
+	}
+}
+
+int
+trace_dump(const char *path, size_t plen)
+{
+	if (nullptr == _T || nullptr == _T->_ring) {
+		return 0;
+	}
+
+	char temp[PATH_SIZE];
+	if (nullptr == path || 0 == plen || plen >= sizeof(temp)) {
+		time_t now = ::time(NULL);
+		plen = strftime(temp, sizeof(temp), "trace/%Y%m%d%H%M%S.json", localtime(&now));
+	} else {
+		memcpy(temp, path, plen); temp[plen] = '\0';
+	}
+
+	FILE *file = (FILE*)file_open(temp, plen, "wb");
+	if (nullptr == file) {
+		LOGE("trace-dump\t%s", temp);
+		return 0;
+	}
+
+	uint64_t end = _T->_pos.load(std::memory_order_acquire);
+	uint64_t beg = end > _T->_mask + 1 ? end - _T->_mask - 1 : 0;
+
+	fputs("{\"traceEvents\":[", file);
+	const char *sep = "\n";
+	for (uint64_t i = beg; i < end; ++i) {
+		trace_event &e = _T->_ring[i & _T->_mask];
+		if (i != e._seq.load(std::memory_order_acquire)) {
+			continue;
+		}
+
+		fprintf(file, "%s{\"ph\":\"%c\",\"pid\":1,\"tid\":%u,\"ts\":%llu,\"name\":\"", sep, e._ph, e._tid, (unsigned long long)e._ts);
+		__trace_json(file, e._name);
+		if ('C' == e._ph) {
+			fprintf(file, "\",\"args\":{\"value\":%llu}}", (unsigned long long)e._iarg);
+		} else {
+			fprintf(file, "\",%s\"args\":{\"id\":%llu", 'i' == e._ph ? "\"s\":\"t\"," : "", (unsigned long long)e._iarg);
+			if (nullptr != e._sarg) {
+				fputs(",\"at\":\"", file);
+				__trace_json(file, e._sarg);
+				fputc('"', file);
+			}
+			fputs("}}", file);
+		}
+		sep = ",\n";
+	}
+	fputs("\n]}\n", file);
+	::fclose(file);
+
+	LOGI("trace-dump\t%s", temp);
+	return 1;
+}
+
+static int
+__trace_gc(lua_State *L);
+
+// a finalized sentinel marks each completed gc cycle, then re-arms itself.
+static void
+__trace_gc_arm(lua_State *L)
+{
+	lua_newuserdata(L, 1);
+	lua_createtable(L, 0, 1);
+	lua_pushcfunction(L, __trace_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_setmetatable(L, -2);
+	lua_pop(L, 1);
+}
+
+static int
+__trace_gc(lua_State *L)
+{
+	TRACE_MARK("lua-gc", nullptr, 0);
+	__trace_gc_arm(L);
+	return 0;
+}
+
+static int
+__l2c_start(lua_State *L)
+{
+	lua_pushboolean(L, trace_start((size_t)luaL_optnumber(L, 1, TRACE_SIZE)));
+	return 1;
+}
+
+static int
+__l2c_stop(lua_State *L)
+{
+	lua_pushboolean(L, trace_stop());
+	return 1;
+}
+
+static int
+__l2c_dump(lua_State *L)
+{
+	size_t plen = 0;
+	const char *path = luaL_optlstring(L, 1, nullptr, &plen);
+	lua_pushboolean(L, trace_dump(path, plen));
+	return 1;
+}
+
+static int
+__l2c_mark(lua_State *L)
+{
+	// names are interned in _names, the upvalue maps a lua string to its copy so a repeated
+	// name costs one table lookup.
+	lua_settop(L, 1);
+	size_t nlen = 0;
+	const char *name = luaL_checklstring(L, 1, &nlen);
+	lua_pushvalue(L, 1);
+	lua_rawget(L, lua_upvalueindex(1));
+	const char *kept = (const char*)lua_touserdata(L, -1);
+	if (nullptr == kept) {
+		{
+			std::lock_guard<std::mutex> lock(_T->_nlock);
+			kept = _T->_names.insert(std::string(name, nlen)).first->c_str();
+		}
+		lua_pushvalue(L, 1);
+		lua_pushlightuserdata(L, (void*)kept);
+		lua_rawset(L, lua_upvalueindex(1));
+	}
+	TRACE_MARK(kept, nullptr, 0);
+	return 0;
+}
+
+static int
+__luaopen_trace(lua_State *L)
+{
+	luaL_Reg r[] = {
+		{ "start", __l2c_start },
+		{ "stop", __l2c_stop },
+		{ "dump", __l2c_dump },
+		{ "mark", __l2c_mark },
+		{ nullptr, nullptr },
+	};
+	luaL_newlibtable(L, r);
+	lua_newtable(L);
+	luaL_setfuncs(L, r, 1);
+	return 1;
+}
+
+void
+trace_init(lua_State *L)
+{
+	if (nullptr == _T) {
+		_T = new trace_data();
+	}
+	__trace_gc_arm(L);
+
+	luaL_requiref(L, "ctrace", __luaopen_trace, 0);
+}
+
+void
+trace_reload(lua_State *L)
+{
+	if (nullptr == _T) {
+		return;
+	}
+
+	// recording goes on across the reload, no event points into the old state.
+	__trace_gc_arm(L);
+
+	luaL_requiref(L, "ctrace", __luaopen_trace, 0);
+}
+
+void
+trace_fini(lua_State *L)
+{
+	if (nullptr == _T) {
+		return;
+	}
+
+	__trace_on.store(0);
+	delete _T; _T = nullptr;
+}
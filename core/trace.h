@@ -0,0 +1,41 @@
+#ifndef __PD_TRACE__
+#define __PD_TRACE__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+#define TRACE_SIZE (1 << 16)
+
+extern std::atomic<int> __trace_on;
+
+#define TRACE_BEGIN(n, s, i) do { if (__trace_on.load(std::memory_order_relaxed)) trace_mark('B', (n), (s), (uint64_t)(i)); } while (0)
+#define TRACE_END(n, s, i)   do { if (__trace_on.load(std::memory_order_relaxed)) trace_mark('E', (n), (s), (uint64_t)(i)); } while (0)
+#define TRACE_MARK(n, s, i)  do { if (__trace_on.load(std::memory_order_relaxed)) trace_mark('i', (n), (s), (uint64_t)(i)); } while (0)
+#define TRACE_COUNT(n, i)    do { if (__trace_on.load(std::memory_order_relaxed)) trace_mark('C', (n), nullptr, (uint64_t)(i)); } while (0)
+
+struct lua_State;
+
+void
+trace_init(lua_State *L);
+
+// name and sarg must outlive the trace, they are stored as pointers.
+void
+trace_mark(char ph, const char *name, const char *sarg, uint64_t iarg);
+
+int
+trace_start(size_t size);
+
+int
+trace_stop(void);
+
+int
+trace_dump(const char *path, size_t plen);
+
+void
+trace_reload(lua_State *L);
+
+void
+trace_fini(lua_State *L);
+
+#endif // __PD_TRACE__
@@ -1,4 +1,7 @@
 #include <util.h>
+#include <file.h>
+#include <loop.h>
+#include <pool.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -13,8 +16,37 @@ extern "C" {
 
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
 #include <stdint.h>
 #include <ctype.h>
+#include <stdio.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#include <windows.h>
+#include <intrin.h>
+#else //_WIN32
+#include <time.h>
+#endif //_WIN32
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define UTIL_CRC32C_SSE42
+#if defined(_MSC_VER)
+#define UTIL_SSE42
+#else
+#define UTIL_SSE42 __attribute__((target("sse4.2")))
+#endif
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define UTIL_CRC32C_ARM
+#endif
+
+#define UTIL_READ  (1 << 20) // bytes md5_file reads at once when a file cannot be mapped
+#define UTIL_BATCH 256       // hash_files results per callback
 
 #define F(x, y, z)  ((z) ^ ((x) & ((y) ^ (z))))
 #define G(x, y, z)  ((y) ^ ((z) & ((x) ^ (y))))
@@ -29,12 +61,6 @@ extern "C" {
 #define SET(n)      (*(uint32_t *) &p[n * 4])
 #define GET(n)      (*(uint32_t *) &p[n * 4])
 
-typedef struct {
-	uint64_t  bytes;
-	uint32_t  a, b, c, d;
-	uint8_t   buffer[64];
-} util_md5_t;
-
 static const uint8_t *
 __util_md5_body(util_md5_t *ctx, const uint8_t *data, size_t size)
 {
@@ -240,18 +266,313 @@ __util_md5_final(uint8_t result[16], util_md5_t *ctx)
 	memset(ctx, 0, sizeof(*ctx));
 }
 
-static inline void 
-__util_bin2hex(const uint8_t *bin, int len, char *hex)
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t
+__util_rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+__util_read64(const uint8_t *p)
 {
-	static const char *hex_map = "0123456789abcdef";
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
 
-	const uint8_t *end = bin + len;
-	while (bin < end)
-	{
-		unsigned char c = *bin++;
-		*hex++ = hex_map[(c & 0xf0) >> 4];
-		*hex++ = hex_map[c & 0x0f];
+static inline uint32_t
+__util_read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t
+__util_xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH_P2;
+	acc = __util_rotl64(acc, 31);
+	return acc * XXH_P1;
+}
+
+static inline uint64_t
+__util_xxh64_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= __util_xxh64_round(0, val);
+	return acc * XXH_P1 + XXH_P4;
+}
+
+static inline void
+__util_xxh64_init(util_xxh64_t *ctx)
+{
+	ctx->total = 0;
+	ctx->v[0] = XXH_P1 + XXH_P2;
+	ctx->v[1] = XXH_P2;
+	ctx->v[2] = 0;
+	ctx->v[3] = 0 - XXH_P1;
+}
+
+static inline void
+__util_xxh64_update(util_xxh64_t *ctx, const uint8_t *data, size_t size)
+{
+	size_t used = (size_t)(ctx->total & 31);
+	ctx->total += size;
+
+	if (used) {
+		size_t free = 32 - used;
+		if (size < free) {
+			memcpy(ctx->buffer + used, data, size);
+			return;
+		}
+		memcpy(ctx->buffer + used, data, free);
+		data += free; size -= free;
+		for (int i = 0; i < 4; ++i) {
+			ctx->v[i] = __util_xxh64_round(ctx->v[i], __util_read64(ctx->buffer + i * 8));
+		}
 	}
+
+	// four independent lanes, the loop keeps them in registers.
+	uint64_t v1 = ctx->v[0], v2 = ctx->v[1], v3 = ctx->v[2], v4 = ctx->v[3];
+	for (; size >= 32; data += 32, size -= 32) {
+		v1 = __util_xxh64_round(v1, __util_read64(data));
+		v2 = __util_xxh64_round(v2, __util_read64(data + 8));
+		v3 = __util_xxh64_round(v3, __util_read64(data + 16));
+		v4 = __util_xxh64_round(v4, __util_read64(data + 24));
+	}
+	ctx->v[0] = v1; ctx->v[1] = v2; ctx->v[2] = v3; ctx->v[3] = v4;
+
+	memcpy(ctx->buffer, data, size);
+}
+
+static inline uint64_t
+__util_xxh64_final(util_xxh64_t *ctx)
+{
+	uint64_t h = 0;
+	if (ctx->total >= 32) {
+		h = __util_rotl64(ctx->v[0], 1) + __util_rotl64(ctx->v[1], 7) + __util_rotl64(ctx->v[2], 12) + __util_rotl64(ctx->v[3], 18);
+		for (int i = 0; i < 4; ++i) {
+			h = __util_xxh64_merge(h, ctx->v[i]);
+		}
+	} else {
+		h = ctx->v[2] + XXH_P5;
+	}
+	h += ctx->total;
+
+	const uint8_t *p = ctx->buffer, *e = ctx->buffer + (size_t)(ctx->total & 31);
+	for (; p + 8 <= e; p += 8) {
+		h ^= __util_xxh64_round(0, __util_read64(p));
+		h = __util_rotl64(h, 27) * XXH_P1 + XXH_P4;
+	}
+	if (p + 4 <= e) {
+		h ^= (uint64_t)__util_read32(p) * XXH_P1;
+		h = __util_rotl64(h, 23) * XXH_P2 + XXH_P3;
+		p += 4;
+	}
+	for (; p < e; ++p) {
+		h ^= (*p) * XXH_P5;
+		h = __util_rotl64(h, 11) * XXH_P1;
+	}
+
+	h ^= h >> 33; h *= XXH_P2;
+	h ^= h >> 29; h *= XXH_P3;
+	h ^= h >> 32;
+	return h;
+}
+
+// crc32c, castagnoli polynomial. slicing by 8 in software, the crc32 instructions where
+// the cpu has them.
+static uint32_t __util_crc32c[8][256];
+static int      __util_crc32c_hw = 0;
+
+static void
+__util_crc32c_init(void)
+{
+	for (uint32_t i = 0; i < 256; ++i) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; ++k) {
+			c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+		}
+		__util_crc32c[0][i] = c;
+	}
+	for (uint32_t i = 0; i < 256; ++i) {
+		for (int t = 1; t < 8; ++t) {
+			uint32_t c = __util_crc32c[t - 1][i];
+			__util_crc32c[t][i] = (c >> 8) ^ __util_crc32c[0][c & 0xff];
+		}
+	}
+
+#if defined(UTIL_CRC32C_SSE42)
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	__util_crc32c_hw = 0 != (info[2] & (1 << 20));
+#else
+	__util_crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+#elif defined(UTIL_CRC32C_ARM)
+	__util_crc32c_hw = 1;
+#endif
+}
+
+static uint32_t
+__util_crc32c_sw(uint32_t crc, const uint8_t *p, size_t size)
+{
+	for (; size > 0 && 0 != ((uintptr_t)p & 7); --size) {
+		crc = (crc >> 8) ^ __util_crc32c[0][(crc ^ *p++) & 0xff];
+	}
+	for (; size >= 8; size -= 8, p += 8) {
+		uint32_t lo = __util_read32(p) ^ crc, hi = __util_read32(p + 4);
+		crc = __util_crc32c[7][lo & 0xff] ^ __util_crc32c[6][(lo >> 8) & 0xff]
+			^ __util_crc32c[5][(lo >> 16) & 0xff] ^ __util_crc32c[4][lo >> 24]
+			^ __util_crc32c[3][hi & 0xff] ^ __util_crc32c[2][(hi >> 8) & 0xff]
+			^ __util_crc32c[1][(hi >> 16) & 0xff] ^ __util_crc32c[0][hi >> 24];
+	}
+	while (size-- > 0) {
+		crc = (crc >> 8) ^ __util_crc32c[0][(crc ^ *p++) & 0xff];
+	}
+	return crc;
+}
+
+#if defined(UTIL_CRC32C_SSE42)
+static UTIL_SSE42 uint32_t
+__util_crc32c_hw_update(uint32_t crc, const uint8_t *p, size_t size)
+{
+	for (; size > 0 && 0 != ((uintptr_t)p & 7); --size) {
+		crc = _mm_crc32_u8(crc, *p++);
+	}
+#if defined(_M_X64) || defined(__x86_64__)
+	uint64_t c = crc;
+	for (; size >= 8; size -= 8, p += 8) {
+		c = _mm_crc32_u64(c, __util_read64(p));
+	}
+	crc = (uint32_t)c;
+#endif
+	for (; size >= 4; size -= 4, p += 4) {
+		crc = _mm_crc32_u32(crc, __util_read32(p));
+	}
+	while (size-- > 0) {
+		crc = _mm_crc32_u8(crc, *p++);
+	}
+	return crc;
+}
+#elif defined(UTIL_CRC32C_ARM)
+static uint32_t
+__util_crc32c_hw_update(uint32_t crc, const uint8_t *p, size_t size)
+{
+	for (; size >= 8; size -= 8, p += 8) {
+		crc = __crc32cd(crc, __util_read64(p));
+	}
+	while (size-- > 0) {
+		crc = __crc32cb(crc, *p++);
+	}
+	return crc;
+}
+#endif
+
+static inline uint32_t
+__util_crc32c_update(uint32_t crc, const uint8_t *p, size_t size)
+{
+#if defined(UTIL_CRC32C_SSE42) || defined(UTIL_CRC32C_ARM)
+	if (__util_crc32c_hw) {
+		return __util_crc32c_hw_update(crc, p, size);
+	}
+#endif
+	return __util_crc32c_sw(crc, p, size);
+}
+
+int
+util_hash_kind(const char *name, size_t nlen)
+{
+	static const char *kinds[] = { "md5", "xxh64", "crc32c" };
+	for (int i = 0; i < (int)(sizeof(kinds) / sizeof(kinds[0])); ++i) {
+		if (strlen(kinds[i]) == nlen && 0 == memcmp(kinds[i], name, nlen)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+void
+util_hash_init(util_hash *h, int kind)
+{
+	h->_kind = kind;
+	switch (kind) {
+	case UTIL_MD5: __util_md5_init(&h->_md5); break;
+	case UTIL_XXH64: __util_xxh64_init(&h->_xxh); break;
+	case UTIL_CRC32C: h->_crc = 0xFFFFFFFF; break;
+	}
+}
+
+void
+util_hash_update(util_hash *h, const void *data, size_t dlen)
+{
+	switch (h->_kind) {
+	case UTIL_MD5: __util_md5_update(&h->_md5, (const uint8_t*)data, dlen); break;
+	case UTIL_XXH64: __util_xxh64_update(&h->_xxh, (const uint8_t*)data, dlen); break;
+	case UTIL_CRC32C: h->_crc = __util_crc32c_update(h->_crc, (const uint8_t*)data, dlen); break;
+	}
+}
+
+size_t
+util_hash_final(util_hash *h, uint8_t *out)
+{
+	switch (h->_kind) {
+	case UTIL_MD5:
+		__util_md5_final(out, &h->_md5);
+		return 16;
+	case UTIL_XXH64: {
+		uint64_t v = __util_xxh64_final(&h->_xxh);
+		for (int i = 7; i >= 0; --i, v >>= 8) out[i] = (uint8_t)v;
+		return 8;
+	}
+	case UTIL_CRC32C: {
+		uint32_t v = ~h->_crc;
+		for (int i = 3; i >= 0; --i, v >>= 8) out[i] = (uint8_t)v;
+		return 4;
+	}
+	}
+	return 0;
+}
+
+int
+util_hash_file(const char *path, int kind, uint8_t *out, size_t *olen)
+{
+	util_hash h;
+	util_hash_init(&h, kind);
+
+	size_t size = 0;
+	void *data = file_map(path, &size);
+	if (nullptr != data) {
+		util_hash_update(&h, data, size);
+		file_unmap(data, size);
+		*olen = util_hash_final(&h, out);
+		return 1;
+	}
+
+	// empty files do not map, nor does everything on every platform.
+	FILE *file = ::fopen(path, "rb");
+	if (nullptr == file) {
+		return 0;
+	}
+	std::unique_ptr<uint8_t[]> temp(new uint8_t[UTIL_READ]);
+	size_t n = 0;
+	while ((n = ::fread(temp.get(), 1, UTIL_READ, file)) > 0) {
+		util_hash_update(&h, temp.get(), n);
+	}
+	int ok = !::ferror(file);
+	::fclose(file);
+
+	if (ok) {
+		*olen = util_hash_final(&h, out);
+	}
+	return ok;
 }
 
 static int
@@ -272,7 +593,7 @@ __util_md5data(lua_State *L)
 	__util_md5_final(bin, &ctx);
 
 	char hex[33];
-	__util_bin2hex(bin, sizeof(bin), hex);
+	util_hex(bin, sizeof(bin), hex);
 	lua_pushlstring(L, hex, sizeof(hex) - 1);
 
 	return 1;
@@ -281,130 +602,642 @@ __util_md5data(lua_State *L)
 static int
 __util_md5file(lua_State *L)
 {
-	int ret = 0;
-	FILE* file = nullptr;
+	size_t plen = 0;
+	const char *path = luaL_checklstring(L, -1, &plen);
+	if (nullptr == path || 0 == plen) {
+		return 0;
+	}
 
-	do {
-		size_t plen = 0;
-		const char *path = luaL_checklstring(L, -1, &plen);
-		if (nullptr == path || 0 == plen) {
-			break;
+	uint8_t bin[UTIL_DIGEST];
+	size_t blen = 0;
+	if (!util_hash_file(path, UTIL_MD5, bin, &blen)) {
+		return 0;
+	}
+
+	char hex[UTIL_DIGEST * 2];
+	util_hex(bin, blen, hex);
+	lua_pushlstring(L, hex, blen * 2);
+
+	return 1;
+}
+
+static int
+__util_kind(lua_State *L, int idx)
+{
+	size_t nlen = 0;
+	const char *name = luaL_optlstring(L, idx, "md5", &nlen);
+	int kind = util_hash_kind(name, nlen);
+	if (kind < 0) {
+		return luaL_argerror(L, idx, "unknown hash, md5, xxh64 or crc32c");
+	}
+	return kind;
+}
+
+// digests go to lua as lowercase hex, or the raw bytes when raw is set.
+static void
+__util_pushdigest(lua_State *L, const uint8_t *bin, size_t blen, int raw)
+{
+	if (raw) {
+		lua_pushlstring(L, (const char*)bin, blen);
+	} else {
+		char hex[UTIL_DIGEST * 2];
+		util_hex(bin, blen, hex);
+		lua_pushlstring(L, hex, blen * 2);
+	}
+}
+
+static int
+__util_hashdata(lua_State *L)
+{
+	size_t dlen = 0;
+	const char *data = luaL_checklstring(L, 1, &dlen);
+	util_hash h;
+	util_hash_init(&h, __util_kind(L, 2));
+	util_hash_update(&h, data, dlen);
+
+	uint8_t bin[UTIL_DIGEST];
+	size_t blen = util_hash_final(&h, bin);
+	__util_pushdigest(L, bin, blen, lua_toboolean(L, 3));
+	return 1;
+}
+
+static int
+__util_hashfile(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	uint8_t bin[UTIL_DIGEST];
+	size_t blen = 0;
+	if (!util_hash_file(path, __util_kind(L, 2), bin, &blen)) {
+		return 0;
+	}
+	__util_pushdigest(L, bin, blen, lua_toboolean(L, 3));
+	return 1;
+}
+
+struct hash_item
+{
+	std::string _path;
+	std::string _expect; // lowercase hex, empty when nothing is expected
+	std::string _digest; // hex, empty when the file could not be read
+};
+
+typedef std::vector<hash_item> hash_items;
+
+// one hash_files call, workers take the next file off _next until the list is done,
+// results are handed to lua in batches and the last worker to stop posts the final one.
+struct hash_data
+{
+	int                 _kind;
+	std::string         _root;
+	hash_items          _files;
+	std::atomic<size_t> _next;
+	size_t              _batch;
+
+	std::mutex          _lock;
+	std::vector<size_t> _done;
+	size_t              _bad;
+	int                 _running;
+	int                 _lfun;
+
+	hash_data(void) : _kind(UTIL_MD5), _next(0), _batch(UTIL_BATCH), _bad(0), _running(0), _lfun(LUA_NOREF)
+	{
+	}
+};
+
+typedef std::shared_ptr<hash_data> hash_ptr;
+
+// results map each path to its digest, or false when it could not be read. where digests were
+// expected a match is true instead, and the final call adds the count and how many were bad.
+static void
+__hash_flush(hash_ptr hd, bool last)
+{
+	std::shared_ptr<std::vector<size_t>> batch(new std::vector<size_t>());
+	batch->swap(hd->_done);
+	size_t total = hd->_files.size(), bad = hd->_bad;
+	pool_post([hd, batch, last, total, bad](lua_State *L) {
+		if (LUA_NOREF == hd->_lfun) {
+			return;
 		}
+		lua_rawgeti(L, LUA_REGISTRYINDEX, hd->_lfun);
+		if (last) {
+			luaL_unref(L, LUA_REGISTRYINDEX, hd->_lfun);
+			hd->_lfun = LUA_NOREF;
+		}
+		lua_createtable(L, 0, (int)batch->size());
+		for (auto i : *batch) {
+			const hash_item &it = hd->_files[i];
+			lua_pushlstring(L, it._path.data(), it._path.size());
+			if (it._digest.empty()) {
+				lua_pushboolean(L, 0);
+			} else if (!it._expect.empty() && it._expect == it._digest) {
+				lua_pushboolean(L, 1);
+			} else {
+				lua_pushlstring(L, it._digest.data(), it._digest.size());
+			}
+			lua_rawset(L, -3);
+		}
+		lua_pushboolean(L, last ? 1 : 0);
+		if (last) {
+			lua_pushnumber(L, (lua_Number)total);
+			lua_pushnumber(L, (lua_Number)bad);
+		}
+		loop_call(L, last ? 4 : 2, 0);
+	});
+}
 
-		file = ::fopen(path, "rb");
-		if (nullptr == file) {
-			break;
+static void
+__hash_task(hash_ptr hd)
+{
+	std::string path;
+	size_t i = 0;
+	while ((i = hd->_next++) < hd->_files.size()) {
+		hash_item &it = hd->_files[i];
+		path.assign(hd->_root).append(it._path);
+
+		uint8_t bin[UTIL_DIGEST];
+		size_t blen = 0;
+		if (util_hash_file(path.c_str(), hd->_kind, bin, &blen)) {
+			it._digest.resize(blen * 2);
+			util_hex(bin, blen, &it._digest[0]);
 		}
 
-		util_md5_t ctx;
-		__util_md5_init(&ctx);
+		std::lock_guard<std::mutex> lock(hd->_lock);
+		if (it._digest.empty() || (!it._expect.empty() && it._expect != it._digest)) {
+			++hd->_bad;
+		}
+		hd->_done.push_back(i);
+		if (hd->_done.size() >= hd->_batch) {
+			__hash_flush(hd, false);
+		}
+	}
 
-		uint8_t temp[2048];
-		size_t size = 0;
-		do {
-			size = ::fread(temp, 1, sizeof(temp), file);
-			if (size <= sizeof(temp)) {
-				__util_md5_update(&ctx, temp, size);
-			}
-		} while (sizeof(temp) == size);
+	// posted under the lock, so no batch of another worker can come after the last one.
+	std::lock_guard<std::mutex> lock(hd->_lock);
+	if (0 == --hd->_running) {
+		__hash_flush(hd, true);
+	}
+}
 
-		uint8_t bin[16];
-		__util_md5_final(bin, &ctx);
+// cutil.hash_files(files[, opts], fn), files is a list of paths, or a table of path to the
+// expected hex digest. opts: kind (md5), root prepended to every path, threads (the pool),
+// batch (256). files are mapped and hashed on the pool, fn(results, last) gets them as they
+// finish and fn(results, true, count, bad) at the end, bad counting unreadable and mismatched.
+static int
+__util_hashfiles(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	int fidx = lua_istable(L, 2) ? 3 : 2;
+	luaL_checktype(L, fidx, LUA_TFUNCTION);
+
+	hash_ptr hd(new hash_data());
+	int threads = (int)pool_size();
+	if (3 == fidx) {
+		lua_getfield(L, 2, "kind");
+		hd->_kind = __util_kind(L, lua_gettop(L));
+		lua_getfield(L, 2, "root");
+		size_t rlen = 0;
+		const char *root = lua_tolstring(L, -1, &rlen);
+		if (nullptr != root) {
+			hd->_root.assign(root, rlen);
+		}
+		lua_getfield(L, 2, "threads");
+		if (lua_isnumber(L, -1) && lua_tointeger(L, -1) > 0) {
+			threads = std::min(threads, (int)lua_tointeger(L, -1));
+		}
+		lua_getfield(L, 2, "batch");
+		if (lua_isnumber(L, -1) && lua_tointeger(L, -1) > 0) {
+			hd->_batch = (size_t)lua_tointeger(L, -1);
+		}
+		lua_pop(L, 4);
+	}
+	if (threads < 1) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "no pool");
+		return 2;
+	}
 
-		char hex[33];
-		__util_bin2hex(bin, sizeof(bin), hex);
-		lua_pushlstring(L, hex, sizeof(hex) - 1);
-		ret = 1;
+	lua_pushnil(L);
+	while (lua_next(L, 1)) {
+		hash_item it;
+		size_t plen = 0, elen = 0;
+		const char *path = nullptr;
+		if (LUA_TNUMBER == lua_type(L, -2)) {
+			path = lua_tolstring(L, -1, &plen);
+		} else if (LUA_TSTRING == lua_type(L, -2)) {
+			path = lua_tolstring(L, -2, &plen);
+			const char *expect = lua_tolstring(L, -1, &elen);
+			if (nullptr != expect) {
+				it._expect.assign(expect, elen);
+				for (auto &c : it._expect) c = (char)tolower((unsigned char)c);
+			}
+		}
+		if (nullptr != path) {
+			it._path.assign(path, plen);
+			hd->_files.push_back(std::move(it));
+		}
+		lua_pop(L, 1);
+	}
 
-	} while (false);
+	lua_pushvalue(L, fidx);
+	hd->_lfun = luaL_ref(L, LUA_REGISTRYINDEX);
 
-	if (nullptr != file) {
-		fclose(file);
+	threads = (int)std::max((size_t)1, std::min((size_t)threads, hd->_files.size()));
+	hd->_running = threads;
+	for (int i = 0; i < threads; ++i) {
+		pool_push([hd](int) { __hash_task(hd); }, pool_done());
 	}
 
-	return ret;
+	lua_pushnumber(L, (lua_Number)hd->_files.size());
+	return 1;
 }
 
-static unsigned char HEX_CHARS[] = "0123456789ABCDEF";
+static const char *__HASH_METATABLE = "__HASH_METATABLE__";
 
-static inline int 
-__util_htoi(char *s)
+static int
+__util_hasher(lua_State *L)
 {
-	int value;
-	int c;
+	int kind = __util_kind(L, 1);
+	util_hash *h = (util_hash*)lua_newuserdata(L, sizeof(util_hash));
+	util_hash_init(h, kind);
+	luaL_getmetatable(L, __HASH_METATABLE);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+// h:update(data, ...) takes any number of strings and returns h.
+static int
+__util_hash_update(lua_State *L)
+{
+	util_hash *h = (util_hash*)luaL_checkudata(L, 1, __HASH_METATABLE);
+	for (int i = 2, n = lua_gettop(L); i <= n; ++i) {
+		size_t dlen = 0;
+		const char *data = luaL_checklstring(L, i, &dlen);
+		util_hash_update(h, data, dlen);
+	}
+	lua_settop(L, 1);
+	return 1;
+}
 
-	c = ((unsigned char *)s)[0];
-	if (isupper(c))
-		c = tolower(c);
-	value = (c >= '0' && c <= '9' ? c - '0' : c - 'a' + 10) * 16;
+// h:final([raw]) gives the digest and starts h over.
+static int
+__util_hash_final(lua_State *L)
+{
+	util_hash *h = (util_hash*)luaL_checkudata(L, 1, __HASH_METATABLE);
+	uint8_t bin[UTIL_DIGEST];
+	size_t blen = util_hash_final(h, bin);
+	util_hash_init(h, h->_kind);
+	__util_pushdigest(L, bin, blen, lua_toboolean(L, 2));
+	return 1;
+}
 
-	c = ((unsigned char *)s)[1];
-	if (isupper(c))
-		c = tolower(c);
-	value += c >= '0' && c <= '9' ? c - '0' : c - 'a' + 10;
+static int
+__util_hash_reset(lua_State *L)
+{
+	util_hash *h = (util_hash*)luaL_checkudata(L, 1, __HASH_METATABLE);
+	util_hash_init(h, h->_kind);
+	lua_settop(L, 1);
+	return 1;
+}
 
-	return (value);
+uint64_t
+util_clock(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq = { 0 };
+	if (0 == freq.QuadPart) {
+		::QueryPerformanceFrequency(&freq);
+	}
+	LARGE_INTEGER now;
+	::QueryPerformanceCounter(&now);
+	return (uint64_t)(now.QuadPart / freq.QuadPart * 1000000 + now.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart);
+#else //_WIN32
+	struct timespec ts;
+	::clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+#endif //_WIN32
 }
 
-char* 
-util_url_encode(const char *src, size_t slen, size_t *dlen)
+// lookup tables for the codecs, filled once by util_init.
+enum {
+	_URL_KEEP = 0,
+	_URL_ESCAPE,
+	_URL_SPACE,
+};
+
+static uint8_t  __util_url_form[256];  // form encoding, alnum - . _ kept, space as '+'
+static uint8_t  __util_url_raw[256];   // rfc 3986, alnum - . _ ~ kept, space as %20
+static uint8_t  __util_unhex[256];     // 0xff where the char is no hex digit
+static uint16_t __util_hexpair[256];   // both lowercase hex digits of a byte, in memory order
+static uint8_t  __util_unb64[2][256];  // 0xff where the char is not in the alphabet
+
+static std::once_flag __util_tables;
+
+static const char *__UTIL_HEX = "0123456789ABCDEF";
+static const char *__UTIL_B64[2] = {
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/",
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_",
+};
+
+static void
+__util_codec_init(void)
 {
-	unsigned char *beg = (unsigned char*)::calloc(1, 3 * slen + 1);
-	unsigned char *end = (unsigned char*)src + slen;
-	unsigned char *fr = (unsigned char*)src;
-	unsigned char *to = beg;
+	for (int c = 0; c < 256; ++c) {
+		bool alnum = (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+		bool mark = '-' == c || '.' == c || '_' == c;
+		__util_url_form[c] = ' ' == c ? _URL_SPACE : (alnum || mark) ? _URL_KEEP : _URL_ESCAPE;
+		__util_url_raw[c] = (alnum || mark || '~' == c) ? _URL_KEEP : _URL_ESCAPE;
 
-	unsigned char c = 0;
+		__util_unhex[c] = c >= '0' && c <= '9' ? (uint8_t)(c - '0')
+			: c >= 'a' && c <= 'f' ? (uint8_t)(c - 'a' + 10)
+			: c >= 'A' && c <= 'F' ? (uint8_t)(c - 'A' + 10) : 0xff;
 
-	while (fr < end) {
-		c = *fr++;
+		char pair[2] = { "0123456789abcdef"[c >> 4], "0123456789abcdef"[c & 15] };
+		memcpy(&__util_hexpair[c], pair, 2);
 
-		if (' ' == c) {
-			*to++ = '+';
-		} else if ((c < '0' && c != '-' && c != '.') || (c < 'A' && c > '9') || (c > 'Z' && c < 'a' && c != '_') || (c > 'z')) {
-			to[0] = '%';
-			to[1] = HEX_CHARS[c >> 4];
-			to[2] = HEX_CHARS[c & 15];
-			to += 3;
-		} else {
-			*to++ = c;
+		__util_unb64[0][c] = __util_unb64[1][c] = 0xff;
+	}
+	for (int v = 0; v < 64; ++v) {
+		__util_unb64[0][(uint8_t)__UTIL_B64[0][v]] = (uint8_t)v;
+		__util_unb64[1][(uint8_t)__UTIL_B64[1][v]] = (uint8_t)v;
+	}
+}
+
+void
+util_hex(const uint8_t *bin, size_t blen, char *hex)
+{
+	for (size_t i = 0; i < blen; ++i, hex += 2) {
+		memcpy(hex, &__util_hexpair[bin[i]], 2);
+	}
+}
+
+size_t
+util_unhex(const char *hex, size_t hlen, uint8_t *bin)
+{
+	if (0 != (hlen & 1)) {
+		return UTIL_ERROR;
+	}
+	const uint8_t *p = (const uint8_t*)hex;
+	for (size_t i = 0; i < hlen / 2; ++i, p += 2) {
+		uint8_t hi = __util_unhex[p[0]], lo = __util_unhex[p[1]];
+		if (0xff == (hi | lo)) {
+			return UTIL_ERROR;
+		}
+		bin[i] = (uint8_t)(hi << 4 | lo);
+	}
+	return hlen / 2;
+}
+
+// runs of kept bytes are found through the table and copied in one go,
+// only the bytes between them are looked at one by one.
+size_t
+util_url_encode(const char *src, size_t slen, char *dst, int raw)
+{
+	const uint8_t *table = raw ? __util_url_raw : __util_url_form;
+	const uint8_t *p = (const uint8_t*)src, *e = p + slen;
+	char *to = dst;
+
+	while (p < e) {
+		const uint8_t *q = p;
+		while (q < e && _URL_KEEP == table[*q]) {
+			++q;
+		}
+		if (q > p) {
+			memcpy(to, p, q - p); to += q - p;
+			p = q;
+		}
+		for (; p < e && _URL_KEEP != table[*p]; ++p) {
+			if (_URL_SPACE == table[*p]) {
+				*to++ = '+';
+			} else {
+				to[0] = '%';
+				to[1] = __UTIL_HEX[*p >> 4];
+				to[2] = __UTIL_HEX[*p & 15];
+				to += 3;
+			}
 		}
 	}
-	*to = 0;
 
-	*dlen = to - beg;
-	return (char *)beg;
+	return to - dst;
 }
 
 size_t
 util_url_decode(char *src, size_t slen)
 {
-	char *dst = src;
-	char *tmp = src;
+	char *dst = src, *p = src, *e = src + slen;
+
+	while (p < e) {
+		char *q = p;
+		while (q < e && '%' != *q && '+' != *q) {
+			++q;
+		}
+		if (q > p) {
+			if (dst != p) {
+				memmove(dst, p, q - p);
+			}
+			dst += q - p;
+			p = q;
+		}
+		if (p >= e) {
+			break;
+		}
 
-	while (slen--) {
-		if ('+' == *tmp) {
-			*dst = ' ';
-		} else if (*tmp == '%' && slen >= 2 && isxdigit((int)*(tmp + 1)) && isxdigit((int)*(tmp + 2))) {
-			*dst = (char)__util_htoi(tmp + 1);
-			tmp += 2;
-			slen -= 2;
+		if ('+' == *p) {
+			*dst++ = ' ';
+			++p;
+		} else if (e - p >= 3 && 0xff != (__util_unhex[(uint8_t)p[1]] | __util_unhex[(uint8_t)p[2]])) {
+			*dst++ = (char)(__util_unhex[(uint8_t)p[1]] << 4 | __util_unhex[(uint8_t)p[2]]);
+			p += 3;
 		} else {
-			*dst = *tmp;
+			*dst++ = *p++;
 		}
-		tmp++;
-		dst++;
 	}
 
 	return dst - src;
 }
 
+size_t
+util_base64_encode(const uint8_t *src, size_t slen, char *dst, int url)
+{
+	const char *table = __UTIL_B64[url ? 1 : 0];
+	char *to = dst;
+
+	size_t i = 0;
+	for (; i + 3 <= slen; i += 3, to += 4) {
+		uint32_t v = (uint32_t)src[i] << 16 | (uint32_t)src[i + 1] << 8 | src[i + 2];
+		to[0] = table[v >> 18];
+		to[1] = table[(v >> 12) & 63];
+		to[2] = table[(v >> 6) & 63];
+		to[3] = table[v & 63];
+	}
+	if (i < slen) {
+		uint32_t v = (uint32_t)src[i] << 16 | (i + 1 < slen ? (uint32_t)src[i + 1] << 8 : 0);
+		*to++ = table[v >> 18];
+		*to++ = table[(v >> 12) & 63];
+		if (i + 1 < slen) {
+			*to++ = table[(v >> 6) & 63];
+		}
+		// the url alphabet goes without padding, the way tokens use it.
+		if (!url) {
+			if (i + 1 >= slen) {
+				*to++ = '=';
+			}
+			*to++ = '=';
+		}
+	}
+
+	return to - dst;
+}
+
+size_t
+util_base64_decode(const char *src, size_t slen, uint8_t *dst, int url)
+{
+	const uint8_t *table = __util_unb64[url ? 1 : 0];
+	const uint8_t *p = (const uint8_t*)src;
+
+	// padding is optional, but when it is there it has to be right.
+	size_t pads = 0;
+	while (slen > 0 && '=' == p[slen - 1] && pads < 2) {
+		--slen; ++pads;
+	}
+	if ((pads > 0 && 0 != ((slen + pads) & 3)) || 1 == (slen & 3)) {
+		return UTIL_ERROR;
+	}
+
+	uint8_t *to = dst;
+	size_t i = 0;
+	for (; i + 4 <= slen; i += 4, to += 3) {
+		uint8_t a = table[p[i]], b = table[p[i + 1]], c = table[p[i + 2]], d = table[p[i + 3]];
+		if (0xff == (a | b | c | d)) {
+			return UTIL_ERROR;
+		}
+		uint32_t v = (uint32_t)a << 18 | (uint32_t)b << 12 | (uint32_t)c << 6 | d;
+		to[0] = (uint8_t)(v >> 16);
+		to[1] = (uint8_t)(v >> 8);
+		to[2] = (uint8_t)v;
+	}
+	if (i < slen) {
+		uint8_t a = table[p[i]], b = table[p[i + 1]], c = i + 2 < slen ? table[p[i + 2]] : 0;
+		if (0xff == (a | b | c)) {
+			return UTIL_ERROR;
+		}
+		uint32_t v = (uint32_t)a << 18 | (uint32_t)b << 12 | (uint32_t)c << 6;
+		*to++ = (uint8_t)(v >> 16);
+		if (i + 2 < slen) {
+			*to++ = (uint8_t)(v >> 8);
+		}
+	}
+
+	return to - dst;
+}
+
+// the codecs write straight into the lua buffer, the result is built without another copy.
+static int
+__util_urlencode(lua_State *L)
+{
+	size_t slen = 0;
+	const char *src = luaL_checklstring(L, 1, &slen);
+	luaL_Buffer b;
+	char *dst = luaL_buffinitsize(L, &b, slen * 3);
+	luaL_pushresultsize(&b, util_url_encode(src, slen, dst, lua_toboolean(L, 2)));
+	return 1;
+}
+
+static int
+__util_urldecode(lua_State *L)
+{
+	size_t slen = 0;
+	const char *src = luaL_checklstring(L, 1, &slen);
+	luaL_Buffer b;
+	char *dst = luaL_buffinitsize(L, &b, slen);
+	memcpy(dst, src, slen);
+	luaL_pushresultsize(&b, util_url_decode(dst, slen));
+	return 1;
+}
+
+static int
+__util_hexencode(lua_State *L)
+{
+	size_t slen = 0;
+	const char *src = luaL_checklstring(L, 1, &slen);
+	luaL_Buffer b;
+	char *dst = luaL_buffinitsize(L, &b, slen * 2);
+	util_hex((const uint8_t*)src, slen, dst);
+	luaL_pushresultsize(&b, slen * 2);
+	return 1;
+}
+
+static int
+__util_hexdecode(lua_State *L)
+{
+	size_t slen = 0;
+	const char *src = luaL_checklstring(L, 1, &slen);
+	luaL_Buffer b;
+	char *dst = luaL_buffinitsize(L, &b, slen / 2);
+	size_t n = util_unhex(src, slen, (uint8_t*)dst);
+	if (UTIL_ERROR == n) {
+		luaL_pushresultsize(&b, 0);
+		lua_pushnil(L);
+		return 1;
+	}
+	luaL_pushresultsize(&b, n);
+	return 1;
+}
+
+static int
+__util_b64encode(lua_State *L)
+{
+	size_t slen = 0;
+	const char *src = luaL_checklstring(L, 1, &slen);
+	luaL_Buffer b;
+	char *dst = luaL_buffinitsize(L, &b, (slen + 2) / 3 * 4);
+	luaL_pushresultsize(&b, util_base64_encode((const uint8_t*)src, slen, dst, lua_toboolean(L, 2)));
+	return 1;
+}
+
+static int
+__util_b64decode(lua_State *L)
+{
+	size_t slen = 0;
+	const char *src = luaL_checklstring(L, 1, &slen);
+	luaL_Buffer b;
+	char *dst = luaL_buffinitsize(L, &b, slen / 4 * 3 + 3);
+	size_t n = util_base64_decode(src, slen, (uint8_t*)dst, lua_toboolean(L, 2));
+	if (UTIL_ERROR == n) {
+		luaL_pushresultsize(&b, 0);
+		lua_pushnil(L);
+		return 1;
+	}
+	luaL_pushresultsize(&b, n);
+	return 1;
+}
+
 static int 
 __luaopen_util(lua_State *L)
 {
+	luaL_Reg m[] = {
+		{ "update", __util_hash_update },
+		{ "final", __util_hash_final },
+		{ "reset", __util_hash_reset },
+		{ nullptr, nullptr },
+	};
+	luaL_newmetatable(L, __HASH_METATABLE);
+	luaL_newlib(L, m);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
 	luaL_Reg r[] = {
 		{ "md5_data", __util_md5data },
 		{ "md5_file", __util_md5file },
+		{ "hash_data", __util_hashdata },
+		{ "hash_file", __util_hashfile },
+		{ "hasher", __util_hasher },
+		{ "hash_files", __util_hashfiles },
+		{ "url_encode", __util_urlencode },
+		{ "url_decode", __util_urldecode },
+		{ "hex_encode", __util_hexencode },
+		{ "hex_decode", __util_hexdecode },
+		{ "base64_encode", __util_b64encode },
+		{ "base64_decode", __util_b64decode },
 		{ nullptr, nullptr },
 	};
 	luaL_newlib(L, r);
@@ -413,11 +1246,37 @@ __luaopen_util(lua_State *L)
 
 void
 util_init(lua_State *L)
+{
+    // pool threads read the tables without a lock, they are filled once and never again.
+    std::call_once(__util_tables, [] { __util_crc32c_init(); __util_codec_init(); });
+    util_preload(L, "cjson", luaopen_cjson_safe);
+    util_preload(L, "cutil", __luaopen_util);
+}
+
+void
+util_require(lua_State *L)
 {
     luaL_requiref(L, "cjson", luaopen_cjson_safe, 0);
     luaL_requiref(L, "cutil", __luaopen_util, 0);
 }
 
+// registers a module in package.preload, it is opened by the first require.
+void
+util_preload(lua_State *L, const char *name, int (*open)(lua_State*))
+{
+    luaL_getsubtable(L, LUA_REGISTRYINDEX, "_PRELOAD");
+    lua_pushcfunction(L, open);
+    lua_setfield(L, -2, name);
+    lua_pop(L, 1);
+}
+
+void
+util_reload(lua_State *L)
+{
+    util_preload(L, "cjson", luaopen_cjson_safe);
+    util_preload(L, "cutil", __luaopen_util);
+}
+
 void
 util_fini(lua_State *L)
 {
@@ -2,18 +2,108 @@
 #define __PD_UTIL__
 
 #include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#define THREAD_LOCAL __declspec(thread)
+#else //_WIN32
+#define THREAD_LOCAL __thread
+#endif //_WIN32
+
+#define UTIL_DIGEST 16          // bytes of the longest digest util_hash_final gives
+#define UTIL_ERROR  ((size_t)-1) // what the decoders return for malformed input
 
 struct lua_State;
 
+enum {
+	UTIL_MD5 = 0,
+	UTIL_XXH64,
+	UTIL_CRC32C,
+};
+
+typedef struct {
+	uint64_t  bytes;
+	uint32_t  a, b, c, d;
+	uint8_t   buffer[64];
+} util_md5_t;
+
+typedef struct {
+	uint64_t  total;
+	uint64_t  v[4];
+	uint8_t   buffer[32];
+} util_xxh64_t;
+
+// a streaming hash, the state lives inline so it can be embedded anywhere.
+struct util_hash
+{
+	int _kind;
+	union {
+		util_md5_t   _md5;
+		util_xxh64_t _xxh;
+		uint32_t     _crc;
+	};
+};
+
 void
 util_init(lua_State *L);
 
-char*
-util_url_encode(const char *src, size_t slen, size_t *dlen);
+uint64_t
+util_clock(void);
+
+// the kind named "md5", "xxh64" or "crc32c", -1 for anything else.
+int
+util_hash_kind(const char *name, size_t nlen);
+
+void
+util_hash_init(util_hash *h, int kind);
+
+void
+util_hash_update(util_hash *h, const void *data, size_t dlen);
+
+// writes the digest to out, UTIL_DIGEST bytes at most, and returns its length.
+// xxh64 and crc32c digests are big endian, the way their reference tools print them.
+size_t
+util_hash_final(util_hash *h, uint8_t *out);
+
+// hashes a whole file through a mapping, or large reads where it cannot be mapped.
+// path is taken as is, 0 when the file cannot be read.
+int
+util_hash_file(const char *path, int kind, uint8_t *out, size_t *olen);
+
+// the codecs write into a buffer the caller owns and may reuse, and return the bytes written.
+// hex takes 2 * blen bytes, hex is lowercase.
+void
+util_hex(const uint8_t *bin, size_t blen, char *hex);
+
+// bin takes hlen / 2 bytes.
+size_t
+util_unhex(const char *hex, size_t hlen, uint8_t *bin);
+
+// dst takes 3 * slen bytes. form encoding by default, raw is rfc 3986 for signatures.
+size_t
+util_url_encode(const char *src, size_t slen, char *dst, int raw = 0);
 
+// in place, the result is never longer.
 size_t
 util_url_decode(char *src, size_t slen);
 
+// dst takes (slen + 2) / 3 * 4 bytes. url is the url safe alphabet without padding.
+size_t
+util_base64_encode(const uint8_t *src, size_t slen, char *dst, int url = 0);
+
+// dst takes slen / 4 * 3 + 3 bytes, padding is optional.
+size_t
+util_base64_decode(const char *src, size_t slen, uint8_t *dst, int url = 0);
+
+void
+util_require(lua_State *L);
+
+void
+util_preload(lua_State *L, const char *name, int (*open)(lua_State*));
+
+void
+util_reload(lua_State *L);
+
 void
 util_fini(lua_State *L);
 
@@ -0,0 +1,254 @@
+#include <wire.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <lua/lauxlib.h>
+#include <lua/lua.h>
+#include <lua/lualib.h>
+#ifdef __cplusplus
+} //extern "C"
+#endif //__cplusplus
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+// compact binary encoding of lua values, used wherever values cross a state or thread:
+//   tag byte, then varint (zigzag) integers, raw little endian doubles,
+//   varint length prefixed strings, and tables as key/value pairs closed by an end tag.
+enum {
+	_WIRE_NIL = 0,
+	_WIRE_FALSE,
+	_WIRE_TRUE,
+	_WIRE_INT,
+	_WIRE_NUM,
+	_WIRE_STR,
+	_WIRE_TAB,
+	_WIRE_END,
+};
+
+static inline void
+__wire_uint(std::string &out, uint64_t v)
+{
+	char b[10];
+	size_t n = 0;
+	while (v >= 0x80) {
+		b[n++] = (char)(v | 0x80);
+		v >>= 7;
+	}
+	b[n++] = (char)v;
+	out.append(b, n);
+}
+
+static inline int
+__wire_ruint(const char **p, const char *e, uint64_t *v)
+{
+	uint64_t r = 0;
+	for (int s = 0; *p < e && s < 64; s += 7) {
+		uint8_t c = (uint8_t)*(*p)++;
+		r |= (uint64_t)(c & 0x7f) << s;
+		if (0 == (c & 0x80)) {
+			*v = r;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int
+__wire_pack(lua_State *L, int idx, std::string &out, int depth)
+{
+	if (depth > WIRE_DEPTH) {
+		return 0;
+	}
+
+	switch (lua_type(L, idx)) {
+	case LUA_TNIL:
+		out.push_back((char)_WIRE_NIL);
+		break;
+	case LUA_TBOOLEAN:
+		out.push_back((char)(lua_toboolean(L, idx) ? _WIRE_TRUE : _WIRE_FALSE));
+		break;
+	case LUA_TNUMBER: {
+		lua_Number d = lua_tonumber(L, idx);
+		if (d >= -9007199254740992.0 && d <= 9007199254740992.0 && d == floor(d)) {
+			wire_int(out, (int64_t)d);
+		} else {
+			wire_num(out, (double)d);
+		}
+		break;
+	}
+	case LUA_TSTRING: {
+		size_t slen = 0;
+		const char *s = lua_tolstring(L, idx, &slen);
+		wire_str(out, s, slen);
+		break;
+	}
+	case LUA_TTABLE: {
+		if (!lua_checkstack(L, 3)) {
+			return 0;
+		}
+		idx = lua_absindex(L, idx);
+		out.push_back((char)_WIRE_TAB);
+		lua_pushnil(L);
+		while (lua_next(L, idx)) {
+			if (!__wire_pack(L, -2, out, depth + 1) || !__wire_pack(L, -1, out, depth + 1)) {
+				lua_pop(L, 2);
+				return 0;
+			}
+			lua_pop(L, 1);
+		}
+		out.push_back((char)_WIRE_END);
+		break;
+	}
+	default:
+		return 0;
+	}
+
+	return 1;
+}
+
+static int
+__wire_unpack(lua_State *L, const char **p, const char *e, int depth)
+{
+	if (*p >= e || depth > WIRE_DEPTH || !lua_checkstack(L, 3)) {
+		return 0;
+	}
+
+	uint64_t u = 0;
+	switch (*(*p)++) {
+	case _WIRE_NIL:
+		lua_pushnil(L);
+		break;
+	case _WIRE_FALSE:
+		lua_pushboolean(L, 0);
+		break;
+	case _WIRE_TRUE:
+		lua_pushboolean(L, 1);
+		break;
+	case _WIRE_INT:
+		if (!__wire_ruint(p, e, &u)) {
+			return 0;
+		}
+		lua_pushnumber(L, (lua_Number)(int64_t)((u >> 1) ^ (~(u & 1) + 1)));
+		break;
+	case _WIRE_NUM: {
+		double v = 0;
+		if (e - *p < (ptrdiff_t)sizeof(v)) {
+			return 0;
+		}
+		memcpy(&v, *p, sizeof(v)); *p += sizeof(v);
+		lua_pushnumber(L, (lua_Number)v);
+		break;
+	}
+	case _WIRE_STR:
+		if (!__wire_ruint(p, e, &u) || (uint64_t)(e - *p) < u) {
+			return 0;
+		}
+		lua_pushlstring(L, *p, (size_t)u); *p += u;
+		break;
+	case _WIRE_TAB:
+		lua_newtable(L);
+		while (*p < e && _WIRE_END != **p) {
+			if (!__wire_unpack(L, p, e, depth + 1)) {
+				lua_pop(L, 1);
+				return 0;
+			}
+			if (!__wire_unpack(L, p, e, depth + 1)) {
+				lua_pop(L, 2);
+				return 0;
+			}
+			if (lua_isnil(L, -2)) {
+				lua_pop(L, 2);
+			} else {
+				lua_rawset(L, -3);
+			}
+		}
+		if (*p >= e) {
+			lua_pop(L, 1);
+			return 0;
+		}
+		++(*p);
+		break;
+	default:
+		return 0;
+	}
+
+	return 1;
+}
+
+int
+wire_pack(lua_State *L, int idx, int n, std::string &out)
+{
+	idx = lua_absindex(L, idx);
+	for (int i = 0; i < n; ++i) {
+		if (!__wire_pack(L, idx + i, out, 0)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+int
+wire_unpack(lua_State *L, const char *data, size_t dlen)
+{
+	int n = 0;
+	const char *p = data, *e = data + dlen;
+	while (p < e) {
+		if (!__wire_unpack(L, &p, e, 0)) {
+			lua_pop(L, n);
+			return -1;
+		}
+		++n;
+	}
+
+	return n;
+}
+
+void
+wire_nil(std::string &out)
+{
+	out.push_back((char)_WIRE_NIL);
+}
+
+void
+wire_bool(std::string &out, int v)
+{
+	out.push_back((char)(v ? _WIRE_TRUE : _WIRE_FALSE));
+}
+
+void
+wire_int(std::string &out, int64_t v)
+{
+	out.push_back((char)_WIRE_INT);
+	__wire_uint(out, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+void
+wire_num(std::string &out, double v)
+{
+	out.push_back((char)_WIRE_NUM);
+	out.append((const char*)&v, sizeof(v));
+}
+
+void
+wire_str(std::string &out, const char *s, size_t slen)
+{
+	out.push_back((char)_WIRE_STR);
+	__wire_uint(out, slen);
+	out.append(s, slen);
+}
+
+void
+wire_table(std::string &out)
+{
+	out.push_back((char)_WIRE_TAB);
+}
+
+void
+wire_end(std::string &out)
+{
+	out.push_back((char)_WIRE_END);
+}
@@ -0,0 +1,41 @@
+#ifndef __PD_WIRE__
+#define __PD_WIRE__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#define WIRE_DEPTH 32
+
+struct lua_State;
+
+int
+wire_pack(lua_State *L, int idx, int n, std::string &out);
+
+int
+wire_unpack(lua_State *L, const char *data, size_t dlen);
+
+// encoders for code without a lua state, a table is wire_table, then its keys and values
+// in turn, then wire_end. strings may hold any bytes.
+void
+wire_nil(std::string &out);
+
+void
+wire_bool(std::string &out, int v);
+
+void
+wire_int(std::string &out, int64_t v);
+
+void
+wire_num(std::string &out, double v);
+
+void
+wire_str(std::string &out, const char *s, size_t slen);
+
+void
+wire_table(std::string &out);
+
+void
+wire_end(std::string &out);
+
+#endif // __PD_WIRE__
@@ -0,0 +1,295 @@
+#include <work.h>
+#include <pool.h>
+#include <wire.h>
+#include <loop.h>
+#include <file.h>
+#include <util.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include <lua/lauxlib.h>
+#include <lua/lua.h>
+#include <lua/lualib.h>
+#ifdef __cplusplus
+} //extern "C"
+#endif //__cplusplus
+
+#include <string.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+const char __LUA_WORKER[] =
+"cjson = require('cjson')\n"
+"cutil = require('cutil')\n"
+"cfile = require('cfile')\n"
+"package.path = HOME .. '?.lua'\n";
+
+struct work_state
+{
+	lua_State *_L;
+	size_t     _gen;
+
+	work_state(void) : _L(nullptr), _gen(0)
+	{
+	}
+};
+
+struct work_data
+{
+	char   _home[PATH_SIZE];
+	size_t _hlen;
+	std::vector<work_state> _states;
+	std::atomic<size_t>     _gen;
+
+	work_data(void) : _hlen(0), _gen(0)
+	{
+		this->_home[0] = '\0';
+	}
+
+	~work_data(void)
+	{
+		for (auto &it : this->_states) {
+			if (nullptr != it._L) {
+				lua_close(it._L);
+			}
+		}
+	}
+};
+
+static work_data *_W = nullptr;
+
+struct work_job
+{
+	std::string _name;
+	std::string _args;
+	std::string _rets;
+	bool        _ok;
+	int         _lfun;
+
+	work_job(void) : _ok(false), _lfun(LUA_NOREF)
+	{
+	}
+};
+
+static int
+__work_print(lua_State *L)
+{
+	int n = lua_gettop(L);
+	for (int i = 1; i <= n; ++i) {
+		const char *z = lua_tostring(L, i);
+		LOGD("work-print\t%s", nullptr != z ? z : lua_typename(L, lua_type(L, i)));
+	}
+
+	return 0;
+}
+
+static lua_State*
+__work_state(int idx)
+{
+	work_state &ws = _W->_states[idx];
+
+	// states booted before a reload still run the old scripts.
+	size_t gen = _W->_gen.load();
+	if (nullptr != ws._L && gen != ws._gen) {
+		lua_close(ws._L); ws._L = nullptr;
+	}
+
+	if (nullptr == ws._L) {
+		lua_State *L = luaL_newstate();
+		luaL_openlibs(L);
+		lua_register(L, "print", __work_print);
+		lua_pushlstring(L, _W->_home, _W->_hlen);
+		lua_setglobal(L, "HOME");
+
+		util_require(L);
+		file_require(L);
+		lua_settop(L, 0);
+
+		if (LUA_OK != luaL_loadbufferx(L, __LUA_WORKER, sizeof(__LUA_WORKER) - 1, "work_boot", "t") || LUA_OK != lua_pcall(L, 0, 0, 0)) {
+			LOGE("work-boot\t%s", lua_tostring(L, -1));
+		}
+		lua_settop(L, 0);
+
+		ws._L = L;
+		ws._gen = gen;
+	}
+
+	return ws._L;
+}
+
+static int
+__work_error(lua_State *L)
+{
+	luaL_traceback(L, L, lua_tostring(L, 1), 1);
+	return 1;
+}
+
+// resolves "fun" as a global and "mod.fun" as require(mod).fun
+static int
+__work_resolve(lua_State *L, const std::string &name)
+{
+	size_t dot = name.rfind('.');
+	if (std::string::npos == dot) {
+		lua_getglobal(L, name.c_str());
+	} else {
+		lua_getglobal(L, "require");
+		lua_pushlstring(L, name.data(), dot);
+		if (LUA_OK != lua_pcall(L, 1, 1, 0)) {
+			return 0;
+		}
+		if (!lua_istable(L, -1)) {
+			lua_pop(L, 1);
+			lua_pushfstring(L, "module %s not found", name.substr(0, dot).c_str());
+			return 0;
+		}
+		lua_getfield(L, -1, name.c_str() + dot + 1);
+		lua_remove(L, -2);
+	}
+
+	if (!lua_isfunction(L, -1)) {
+		lua_pop(L, 1);
+		lua_pushfstring(L, "function %s not found", name.c_str());
+		return 0;
+	}
+
+	return 1;
+}
+
+static void
+__work_run(int idx, work_job *job)
+{
+	lua_State *L = __work_state(idx);
+	lua_settop(L, 0);
+	lua_pushcfunction(L, __work_error);
+
+	do {
+		if (!__work_resolve(L, job->_name)) {
+			break;
+		}
+
+		int n = wire_unpack(L, job->_args.data(), job->_args.size());
+		if (n < 0) {
+			lua_pop(L, 1);
+			lua_pushliteral(L, "bad arguments");
+			break;
+		}
+
+		if (LUA_OK != lua_pcall(L, n, LUA_MULTRET, 1)) {
+			break;
+		}
+
+		job->_ok = 0 != wire_pack(L, 2, lua_gettop(L) - 1, job->_rets);
+		if (!job->_ok) {
+			job->_rets.clear();
+			lua_settop(L, 1);
+			lua_pushliteral(L, "bad results");
+		}
+	} while (false);
+
+	if (!job->_ok) {
+		LOGW("work-call\t%s\t%s", job->_name.c_str(), lua_tostring(L, -1));
+		wire_pack(L, -1, 1, job->_rets);
+	}
+
+	lua_settop(L, 0);
+	lua_gc(L, LUA_GCSTEP, 0);
+}
+
+static void
+__work_done(lua_State *L, work_job *job)
+{
+	if (LUA_NOREF == job->_lfun) {
+		return;
+	}
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, job->_lfun);
+	luaL_unref(L, LUA_REGISTRYINDEX, job->_lfun);
+	job->_lfun = LUA_NOREF;
+
+	lua_pushboolean(L, job->_ok ? 1 : 0);
+	int n = wire_unpack(L, job->_rets.data(), job->_rets.size());
+	loop_call(L, 1 + (n > 0 ? n : 0), 0);
+}
+
+static int
+__l2c_call(lua_State *L)
+{
+	size_t nlen = 0;
+	const char *name = luaL_checklstring(L, 1, &nlen);
+
+	std::shared_ptr<work_job> job(new work_job());
+	job->_name.assign(name, nlen);
+	if (!wire_pack(L, 3, lua_gettop(L) - 2, job->_args)) {
+		return luaL_argerror(L, 3, "unsupported argument type");
+	}
+
+	if (lua_isfunction(L, 2)) {
+		lua_pushvalue(L, 2);
+		job->_lfun = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+
+	int ret = pool_push(
+		[job](int idx) { __work_run(idx, job.get()); },
+		[job](lua_State *L) { __work_done(L, job.get()); });
+
+	lua_pushboolean(L, ret);
+	return 1;
+}
+
+static int
+__l2c_size(lua_State *L)
+{
+	lua_pushinteger(L, (lua_Integer)pool_size());
+	return 1;
+}
+
+static int
+__luaopen_work(lua_State *L)
+{
+	luaL_Reg r[] = {
+		{ "call", __l2c_call },
+		{ "size", __l2c_size },
+		{ nullptr, nullptr },
+	};
+	luaL_newlib(L, r);
+	return 1;
+}
+
+void
+work_init(lua_State *L, const char *home, size_t hlen)
+{
+	if (nullptr == _W) {
+		_W = new work_data();
+		if (nullptr != home && hlen < sizeof(_W->_home)) {
+			memcpy(_W->_home, home, hlen); _W->_home[hlen] = '\0';
+			_W->_hlen = hlen;
+		}
+		_W->_states.resize(pool_size());
+	}
+
+	luaL_requiref(L, "cwork", __luaopen_work, 0);
+}
+
+void
+work_reload(lua_State *L)
+{
+	if (nullptr == _W) {
+		return;
+	}
+
+	++_W->_gen;
+	luaL_requiref(L, "cwork", __luaopen_work, 0);
+}
+
+void
+work_fini(lua_State *L)
+{
+	if (nullptr == _W) {
+		return;
+	}
+
+	delete _W; _W = nullptr;
+}
@@ -0,0 +1,17 @@
+#ifndef __PD_WORK__
+#define __PD_WORK__
+
+#include <stddef.h>
+
+struct lua_State;
+
+void
+work_init(lua_State *L, const char *home, size_t hlen);
+
+void
+work_reload(lua_State *L);
+
+void
+work_fini(lua_State *L);
+
+#endif // __PD_WORK__
@@ -1,6 +1,8 @@
 #include <bind.h>
 #include <loop.h>
 #include <file.h>
+#include <pack.h>
+#include <wire.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -22,41 +24,97 @@ struct bind_data
 	unsigned int _tick;
 	unsigned int _quit;
 	unsigned int _restart;
+	unsigned int _reload;
 
-	bind_data() : _tick(10), _quit(0), _restart(0)
+	bind_data() : _tick(10), _quit(0), _restart(0), _reload(0)
 	{
 	}
 };
 
 static bind_data *_B = nullptr;
 
+static std::map<std::string, std::string> __tmp_values;
+
+static void
+__bind_field(std::string &out, const char *key, const char *val)
+{
+	wire_str(out, key, strlen(key));
+	wire_str(out, val, strlen(val));
+}
+
+// devinfo and pkginfo reach lua as tables, decoded once per state.
+static int
+__bind_devinfo(const char *args, size_t alen, std::string &out)
+{
+	wire_table(out);
+	__bind_field(out, "id", "pc-test");
+	wire_end(out);
+	return 1;
+}
+
+static int
+__bind_pkginfo(const char *args, size_t alen, std::string &out)
+{
+	wire_table(out);
+	wire_str(out, "version", sizeof("version") - 1); wire_int(out, 1);
+	wire_str(out, "config", sizeof("config") - 1);
+	wire_table(out);
+	__bind_field(out, "server_url", "http://server.thedawens.net:8080/do");
+	__bind_field(out, "static_url", "http://static.thedawens.net:8080/");
+	__bind_field(out, "auth_token", "auth_token.txt");
+	wire_end(out);
+	wire_end(out);
+	return 1;
+}
+
+static int
+__bind_get_tmpvalue(const char *data, const char *sign, lua_State *L)
+{
+	std::string val = __tmp_values[std::string(data)];
+	lua_pushstring(L, val.data());
+	return 1;
+}
+
+static int
+__bind_set_tmpvalue(const char *data, const char *sign, lua_State *L)
+{
+	__tmp_values[std::string(data)] = std::string(sign);
+	return 0;
+}
+
+static int
+__bind_set_tick(const char *data, const char *sign, lua_State *L)
+{
+	_B->_tick = atoi(data);
+	return 0;
+}
+
+static int
+__bind_restart(const char *data, const char *sign, lua_State *L)
+{
+	_B->_restart = (nullptr == data ? 1 : atoi(data));
+	return 0;
+}
+
+static int
+__bind_reload(const char *data, const char *sign, lua_State *L)
+{
+	_B->_reload = 1;
+	return 0;
+}
+
+static int
+__bind_exit(const char *data, const char *sign, lua_State *L)
+{
+	_B->_quit = 1;
+	return 0;
+}
+
+// only types nobody registered a handler for end up here.
 int
 bind_call(const char *type, const char *data, const char *sign, lua_State *L)
 {
-	static std::map<std::string, std::string> tmp_values;
-
-	int ret = 0;
-	if (0 == strcmp(type, "data.get_devinfo")) {
-		lua_pushstring(L, "{\"id\":\"pc-test\"}");
-		ret = 1;
-	} else if (0 == strcmp(type, "data.get_pkginfo")) {
-		lua_pushstring(L, "{\"version\":1, \"config\":{\"server_url\":\"http://server.thedawens.net:8080/do\", \"static_url\":\"http://static.thedawens.net:8080/\", \"auth_token\":\"auth_token.txt\"}}");
-		ret = 1;
-	} else if (0 == strcmp(type, "data.get_tmpvalue")) {
-		std::string val = tmp_values[std::string(data)];
-		lua_pushstring(L, val.data());
-		ret = 1;
-	} else if (0 == strcmp(type, "data.set_tmpvalue")) {
-		tmp_values[std::string(data)] = std::string(sign);
-	} else if (0 == strcmp(type, "loop.set_tick")) {
-		_B->_tick = atoi(data);
-	} else if (0 == strcmp(type, "loop.restart")) {
-		_B->_restart = (nullptr == data ? 1 : atoi(data));
-	} else if (0 == strcmp(type, "loop.exit")) {
-		_B->_quit = 1;
-	}
-
-	return ret;
+	return 0;
 }
 
 int
@@ -71,23 +129,23 @@ bind_read(const char *path, size_t plen, lua_State *L)
 		return 0;
 	}
 
-	char *data = nullptr;
-	::fseek(asset, 0, SEEK_END);
-	size_t size = ::ftell(asset);
-	::fseek(asset, 0, SEEK_SET);
-	if (size > 0) {
-		data = new char[size];
-		if (size != ::fread(data, 1, size, asset)) {
-			size = 0;
-		}
+	// ftell gives -1 on failure, which would be a huge size for the buffer below.
+	long fsize = (0 == ::fseek(asset, 0, SEEK_END)) ? ::ftell(asset) : -1;
+	if (fsize < 0 || 0 != ::fseek(asset, 0, SEEK_SET)) {
+		::fclose(asset);
+		return 0;
 	}
+	size_t size = (size_t)fsize;
 
-	lua_pushlstring(L, data, size);
+	// read straight into the lua buffer, the string is built without another copy.
+	luaL_Buffer b;
+	char *data = luaL_buffinitsize(L, &b, size);
+	if (size != ::fread(data, 1, size, asset)) {
+		size = 0;
+	}
+	luaL_pushresultsize(&b, size);
 
 	::fclose(asset);
-	if (nullptr != data) {
-		delete[] data;
-	}
 
 	return 1;
 }
@@ -95,6 +153,18 @@ bind_read(const char *path, size_t plen, lua_State *L)
 int
 main(void)
 {
+	// assets come from the pack when one was built, loose files under ../assets/ are the fallback.
+	pack_open("../assets.pak");
+
+	bind_register_wire("data.get_devinfo", __bind_devinfo, BIND_CONST);
+	bind_register_wire("data.get_pkginfo", __bind_pkginfo, BIND_CONST);
+	bind_register("data.get_tmpvalue", __bind_get_tmpvalue);
+	bind_register("data.set_tmpvalue", __bind_set_tmpvalue);
+	bind_register("loop.set_tick", __bind_set_tick);
+	bind_register("loop.restart", __bind_restart);
+	bind_register("loop.reload", __bind_reload);
+	bind_register("loop.exit", __bind_exit);
+
 	while (true) {
 		//_CrtSetBreakAlloc(1553);
 		_CrtSetDbgFlag(_CrtSetDbgFlag(_CRTDBG_REPORT_FLAG) | _CRTDBG_LEAK_CHECK_DF);
@@ -104,6 +174,10 @@ main(void)
 
 		while (0 == _B->_quit && 0 == _B->_restart) {
 			loop_update();
+			if (_B->_reload > 0) {
+				_B->_reload = 0;
+				loop_reload();
+			}
 			::Sleep(_B->_tick);
 		}
 
@@ -124,5 +198,7 @@ main(void)
 		delete _B; _B = nullptr;
 	}
 
+	pack_close();
+
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,176 @@
+// renders a binary log (see core/logfmt.h) as the text lines the client would have written:
+//   logdump <yyyymmdd.bin> [...]
+// c++ -std=c++11 -I../core -o logdump logdump.cc
+
+#include <logfmt.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+struct dump_site
+{
+	std::string _file;
+	uint64_t    _line;
+	std::string _fmt;
+};
+
+static int
+__dump_str(const char **p, const char *e, std::string &s)
+{
+	uint64_t slen = 0;
+	if (!logfmt_ruint(p, e, &slen) || slen > (uint64_t)(e - *p)) {
+		return 0;
+	}
+	s.assign(*p, (size_t)slen);
+	*p += slen;
+	return 1;
+}
+
+static int
+__dump_u64(const char **p, const char *e, uint64_t *v)
+{
+	if (e - *p < 8) {
+		return 0;
+	}
+	*v = 0;
+	for (int i = 0; i < 8; ++i) {
+		*v |= (uint64_t)(uint8_t)(*p)[i] << (i * 8);
+	}
+	*p += 8;
+	return 1;
+}
+
+static void
+__dump_head(std::string &line, int lv, uint64_t usec, int64_t off)
+{
+	static const char lvs[] = { 'D', 'I', 'W', 'E', 'F' };
+	char stamp[16];
+	time_t sec = (time_t)(usec / 1000000 + off);
+	struct tm tm;
+#ifdef _WIN32
+	gmtime_s(&tm, &sec);
+#else //_WIN32
+	gmtime_r(&sec, &tm);
+#endif //_WIN32
+	strftime(stamp, sizeof(stamp), "%Y%m%d%H%M%S", &tm);
+
+	line.push_back(lv >= 0 && lv < (int)sizeof(lvs) ? lvs[lv] : '?');
+	line.push_back(' ');
+	line.append(stamp);
+	line.push_back(' ');
+}
+
+static int
+__dump(const char *path)
+{
+	FILE *file = fopen(path, "rb");
+	if (nullptr == file) {
+		fprintf(stderr, "logdump: cannot open %s\n", path);
+		return 0;
+	}
+	std::string data;
+	char temp[1 << 16];
+	size_t n = 0;
+	while (0 < (n = fread(temp, 1, sizeof(temp), file))) {
+		data.append(temp, n);
+	}
+	fclose(file);
+
+	if (data.size() < 5 || 0 != memcmp(data.data(), LOGBIN_MAGIC, 4) || LOGBIN_VERSION != data[4]) {
+		fprintf(stderr, "logdump: %s is not a binary log\n", path);
+		return 0;
+	}
+
+	const char *p = data.data() + 5, *e = data.data() + data.size();
+	std::vector<dump_site> sites;
+	uint64_t now = 0;
+	int64_t off = 0;
+	std::string line, args;
+	while (p < e) {
+		char type = *p++;
+		uint64_t id = 0, dt = 0;
+		line.clear();
+
+		bool ok = true;
+		switch (type) {
+		case 'S': {
+			ok = __dump_u64(&p, e, &now) && logfmt_rint(&p, e, &off);
+			sites.clear();
+			break;
+		}
+		case 'A': {
+			ok = 0 != __dump_u64(&p, e, &now);
+			break;
+		}
+		case 'D': {
+			dump_site site;
+			ok = logfmt_ruint(&p, e, &id) && logfmt_ruint(&p, e, &site._line) && __dump_str(&p, e, site._file) && __dump_str(&p, e, site._fmt);
+			if (ok) {
+				if (id >= sites.size()) sites.resize((size_t)id + 1);
+				sites[(size_t)id] = site;
+			}
+			break;
+		}
+		case 'L': {
+			if (!logfmt_ruint(&p, e, &id) || p >= e) { ok = false; break; }
+			int lv = (uint8_t)*p++;
+			ok = logfmt_ruint(&p, e, &dt) && __dump_str(&p, e, args);
+			if (!ok) break;
+			now += dt;
+			__dump_head(line, lv, now, off);
+			line.append("C ");
+			if (id < sites.size()) {
+				logfmt_render(sites[(size_t)id]._fmt.c_str(), args.data(), args.size(), line);
+			} else {
+				line.append("<unknown site>");
+			}
+			line.push_back('\n');
+			fwrite(line.data(), 1, line.size(), stdout);
+			break;
+		}
+		case 'T': {
+			if (p >= e) { ok = false; break; }
+			int lv = (uint8_t)*p++;
+			ok = logfmt_ruint(&p, e, &dt) && __dump_str(&p, e, args);
+			if (!ok) break;
+			now += dt;
+			__dump_head(line, lv, now, off);
+			line.append(args).push_back('\n');
+			fwrite(line.data(), 1, line.size(), stdout);
+			break;
+		}
+		default:
+			ok = false;
+			break;
+		}
+
+		// a torn tail, from a crash mid write, ends the file.
+		if (!ok) {
+			fprintf(stderr, "logdump: %s is cut at offset %u\n", path, (unsigned int)(p - data.data()));
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage: logdump <log.bin> [...]\n");
+		return 1;
+	}
+
+	int ret = 0;
+	for (int i = 1; i < argc; ++i) {
+		if (!__dump(argv[i])) {
+			ret = 1;
+		}
+	}
+	return ret;
+}
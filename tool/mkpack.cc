@@ -0,0 +1,158 @@
+// builds an asset pack (see core/pack.h) from a directory tree:
+//   mkpack <assets-dir> <out.pak>
+// c++ -std=c++11 -I../core -o mkpack mkpack.cc
+
+#include <pack.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#ifdef _WIN32
+#include <io.h>
+#else //_WIN32
+#include <dirent.h>
+#include <sys/stat.h>
+#endif //_WIN32
+
+struct pack_file
+{
+	std::string _name;
+	std::string _path;
+	uint64_t    _size;
+};
+
+static void
+__pack_walk(const std::string &root, const std::string &rel, std::vector<pack_file> &files)
+{
+	std::string dir = rel.empty() ? root : root + "/" + rel;
+#ifdef _WIN32
+	struct _finddata_t fd;
+	intptr_t fh = ::_findfirst((dir + "/*").c_str(), &fd);
+	if (-1 == fh) {
+		return;
+	}
+	do {
+		if (0 == strcmp(".", fd.name) || 0 == strcmp("..", fd.name)) {
+			continue;
+		}
+		std::string name = rel.empty() ? fd.name : rel + "/" + fd.name;
+		if (fd.attrib & _A_SUBDIR) {
+			__pack_walk(root, name, files);
+		} else {
+			pack_file f = { name, root + "/" + name, (uint64_t)fd.size };
+			files.push_back(f);
+		}
+	} while (0 == ::_findnext(fh, &fd));
+	::_findclose(fh);
+#else //_WIN32
+	DIR *dp = ::opendir(dir.c_str());
+	if (nullptr == dp) {
+		return;
+	}
+	dirent *ep;
+	while (nullptr != (ep = ::readdir(dp))) {
+		if (0 == strcmp(".", ep->d_name) || 0 == strcmp("..", ep->d_name)) {
+			continue;
+		}
+		std::string name = rel.empty() ? ep->d_name : rel + "/" + ep->d_name;
+		std::string path = root + "/" + name;
+		struct stat st;
+		if (0 != ::stat(path.c_str(), &st)) {
+			continue;
+		}
+		if (S_ISDIR(st.st_mode)) {
+			__pack_walk(root, name, files);
+		} else if (S_ISREG(st.st_mode)) {
+			pack_file f = { name, path, (uint64_t)st.st_size };
+			files.push_back(f);
+		}
+	}
+	::closedir(dp);
+#endif //_WIN32
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s <assets-dir> <out.pak>\n", argv[0]);
+		return 1;
+	}
+
+	std::vector<pack_file> files;
+	__pack_walk(argv[1], "", files);
+	std::sort(files.begin(), files.end(), [](const pack_file &a, const pack_file &b) { return a._name < b._name; });
+
+	pack_head head;
+	memcpy(head._magic, PACK_MAGIC, sizeof(head._magic));
+	head._version = PACK_VERSION;
+	head._count = (uint32_t)files.size();
+	head._flags = 0;
+
+	std::vector<pack_item> items(files.size());
+	uint64_t off = sizeof(head) + sizeof(pack_item) * files.size();
+	for (size_t i = 0; i < files.size(); ++i) {
+		items[i]._noff = (uint32_t)off;
+		items[i]._nlen = (uint32_t)files[i]._name.size();
+		off += files[i]._name.size();
+	}
+	// blobs are aligned so a mapped asset can be read with any access width.
+	for (size_t i = 0; i < files.size(); ++i) {
+		off = (off + 15) & ~(uint64_t)15;
+		items[i]._doff = off;
+		items[i]._size = files[i]._size;
+		items[i]._flags = 0;
+		items[i]._rsvd = 0;
+		off += files[i]._size;
+	}
+
+	FILE *out = ::fopen(argv[2], "wb");
+	if (nullptr == out) {
+		fprintf(stderr, "cannot open %s\n", argv[2]);
+		return 1;
+	}
+
+	::fwrite(&head, sizeof(head), 1, out);
+	if (!items.empty()) {
+		::fwrite(items.data(), sizeof(pack_item), items.size(), out);
+	}
+	uint64_t pos = sizeof(head) + sizeof(pack_item) * files.size();
+	for (auto &f : files) {
+		::fwrite(f._name.data(), 1, f._name.size(), out);
+		pos += f._name.size();
+	}
+
+	std::vector<char> temp(1 << 16);
+	for (size_t i = 0; i < files.size(); ++i) {
+		static const char zero[16] = { 0 };
+		::fwrite(zero, 1, (size_t)(items[i]._doff - pos), out);
+		pos = items[i]._doff;
+
+		FILE *in = ::fopen(files[i]._path.c_str(), "rb");
+		uint64_t left = files[i]._size;
+		while (nullptr != in && left > 0) {
+			size_t n = ::fread(temp.data(), 1, left < temp.size() ? (size_t)left : temp.size(), in);
+			if (0 == n) {
+				break;
+			}
+			::fwrite(temp.data(), 1, n, out);
+			left -= n;
+		}
+		if (nullptr != in) {
+			::fclose(in);
+		}
+		if (left > 0) {
+			fprintf(stderr, "short read %s\n", files[i]._path.c_str());
+			::fclose(out);
+			return 1;
+		}
+		pos += files[i]._size;
+	}
+
+	::fclose(out);
+	printf("%u assets, %llu bytes\n", head._count, (unsigned long long)pos);
+	return 0;
+}